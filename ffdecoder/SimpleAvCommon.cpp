@@ -1,11 +1,116 @@
 ﻿#include "SimpleAvCommon.h"
 #include "libavutil/pixdesc.h"
 #include "libavutil/avutil.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 ///////////// packet_queue section {{{
 
 /* packet queue handling */
 
+MyAVPacketListNode* PacketNodePool::alloc_node()
+{
+    MyAVPacketListNode* node = this->free_nodes;
+    if (node) {
+        this->free_nodes = node->next;
+        this->nb_free_nodes--;
+        this->hits++;
+        return node;
+    }
+
+    this->misses++;
+    return (MyAVPacketListNode*)av_malloc(sizeof(MyAVPacketListNode));
+}
+
+void PacketNodePool::recycle_node(MyAVPacketListNode* node)
+{
+    node->next = this->free_nodes;
+    this->free_nodes = node;
+    this->nb_free_nodes++;
+}
+
+void PacketNodePool::release_all()
+{
+    MyAVPacketListNode* node, * next;
+    for (node = this->free_nodes; node; node = next) {
+        next = node->next;
+        av_free(node);
+    }
+    this->free_nodes = NULL;
+    this->nb_free_nodes = 0;
+}
+
+void WakeupSignal::notify()
+{
+    this->epoch++;
+    if (!this->waiters.load())
+        return;
+
+    AutoLocker _yes_locked(this->cond);
+    this->cond.wake(WAKE_ALL);
+}
+
+int WakeupSignal::wait(unsigned seen_epoch, unsigned int timeout_ms)
+{
+    int64_t deadline = av_gettime_relative() + (int64_t)timeout_ms * 1000;
+    int ret = 0;
+
+    AutoLocker _yes_locked(this->cond);
+    this->waiters++;
+    while (this->epoch.load() == seen_epoch) {
+        int64_t left = deadline - av_gettime_relative();
+        if (left <= 0) {
+            ret = 1;
+            break;
+        }
+        this->cond.timed_wait_ms((unsigned int)((left + 999) / 1000));
+    }
+    this->waiters--;
+
+    return ret;
+}
+
 AVPacket PacketQueue::flush_pkt;
+int PacketQueue::default_impl = PQ_IMPL_LINKED_LIST;
+
+PacketQueue::PacketQueue(int impl)
+{
+    first_pkt = NULL;
+    last_pkt = NULL;
+    nb_packets = 0;
+    size = 0;
+    total_duration = 0;
+    serial = 0;
+    abort_request = 1;
+
+    this->space_signal = NULL;
+    this->consumer_task = NULL;
+
+    overflow_max_bytes = 0;
+    overflow_max_duration = 0;
+    overflow_drops = 0;
+    overflow_dropped_pkts = 0;
+
+    this->impl = impl;
+    this->ring = NULL;
+    if (PQ_IMPL_SPSC_RING == impl) {
+        this->ring = new(std::nothrow) PacketRing;
+        if (!this->ring) {
+            av_log(NULL, AV_LOG_WARNING, "failed to alloc packet ring, fallback to linked list.\n");
+            this->impl = PQ_IMPL_LINKED_LIST;
+        }
+    }
+}
+
+PacketQueue::~PacketQueue()
+{
+    if (this->ring) {
+        ring_flush();
+        delete this->ring;
+        this->ring = NULL;
+    }
+}
 
 int PacketQueue::is_flush_pkt(const AVPacket& to_check)
 {
@@ -24,17 +129,18 @@ int PacketQueue::packet_queue_put_private(AVPacket* pkt)
     if (this->abort_request)
         return -1;
 
-    pkt1 = (MyAVPacketListNode*)av_malloc(sizeof(MyAVPacketListNode));
+    pkt1 = this->node_pool.alloc_node();
     if (!pkt1)
         return -1;
 
     pkt1->pkt = *pkt;   // 要点, ‘pkt’ 已经被 clone 进 MyAVPacketList， 因此无所谓‘pkt’是来自heap/stack/global
     pkt1->next = NULL;
-    if (pkt == &flush_pkt)
+    if (is_flush_pkt(*pkt))
         this->serial++;
 
     pkt1->serial = this->serial;
 
+    int was_empty = !this->first_pkt;
     if (!this->last_pkt)
         this->first_pkt = pkt1;
     else
@@ -48,25 +154,141 @@ int PacketQueue::packet_queue_put_private(AVPacket* pkt)
     this->total_duration += pkt1->pkt.duration;
     /* XXX: should duplicate packet data in DV case */
 
-    this->cond.wake();
+    if (was_empty)  // consumer sleeps only on empty queue
+        this->cond.wake();
+
+    return 0;
+}
+
+void PacketQueue::set_overflow_policy(int max_bytes, int64_t max_duration)
+{
+    this->overflow_max_bytes = max_bytes;
+    this->overflow_max_duration = max_duration;
+}
+
+int64_t PacketQueue::oldest_pts()
+{
+    if (this->ring) {
+        PacketRing* r = this->ring;
+        unsigned t = r->tail.load(std::memory_order_relaxed);
+        // slots in [head, tail) are not rewritten by anyone but us, the consumer only reads them
+        for (unsigned h = r->head.load(); h != t; h++) {
+            int64_t pts = r->slots[h & (PACKET_RING_SIZE - 1)].pkt.pts;
+            if (pts != AV_NOPTS_VALUE)
+                return pts;
+        }
+        return AV_NOPTS_VALUE;
+    }
+
+    AutoLocker _yes_locked(this->cond);
+    for (MyAVPacketListNode* node = this->first_pkt; node; node = node->next) {
+        if (node->pkt.pts != AV_NOPTS_VALUE)
+            return node->pkt.pts;
+    }
+    return AV_NOPTS_VALUE;
+}
+
+int PacketQueue::is_overflowed(const AVPacket* incoming)
+{
+    if (!this->overflow_max_bytes && !this->overflow_max_duration)
+        return 0;
+
+    if (!(incoming->flags & AV_PKT_FLAG_KEY) || is_flush_pkt(*incoming) || is_null_pkt(*incoming))
+        return 0;   // only a keyframe could be the new start point
+
+    if (this->overflow_max_bytes && this->size > this->overflow_max_bytes)
+        return 1;
+
+    if (this->overflow_max_duration) {
+        if (this->total_duration)
+            return this->total_duration > this->overflow_max_duration;
+
+        // pkt.duration not available (e.g. raw ES), see how far pts goes
+        int64_t oldest = incoming->pts != AV_NOPTS_VALUE ? oldest_pts() : AV_NOPTS_VALUE;
+        if (oldest != AV_NOPTS_VALUE && incoming->pts - oldest > this->overflow_max_duration)
+            return 1;
+    }
 
     return 0;
 }
 
+void PacketQueue::drop_for_overflow()
+{
+    int dropped = this->nb_packets;
+
+    packet_queue_flush();
+    packet_queue_put(&flush_pkt);   // serial++, decoder restarts from the coming keyframe
+
+    this->overflow_drops++;
+    this->overflow_dropped_pkts += dropped;
+    av_log(NULL, AV_LOG_WARNING, "packet queue overflowed, dropped %d packets (%" PRId64 " times so far)\n"
+        , dropped, this->overflow_drops);
+}
+
 // 接管pkt生命周期，put失败也释放掉
 int PacketQueue::packet_queue_put(AVPacket* pkt)
 {
     int ret;
 
-    AutoLocker _yes_locked(this->cond);
-    ret = packet_queue_put_private(pkt);
+    if (is_overflowed(pkt))
+        drop_for_overflow();
+
+    if (this->ring) {
+        ret = ring_put(pkt);
+        if (pkt != &flush_pkt && ret < 0)
+            av_packet_unref(pkt);
+    }
+    else {
+        AutoLocker _yes_locked(this->cond);
+        ret = packet_queue_put_private(pkt);
 
-    if (pkt != &flush_pkt && ret < 0)
-        av_packet_unref(pkt);
+        if (pkt != &flush_pkt && ret < 0)
+            av_packet_unref(pkt);
+    }
 
+    if (ret >= 0 && this->consumer_task)
+        DecodePool::schedule(this->consumer_task);
     return ret;
 }
 
+// 接管所有pkts生命周期，put失败的也释放掉
+int PacketQueue::packet_queue_put_many(AVPacket* pkts, int nb)
+{
+    int i, ret = 0;
+
+    if (this->overflow_max_bytes || this->overflow_max_duration) {
+        for (i = 0; i < nb; i++) {
+            if (ret >= 0)
+                ret = packet_queue_put(&pkts[i]);
+            else if (!is_flush_pkt(pkts[i]))
+                av_packet_unref(&pkts[i]);
+        }
+        return ret < 0 ? ret : nb;
+    }
+
+    if (this->ring) {
+        for (i = 0; i < nb; i++) {
+            if (ret >= 0)
+                ret = ring_put(&pkts[i]);
+            if (ret < 0 && !is_flush_pkt(pkts[i]))
+                av_packet_unref(&pkts[i]);
+        }
+    }
+    else {
+        AutoLocker _yes_locked(this->cond);
+        for (i = 0; i < nb; i++) {
+            if (ret >= 0)
+                ret = packet_queue_put_private(&pkts[i]);   // wakes consumer only for the 1st pkt into an empty queue
+            if (ret < 0 && !is_flush_pkt(pkts[i]))
+                av_packet_unref(&pkts[i]);
+        }
+    }
+
+    if (nb > 0 && this->consumer_task)
+        DecodePool::schedule(this->consumer_task);
+    return ret < 0 ? ret : nb;
+}
+
 int PacketQueue::packet_queue_put_nullpacket(int stream_index)
 {
     AVPacket pkt1, * pkt = &pkt1;
@@ -82,30 +304,45 @@ void PacketQueue::packet_queue_flush()
 {
     MyAVPacketListNode* pkt, * pkt1;
 
+    if (this->ring) {
+        ring_flush();
+        return;
+    }
+
     AutoLocker _yes_locked(this->cond);
 
     for (pkt = this->first_pkt; pkt; pkt = pkt1) {
         pkt1 = pkt->next;
         av_packet_unref(&pkt->pkt);
-        av_freep(&pkt);
+        this->node_pool.recycle_node(pkt);
     }
     this->last_pkt = NULL;
     this->first_pkt = NULL;
     this->nb_packets = 0;
     this->size = 0;
     this->total_duration = 0;
+
+    if (this->space_signal)
+        this->space_signal->notify();
 }
 
 void PacketQueue::packet_queue_destroy()
 {
     packet_queue_flush();
+
+    AutoLocker _yes_locked(this->cond);
+    av_log(NULL, AV_LOG_VERBOSE, "packet node pool: %" PRId64 " hits, %" PRId64 " misses, %d nodes cached\n"
+        , this->node_pool.hits, this->node_pool.misses, this->node_pool.nb_free_nodes);
+    this->node_pool.release_all();
 }
 
 void PacketQueue::packet_queue_abort()
 {
     AutoLocker _yes_locked(this->cond);
     this->abort_request = 1;
-    this->cond.wake();
+    this->cond.wake(WAKE_ALL);  // with PQ_IMPL_SPSC_RING, the producer may sleep on 'cond' too
+    if (this->consumer_task)
+        DecodePool::schedule(this->consumer_task);
 }
 
 void PacketQueue::packet_queue_start()
@@ -121,6 +358,9 @@ int PacketQueue::packet_queue_get(AVPacket* pkt, int block, /*out*/ int* serial)
     MyAVPacketListNode* pkt1;
     int ret;
 
+    if (this->ring)
+        return ring_get(pkt, block, serial);
+
     AutoLocker _yes_locked(this->cond);
 
     for (;;) {
@@ -147,8 +387,11 @@ int PacketQueue::packet_queue_get(AVPacket* pkt, int block, /*out*/ int* serial)
             if (serial)
                 *serial = pkt1->serial;
 
-            av_free(pkt1);
+            this->node_pool.recycle_node(pkt1);
             ret = 1;
+
+            if (this->space_signal)
+                this->space_signal->notify();
             break;
         }
         else if (!block) {
@@ -163,182 +406,1557 @@ int PacketQueue::packet_queue_get(AVPacket* pkt, int block, /*out*/ int* serial)
     return ret;
 }
 
-///////////// }}} packet_queue section
+int PacketQueue::packet_queue_get_many(AVPacket* pkts, int* serials, int max, int block)
+{
+    MyAVPacketListNode* pkt1;
+    int got = 0;
 
+    if (this->ring)
+        return ring_get_many(pkts, serials, max, block);
 
-//     frame_queue section {{{
+    AutoLocker _yes_locked(this->cond);
 
-void FrameQueue::unref_item(Frame* vp)
-{
-    av_frame_unref(vp->frame);
-}
+    for (;;) {
+        if (this->abort_request)
+            return -1;
 
-int FrameQueue::frame_queue_init(PacketQueue* pktq, int max_size, int keep_last)
-{
-    int i;
+        if (this->first_pkt || !block)
+            break;
 
-    rindex = 0 ;         // 最初的‘读头’
-    rindex_shown = 0;   // rindex指向的位置，是否曾经被 shown过
-    windex = 0;
-    size = 0;
+        this->cond.wait();
+    }
 
-    this->pktq = pktq;
-    this->max_size = FFMIN(max_size, FRAME_QUEUE_SIZE);
-    this->keep_last = !!keep_last;
-    for (i = 0; i < this->max_size; i++)
-        if (!(this->queue[i].frame = av_frame_alloc()))
-            return AVERROR(ENOMEM);
-    return 0;
-}
+    while (got < max && (pkt1 = this->first_pkt)) {
+        this->first_pkt = pkt1->next;
 
-void FrameQueue::frame_queue_destory()
-{
-    int i;
-    for (i = 0; i < this->max_size; i++) {
-        Frame* vp = &this->queue[i];
-        unref_item(vp);
-        av_frame_free(&vp->frame);
+        this->nb_packets--;
+        this->size -= pkt1->pkt.size + sizeof(*pkt1);
+        this->total_duration -= pkt1->pkt.duration;
+
+        pkts[got] = pkt1->pkt;
+        if (serials)
+            serials[got] = pkt1->serial;
+        got++;
+
+        this->node_pool.recycle_node(pkt1);
     }
+    if (!this->first_pkt)
+        this->last_pkt = NULL;
 
-}
+    if (got && this->space_signal)
+        this->space_signal->notify();
 
-void FrameQueue::frame_queue_signal()
-{
-    AutoLocker _yes_locked(this->fq_signal);
-    this->fq_signal.wake();
+    return got;
 }
 
-Frame* FrameQueue::frame_queue_peek()
+// {{ PQ_IMPL_SPSC_RING section
+// 'head' is moved by the consumer (get) and by flush (producer side), both via CAS, so that
+// a slot is owned by exactly one of them. 'tail' is only moved by the producer.
+// Accounting (nb_packets/size/total_duration) is increased before a slot is published,
+// and decreased by whoever claimed the slot, so it never goes negative.
+// The lock in 'cond' is only taken when one side has to sleep, or has to wake a sleeping peer.
+
+void PacketQueue::ring_wake_waiter(std::atomic<int>& waiting)
 {
-    return &this->queue[(this->rindex + this->rindex_shown) % this->max_size];
+    if (!waiting.load())
+        return;
+
+    AutoLocker _yes_locked(this->cond);
+    this->cond.wake(WAKE_ALL);
 }
 
-Frame* FrameQueue::frame_queue_peek_next()
+int PacketQueue::ring_put(AVPacket* pkt)
 {
-    return &this->queue[(this->rindex + this->rindex_shown + 1) % this->max_size];
+    PacketRing* r = this->ring;
+    unsigned t = r->tail.load(std::memory_order_relaxed);  // only we move 'tail'
+
+    if (t - r->head.load() >= PACKET_RING_SIZE) {
+        AutoLocker _yes_locked(this->cond);
+        r->producer_waiting.store(1);
+        while (!this->abort_request && t - r->head.load() >= PACKET_RING_SIZE)
+            this->cond.wait();
+        r->producer_waiting.store(0);
+    }
+
+    if (this->abort_request)
+        return -1;
+
+    MyAVPacketListNode* slot = &r->slots[t & (PACKET_RING_SIZE - 1)];
+    slot->pkt = *pkt;
+    slot->next = NULL;
+    if (is_flush_pkt(*pkt))
+        this->serial++;
+    slot->serial = this->serial;
+
+    this->nb_packets++;
+    this->size += slot->pkt.size + sizeof(*slot);
+    this->total_duration += slot->pkt.duration;
+
+    r->tail.store(t + 1);  // publish
+
+    ring_wake_waiter(r->consumer_waiting);
+    return 0;
 }
 
-Frame* FrameQueue::frame_queue_peek_last()
+int PacketQueue::ring_get(AVPacket* pkt, int block, /*out*/ int* serial)
 {
-    return &this->queue[this->rindex];
+    return ring_get_many(pkt, serial, 1, block);
 }
 
-Frame* FrameQueue::frame_queue_peek_writable()
+int PacketQueue::ring_get_many(AVPacket* pkts, /*out*/ int* serials, int max, int block)
 {
-    /* wait until we have space to put a new frame */
-    {
-        AutoLocker _yes_locked(this->fq_signal);
-        while (this->size >= this->max_size 
-                && !this->pktq->abort_request)  
-        {
-            this->fq_signal.wait();
+    PacketRing* r = this->ring;
+
+    for (;;) {
+        if (this->abort_request)
+            return -1;
+
+        unsigned h = r->head.load();
+        unsigned t = r->tail.load();
+        if (h == t) {
+            if (!block)
+                return 0;
+
+            AutoLocker _yes_locked(this->cond);
+            r->consumer_waiting.store(1);
+            if (!this->abort_request && r->head.load() == r->tail.load())
+                this->cond.wait();
+            r->consumer_waiting.store(0);
+            continue;
         }
-    }
 
-    if (this->pktq->abort_request)
-        return NULL;
+        // copy first then claim [h, h+n) at once. if flush claimed any of them in between, 
+        // the CAS fails and our copies are discarded untouched.
+        int n = (int)(t - h) < max ? (int)(t - h) : max;
+        for (int i = 0; i < n; i++) {
+            const MyAVPacketListNode& slot = r->slots[(h + i) & (PACKET_RING_SIZE - 1)];
+            pkts[i] = slot.pkt;
+            if (serials)
+                serials[i] = slot.serial;
+        }
+        if (!r->head.compare_exchange_strong(h, h + n))
+            continue;
 
-    return &this->queue[this->windex];
+        for (int i = 0; i < n; i++) {
+            this->nb_packets--;
+            this->size -= pkts[i].size + sizeof(MyAVPacketListNode);
+            this->total_duration -= pkts[i].duration;
+        }
+
+        ring_wake_waiter(r->producer_waiting);
+        if (this->space_signal)
+            this->space_signal->notify();
+        return n;
+    }
 }
 
-Frame* FrameQueue::frame_queue_peek_readable_nowait()
-{ 
-    AutoLocker _yes_locked(this->fq_signal);
-    if  (this->size - this->rindex_shown <= 0 || this->pktq->abort_request )  
-    {
-        return NULL;
+void PacketQueue::ring_flush()
+{
+    PacketRing* r = this->ring;
+    unsigned t = r->tail.load();
+    unsigned h = r->head.load();
+
+    // claim all slots [h, t) at once, the consumer may steal some from the front meanwhile.
+    while (h != t && !r->head.compare_exchange_weak(h, t))
+        ;
+
+    for (; h != t; h++) {
+        MyAVPacketListNode* slot = &r->slots[h & (PACKET_RING_SIZE - 1)];
+        this->nb_packets--;
+        this->size -= slot->pkt.size + sizeof(*slot);
+        this->total_duration -= slot->pkt.duration;
+        av_packet_unref(&slot->pkt);
     }
-    return &this->queue[(this->rindex + this->rindex_shown) % this->max_size];
+
+    ring_wake_waiter(r->producer_waiting);
+    if (this->space_signal)
+        this->space_signal->notify();
 }
+// }} PQ_IMPL_SPSC_RING section
+
+///////////// }}} packet_queue section
 
+//     packetizer section {{{
 
-Frame* FrameQueue::frame_queue_peek_readable()
+int Packetizer::init(const AVCodecContext* avctx)
 {
-    /* wait until we have a readable a new frame */
-    {
-        AutoLocker _yes_locked(this->fq_signal);
-        while (this->size - this->rindex_shown <= 0 &&
-            !this->pktq->abort_request) 
-        {
-            this->fq_signal.wait();
-        }
+    close();
+
+    this->parser = av_parser_init(avctx->codec_id);
+    if (!this->parser) {
+        if (!this->init_failed)
+            av_log(NULL, AV_LOG_WARNING, "No parser for %s, byte chunks can't be split into units.\n"
+                , avcodec_get_name(avctx->codec_id));
+        this->init_failed = 1;
+        return 1;
     }
 
-    if (this->pktq->abort_request)
-        return NULL;
+    AVCodecParameters* codec_para = avcodec_parameters_alloc();
+    this->parse_context = avcodec_alloc_context3(NULL);
+    if (!codec_para || !this->parse_context
+        || avcodec_parameters_from_context(codec_para, avctx) < 0
+        || avcodec_parameters_to_context(this->parse_context, codec_para) < 0) {
+        avcodec_parameters_free(&codec_para);
+        close();
+        return 2;
+    }
+    avcodec_parameters_free(&codec_para);
 
-    return &this->queue[(this->rindex + this->rindex_shown) % this->max_size];
+    this->init_failed = 0;
+    return 0;
 }
 
-void FrameQueue::frame_queue_push()
+void Packetizer::close()
 {
-    if (++this->windex == this->max_size)
-        this->windex = 0;
+    if (this->parser) {
+        av_parser_close(this->parser);
+        this->parser = NULL;
+    }
+    avcodec_free_context(&this->parse_context);
+}
 
-    AutoLocker _yes_locked(this->fq_signal);
-    this->size++;
+void Packetizer::reset()
+{
+    if (!this->parser)
+        return;
 
-    this->fq_signal.wake();
+    // no API to drop what a parser buffers, a new one does it
+    enum AVCodecID codec_id = this->parse_context->codec_id;
+    av_parser_close(this->parser);
+    this->parser = av_parser_init(codec_id);
+    if (!this->parser)
+        avcodec_free_context(&this->parse_context);
 }
 
-void FrameQueue::frame_queue_next()
+int Packetizer::make_unit(AVPacket* unit, const AVPacket* chunk, const uint8_t* data, int size)
 {
-    if (this->keep_last && !this->rindex_shown) {
-        this->rindex_shown = 1;
-        return;
+    av_init_packet(unit);
+
+    if (chunk && chunk->buf && data >= chunk->data && data + size <= chunk->data + chunk->size) {
+        // what follows it in 'chunk' (the next unit, or chunk's own padding) serves as padding, as libavformat does
+        unit->buf = av_buffer_ref(chunk->buf);
+        if (!unit->buf)
+            return AVERROR(ENOMEM);
+        unit->data = (uint8_t*)data;
+        unit->size = size;
+    }
+    else {
+        if (av_new_packet(unit, size) < 0)
+            return AVERROR(ENOMEM);
+        memcpy(unit->data, data, size);
+        this->copied_units++;
     }
-    unref_item(&this->queue[this->rindex]);  // 出队列前，先释放 Frame内带的data
-    if (++this->rindex == this->max_size)
-        this->rindex = 0;
 
-    AutoLocker _yes_locked(this->fq_signal);
-    this->size--;
-    this->fq_signal.wake();
+    unit->pts = this->parser->pts;
+    unit->dts = this->parser->dts;
+    unit->pos = this->parser->pos;
+    if (chunk)
+        unit->stream_index = chunk->stream_index;
+
+    if (1 == this->parser->key_frame 
+        || (-1 == this->parser->key_frame && AV_PICTURE_TYPE_I == this->parser->pict_type)
+        || AVMEDIA_TYPE_AUDIO == this->parse_context->codec_type)
+        unit->flags |= AV_PKT_FLAG_KEY;
 
+    return 0;
 }
 
-/* return the number of undisplayed frames in the queue */
-int FrameQueue::frame_queue_nb_remaining()
+int Packetizer::packetize(AVPacket* chunk, int whole_units, PacketQueue* q)
 {
-    return this->size - this->rindex_shown;
+    if (!this->parser) {
+        if (chunk)
+            av_packet_unref(chunk);
+        return AVERROR(EINVAL);
+    }
+
+    if (whole_units)
+        this->parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
+    else
+        this->parser->flags &= ~PARSER_FLAG_COMPLETE_FRAMES;
+
+    AVPacket units[PACKET_BATCH_SIZE];
+    int nb = 0, total = 0, ret = 0;
+
+    const uint8_t* data = chunk ? chunk->data : NULL;
+    int     size = chunk ? chunk->size : 0;
+    int64_t pts = chunk ? chunk->pts : AV_NOPTS_VALUE;
+    int64_t dts = chunk ? chunk->dts : AV_NOPTS_VALUE;
+    int64_t pos = chunk ? chunk->pos : -1;
+
+    for (;;) {
+        uint8_t* out_data = NULL;
+        int      out_size = 0;
+        int used = av_parser_parse2(this->parser, this->parse_context, &out_data, &out_size
+            , data, size, pts, dts, pos);
+        if (used < 0) {
+            ret = used;
+            break;
+        }
+        if (data) {
+            data += used;
+            size -= used;
+        }
+        pts = dts = AV_NOPTS_VALUE;     // parser has taken them for the unit starting in 'chunk'
+        pos = -1;
+
+        if (out_size) {
+            ret = make_unit(&units[nb], chunk, out_data, out_size);
+            if (ret < 0)
+                break;
+
+            if (PACKET_BATCH_SIZE == ++nb) {
+                total += q->packet_queue_put_many(units, nb) < 0 ? 0 : nb;
+                nb = 0;
+            }
+        }
+
+        if (size <= 0 && (chunk || !out_size))  // flushing goes on till nothing comes out
+            break;
+    }
+
+    if (nb)
+        total += q->packet_queue_put_many(units, nb) < 0 ? 0 : nb;
+    this->units += total;
+
+    if (chunk)
+        av_packet_unref(chunk);
+    return ret < 0 ? ret : total;
 }
 
-/* return last shown position */
-int64_t FrameQueue::frame_queue_last_pos()
+///////////// }}} packetizer section
+
+//     packet_buffer_pool section {{{
+
+PacketBufferPool::PacketBufferPool()
 {
-    Frame* fp = &this->queue[this->rindex];
-    if (this->rindex_shown && fp->serial == this->pktq->serial)
-        return fp->pos;
-    else
-        return -1;
+    for (int i = 0; i < PACKET_POOL_CLASSES; i++)
+        this->pools[i] = NULL;
+    this->nb_gets = this->nb_allocs = this->nb_oversize = 0;
 }
-//      }}} frame_queue section
 
-// {{{ Clock section 
-double Clock::get_clock()
+PacketBufferPool::~PacketBufferPool()
 {
-    if (*this->queue_serial != this->serial)
-        return NAN;
-    if (this->paused) {
-        return this->pts;
-    }
-    else {
-        double time = av_gettime_relative() / 1000000.0;
-        return this->pts_drift + time - (time - this->last_updated) * (1.0 - this->speed);
+    for (int i = 0; i < PACKET_POOL_CLASSES; i++) {
+        AVBufferPool* pool = this->pools[i].exchange(NULL);
+        av_buffer_pool_uninit(&pool);
     }
 }
 
-void Clock::set_clock_at(double pts, int serial, double time)
+AVBufferRef* PacketBufferPool::pool_alloc(void* opaque, int size)
 {
-    this->pts = pts;
-    this->last_updated = time;
-    this->pts_drift = this->pts - time;
-    this->serial = serial;
+    PacketBufferPool* me = (PacketBufferPool*)opaque;
+    AVBufferRef* buf = av_buffer_alloc(size);
+    if (buf)
+        me->nb_allocs++;
+    return buf;
 }
 
-void Clock::set_clock(double pts, int serial)
+AVBufferPool* PacketBufferPool::get_pool(int size_class)
 {
-    double time = av_gettime_relative() / 1000000.0;
+    AVBufferPool* pool = this->pools[size_class];
+    if (pool)
+        return pool;
+
+    AutoLocker _yes_locked(this->lock);
+    pool = this->pools[size_class];
+    if (!pool) {
+        pool = av_buffer_pool_init2((PACKET_POOL_MIN_SIZE << size_class) + AV_INPUT_BUFFER_PADDING_SIZE
+            , this, pool_alloc, NULL);
+        this->pools[size_class] = pool;
+    }
+    return pool;
+}
+
+int PacketBufferPool::make_packet(AVPacket* pkt, const uint8_t* data, int size)
+{
+    av_init_packet(pkt);
+    pkt->data = NULL;
+    pkt->size = 0;
+
+    int size_class = 0;
+    while (size_class < PACKET_POOL_CLASSES && (PACKET_POOL_MIN_SIZE << size_class) < size)
+        size_class++;
+
+    if (size_class < PACKET_POOL_CLASSES) {
+        AVBufferPool* pool = get_pool(size_class);
+        pkt->buf = pool ? av_buffer_pool_get(pool) : NULL;
+        if (!pkt->buf)
+            return AVERROR(ENOMEM);
+        this->nb_gets++;
+    }
+    else {
+        pkt->buf = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!pkt->buf)
+            return AVERROR(ENOMEM);
+        this->nb_oversize++;
+    }
+
+    pkt->data = pkt->buf->data;
+    pkt->size = size;
+    memcpy(pkt->data, data, size);
+    memset(pkt->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);  // recycled buffers hold old bytes
+    return 0;
+}
+
+int PacketBufferPool::wrap_packet(AVPacket* pkt, uint8_t* data, int size, void (*release)(void* opaque, uint8_t* data), void* opaque)
+{
+    av_init_packet(pkt);
+    pkt->buf = av_buffer_create(data, size + AV_INPUT_BUFFER_PADDING_SIZE, release, opaque, 0);
+    if (!pkt->buf) {
+        pkt->data = NULL;
+        pkt->size = 0;
+        return AVERROR(ENOMEM);
+    }
+    pkt->data = data;
+    pkt->size = size;
+    return 0;
+}
+
+void PacketBufferPool::get_stats(PacketBufferPoolStats* stats)
+{
+    stats->nb_gets     = this->nb_gets;
+    stats->nb_allocs   = this->nb_allocs;
+    stats->nb_oversize = this->nb_oversize;
+}
+
+///////////// }}} packet_buffer_pool section
+
+//     frame_buffer_pool section {{{
+
+int FrameBufferPool::default_enabled = 1;
+int FrameBufferPool::default_huge_pages = 0;
+
+FrameBufferPool::FrameBufferPool()
+{
+    memset(&stats, 0, sizeof(stats));
+    memset(pools, 0, sizeof(pools));
+    nb_pools = 0;
+    format = -1;
+    width = height = 0;
+    channels = nb_samples = 0;
+    use_huge_pages = default_huge_pages;
+}
+
+FrameBufferPool::~FrameBufferPool()
+{
+    uninit();
+}
+
+void FrameBufferPool::attach(AVCodecContext* avctx)
+{
+    if (!default_enabled)
+        return;
+
+    this->use_huge_pages = default_huge_pages;
+    avctx->opaque = this;
+    avctx->get_buffer2 = get_buffer2;
+    avctx->thread_safe_callbacks = 1;   // we lock by ourselves
+}
+
+void FrameBufferPool::uninit()
+{
+    AutoLocker _yes_locked(this->lock);
+    if (this->stats.nb_gets || this->stats.nb_fallbacks) {
+        av_log(NULL, AV_LOG_VERBOSE, "frame buffer pool: %" PRId64 " gets, %" PRId64 " allocs, %" PRId64 " fallbacks, %" PRId64 " reinits, %" PRId64 " KB alloced\n"
+            , this->stats.nb_gets, this->stats.nb_allocs, this->stats.nb_fallbacks, this->stats.nb_reinits, this->stats.alloced_bytes / 1024);
+    }
+    release_pools();
+}
+
+void FrameBufferPool::trim()
+{
+    AutoLocker _yes_locked(this->lock);
+    release_pools();
+}
+
+void FrameBufferPool::get_stats(FrameBufferPoolStats* stats)
+{
+    AutoLocker _yes_locked(this->lock);
+    *stats = this->stats;
+}
+
+void FrameBufferPool::release_pools()
+{
+    for (int i = 0; i < this->nb_pools; i++)
+        av_buffer_pool_uninit(&this->pools[i]);   // the real free is deferred until all buffers come back
+
+    this->nb_pools = 0;
+    this->format = -1;
+}
+
+#ifndef _WIN32
+static void free_huge_page_buffer(void* opaque, uint8_t* data)
+{
+    munmap(data, (size_t)(intptr_t)opaque);
+}
+#endif
+
+// called by av_buffer_pool_get() with 'lock' held
+AVBufferRef* FrameBufferPool::pool_alloc(void* opaque, int size)
+{
+    FrameBufferPool* me = (FrameBufferPool*)opaque;
+    AVBufferRef* buf = NULL;
+
+#ifndef _WIN32
+    if (me->use_huge_pages && size >= HUGE_PAGE_SIZE) {
+        size_t map_size = FFALIGN((size_t)size, (size_t)HUGE_PAGE_SIZE);
+        void* mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+            madvise(mem, map_size, MADV_HUGEPAGE);
+#endif
+            buf = av_buffer_create((uint8_t*)mem, size, free_huge_page_buffer, (void*)(intptr_t)map_size, 0);
+            if (!buf)
+                munmap(mem, map_size);
+            else
+                me->stats.huge_page_bytes += map_size;
+        }
+    }
+#endif
+
+    if (!buf)
+        buf = av_buffer_alloc(size);  // av_malloc is aligned to what simd of this build needs
+    
+    if (buf) {
+        me->stats.nb_allocs++;
+        me->stats.alloced_bytes += size;
+    }
+    return buf;
+}
+
+int FrameBufferPool::update_video_pools(AVCodecContext* avctx, AVFrame* frame)
+{
+    if (this->nb_pools && this->format == frame->format
+        && this->width == frame->width && this->height == frame->height)
+        return 0;
+
+    int w = frame->width, h = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    int lines[4];
+    uint8_t* data[4];
+    ptrdiff_t linesize1[4];
+    size_t size[4] = { 0 };
+    int i, unaligned;
+
+    // same as what libavcodec does in its default pool
+    avcodec_align_dimensions2(avctx, &w, &h, linesize_align);
+    do {
+        if (av_image_fill_linesizes(lines, (AVPixelFormat)frame->format, w) < 0)
+            return -1;
+        w += w & ~(w - 1);
+        unaligned = 0;
+        for (i = 0; i < 4; i++)
+            unaligned |= lines[i] % FRAME_BUFFER_ALIGN;
+    } while (unaligned);
+
+    for (i = 0; i < 4; i++)
+        linesize1[i] = lines[i];
+    int total = av_image_fill_pointers(data, (AVPixelFormat)frame->format, h, NULL, lines);
+    if (total < 0)
+        return -1;
+
+    for (i = 0; i < 3 && data[i + 1]; i++)
+        size[i] = data[i + 1] - data[i];
+    size[i] = total - (data[i] - data[0]);
+
+    release_pools();
+    for (i = 0; i < 4 && size[i]; i++) {
+        this->linesize[i] = (int)linesize1[i];
+        this->pools[i] = av_buffer_pool_init2((int)size[i] + 16 + FRAME_BUFFER_ALIGN - 1, this, pool_alloc, NULL);
+        if (!this->pools[i]) {
+            this->nb_pools = i;
+            release_pools();
+            return AVERROR(ENOMEM);
+        }
+    }
+    this->nb_pools = i;
+    this->format = frame->format;
+    this->width = frame->width;
+    this->height = frame->height;
+    this->stats.nb_reinits++;
+    return 0;
+}
+
+int FrameBufferPool::update_audio_pools(AVCodecContext* avctx, AVFrame* frame)
+{
+    if (this->nb_pools && this->format == frame->format
+        && this->channels == frame->channels && this->nb_samples == frame->nb_samples)
+        return 0;
+
+    int planar = av_sample_fmt_is_planar((AVSampleFormat)frame->format);
+    int planes = planar ? frame->channels : 1;
+    int lines;
+
+    if (planes > AV_NUM_DATA_POINTERS)
+        return -1;   // would need extended_buf, let default get_buffer2 do it
+
+    if (av_samples_get_buffer_size(&lines, frame->channels, frame->nb_samples, (AVSampleFormat)frame->format, 0) < 0)
+        return -1;
+
+    release_pools();
+    for (int i = 0; i < planes; i++) {
+        this->linesize[i] = lines;
+        this->pools[i] = av_buffer_pool_init2(lines, this, pool_alloc, NULL);
+        if (!this->pools[i]) {
+            this->nb_pools = i;
+            release_pools();
+            return AVERROR(ENOMEM);
+        }
+    }
+    this->nb_pools = planes;
+    this->format = frame->format;
+    this->channels = frame->channels;
+    this->nb_samples = frame->nb_samples;
+    this->stats.nb_reinits++;
+    return 0;
+}
+
+int FrameBufferPool::get_buffer2(AVCodecContext* avctx, AVFrame* frame, int flags)
+{
+    FrameBufferPool* me = (FrameBufferPool*)avctx->opaque;
+    int i, ret;
+
+    if (!me || !(avctx->codec->capabilities & AV_CODEC_CAP_DR1) || avctx->hw_frames_ctx) 
+        goto FALLBACK;
+
+    {
+        AutoLocker _yes_locked(me->lock);
+
+        if (AVMEDIA_TYPE_VIDEO == avctx->codec_type) {
+            const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+            uint64_t unsupported_flags = AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL;
+#if FF_API_PSEUDOPAL
+            unsupported_flags |= AV_PIX_FMT_FLAG_PSEUDOPAL;
+#endif
+            if (!desc || (desc->flags & unsupported_flags))
+                goto FALLBACK_LOCKED;
+            ret = me->update_video_pools(avctx, frame);
+        }
+        else if (AVMEDIA_TYPE_AUDIO == avctx->codec_type) {
+            ret = me->update_audio_pools(avctx, frame);
+        }
+        else {
+            goto FALLBACK_LOCKED;
+        }
+
+        if (ret < 0)
+            goto FALLBACK_LOCKED;
+
+        for (i = 0; i < me->nb_pools; i++) {
+            frame->buf[i] = av_buffer_pool_get(me->pools[i]);
+            if (!frame->buf[i])
+                goto FAIL;
+            frame->data[i] = frame->buf[i]->data;
+            frame->linesize[i] = me->linesize[i];
+        }
+        for (; i < AV_NUM_DATA_POINTERS; i++) {
+            frame->data[i] = NULL;
+            frame->linesize[i] = 0;
+        }
+        frame->extended_data = frame->data;
+
+        me->stats.nb_gets++;
+        return 0;
+
+    FAIL:
+        av_frame_unref(frame);
+        return AVERROR(ENOMEM);
+
+    FALLBACK_LOCKED:
+        me->stats.nb_fallbacks++;
+    }
+
+FALLBACK:
+    return avcodec_default_get_buffer2(avctx, frame, flags);
+}
+//     }}} frame_buffer_pool section
+
+
+//     frame_queue section {{{
+
+void FrameQueue::unref_item(Frame* vp)
+{
+    av_frame_unref(vp->frame);
+}
+
+int FrameQueue::frame_queue_init(PacketQueue* pktq, int max_size, int keep_last, int capacity)
+{
+    int i;
+
+    rindex = 0 ;         // 最初的‘读头’
+    rindex_shown = 0;   // rindex指向的位置，是否曾经被 shown过
+    windex = 0;
+    nb_pushed = 0;
+    nb_nexted = 0;
+    producer_waiting = 0;
+    consumer_waiting = 0;
+
+    this->pktq = pktq;
+    this->keep_last = !!keep_last;
+    this->max_size = av_clip(max_size, 1 + this->keep_last, FRAME_QUEUE_MAX_DEPTH);
+    this->capacity = av_clip(capacity, this->max_size, FRAME_QUEUE_MAX_DEPTH);
+
+    // slots are cheap (AVFrame without data), data is only held by queued frames
+    this->queue = (Frame*)av_mallocz_array(this->capacity, sizeof(Frame));
+    if (!this->queue)
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < this->capacity; i++)
+        if (!(this->queue[i].frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+    return 0;
+}
+
+void FrameQueue::frame_queue_destory()
+{
+    int i;
+    if (!this->queue)
+        return;
+
+    for (i = 0; i < this->capacity; i++) {
+        Frame* vp = &this->queue[i];
+        unref_item(vp);
+        av_frame_free(&vp->frame);
+    }
+    av_freep(&this->queue);
+    this->capacity = 0;
+}
+
+int FrameQueue::frame_queue_set_depth(int depth)
+{
+    depth = av_clip(depth, 1 + this->keep_last, this->capacity);
+    this->max_size = depth;
+    wake_waiter(this->producer_waiting);    // may have room now
+    if (this->producer_task)
+        DecodePool::schedule(this->producer_task);
+    return depth;
+}
+
+void FrameQueue::frame_queue_signal()
+{
+    AutoLocker _yes_locked(this->fq_signal);
+    this->fq_signal.wake(WAKE_ALL);
+}
+
+void FrameQueue::wake_waiter(std::atomic<int>& waiting)
+{
+    if (!waiting.load())
+        return;
+
+    AutoLocker _yes_locked(this->fq_signal);
+    this->fq_signal.wake(WAKE_ALL);
+}
+
+Frame* FrameQueue::frame_queue_peek()
+{
+    return &this->queue[(this->rindex + this->rindex_shown) % this->capacity];
+}
+
+Frame* FrameQueue::frame_queue_peek_next()
+{
+    return &this->queue[(this->rindex + this->rindex_shown + 1) % this->capacity];
+}
+
+Frame* FrameQueue::frame_queue_peek_last()
+{
+    return &this->queue[this->rindex];
+}
+
+Frame* FrameQueue::frame_queue_peek_writable(int serial)
+{
+    /* wait until we have space to put a new frame */
+    if (this->size() >= this->max_size) {
+        AutoLocker _yes_locked(this->fq_signal);
+        this->producer_waiting = 1;
+        while (this->size() >= this->max_size 
+                && !this->pktq->abort_request
+                && (serial < 0 || serial == this->pktq->serial))  // no use waiting to queue a frame before seek
+        {
+            this->fq_signal.wait();
+        }
+        this->producer_waiting = 0;
+    }
+
+    if (this->pktq->abort_request || (serial >= 0 && serial != this->pktq->serial))
+        return NULL;
+
+    return &this->queue[this->windex];
+}
+
+Frame* FrameQueue::frame_queue_peek_writable_nowait()
+{
+    if (this->size() >= this->max_size || this->pktq->abort_request)
+        return NULL;
+
+    return &this->queue[this->windex];
+}
+
+Frame* FrameQueue::frame_queue_peek_readable_nowait()
+{ 
+    if  (this->size() - this->rindex_shown <= 0 || this->pktq->abort_request )  
+    {
+        return NULL;
+    }
+    return &this->queue[(this->rindex + this->rindex_shown) % this->capacity];
+}
+
+
+Frame* FrameQueue::frame_queue_peek_readable()
+{
+    /* wait until we have a readable a new frame */
+    if (this->size() - this->rindex_shown <= 0) {
+        AutoLocker _yes_locked(this->fq_signal);
+        this->consumer_waiting = 1;
+        while (this->size() - this->rindex_shown <= 0 &&
+            !this->pktq->abort_request) 
+        {
+            this->fq_signal.wait();
+        }
+        this->consumer_waiting = 0;
+    }
+
+    if (this->pktq->abort_request)
+        return NULL;
+
+    return &this->queue[(this->rindex + this->rindex_shown) % this->capacity];
+}
+
+void FrameQueue::frame_queue_push()
+{
+    if (++this->windex == this->capacity)
+        this->windex = 0;
+
+    this->nb_pushed++;  // publish the frame written
+    wake_waiter(this->consumer_waiting);
+}
+
+void FrameQueue::frame_queue_next()
+{
+    if (this->keep_last && !this->rindex_shown) {
+        this->rindex_shown = 1;
+        return;
+    }
+    unref_item(&this->queue[this->rindex]);  // 出队列前，先释放 Frame内带的data
+    if (++this->rindex == this->capacity)
+        this->rindex = 0;
+
+    this->nb_nexted++;  // give the slot back to producer
+    wake_waiter(this->producer_waiting);
+    if (this->producer_task)
+        DecodePool::schedule(this->producer_task);
+}
+
+int FrameQueue::frame_queue_purge(int serial)
+{
+    int nb = 0;
+    while (frame_queue_nb_remaining() > 0 && frame_queue_peek()->serial != serial) {
+        frame_queue_next();     // as prepare_picture_for_display() skips them, only all in one go
+        nb++;
+    }
+    return nb;
+}
+
+/* return the number of undisplayed frames in the queue */
+int FrameQueue::frame_queue_nb_remaining()
+{
+    return this->size() - this->rindex_shown;
+}
+
+/* return last shown position */
+int64_t FrameQueue::frame_queue_last_pos()
+{
+    Frame* fp = &this->queue[this->rindex];
+    if (this->rindex_shown && fp->serial == this->pktq->serial)
+        return fp->pos;
+    else
+        return -1;
+}
+//      }}} frame_queue section
+
+// {{{ DecodePool section 
+
+int DecodePool::default_enabled = 0;
+
+thread_local DecodePool::Worker* DecodePool::current_worker = NULL;
+
+DecodePool::DecodePool(int nb_workers)
+{
+    this->nb_workers = nb_workers;
+    this->next_worker = 0;
+    this->nb_tasks = 0;
+    this->nb_queued = 0;
+    this->nb_sleeping = 0;
+    this->nb_detaching = 0;
+
+    this->workers = new Worker[nb_workers];
+    for (int i = 0; i < nb_workers; i++) {
+        this->workers[i].pool = this;
+        this->workers[i].first = this->workers[i].nb = 0;
+        this->workers[i].create_thread();
+    }
+    av_log(NULL, AV_LOG_VERBOSE, "decode pool: %d workers\n", nb_workers);
+}
+
+DecodePool* DecodePool::get_instance()
+{
+    static DecodePool* instance = new DecodePool(FFMAX(av_cpu_count(), 1));   // thread safe init since C++11
+    return instance;
+}
+
+int DecodePool::get_worker_count()
+{
+    return get_instance()->nb_workers;
+}
+
+int DecodePool::attach(DecodeTask* task)
+{
+    DecodePool* pool = get_instance();
+    if (++pool->nb_tasks > DECODE_POOL_MAX_TASKS) {
+        pool->nb_tasks--;
+        return 1;
+    }
+
+    task->task_state = DecodeTask::TASK_IDLE;
+    schedule(task);
+    return 0;
+}
+
+void DecodePool::detach(DecodeTask* task)
+{
+    // a queued task is run once more (and sees its decoder aborted), a running one finishes its slice
+    DecodePool* pool = get_instance();
+    int state = DecodeTask::TASK_IDLE;
+    if (!task->task_state.compare_exchange_strong(state, DecodeTask::TASK_DETACHED)) {
+        if (state == DecodeTask::TASK_DETACHED)
+            return;
+
+        AutoLocker _yes_locked(pool->idle_signal);
+        pool->nb_detaching++;   // before trying again, so run() can't miss us
+        for (;;) {
+            state = DecodeTask::TASK_IDLE;
+            if (task->task_state.compare_exchange_strong(state, DecodeTask::TASK_DETACHED))
+                break;
+            pool->idle_signal.wait();
+        }
+        pool->nb_detaching--;
+    }
+    pool->nb_tasks--;
+}
+
+void DecodePool::schedule(DecodeTask* task)
+{
+    int state = task->task_state.load();
+    for (;;) {
+        if (state == DecodeTask::TASK_IDLE) {
+            if (task->task_state.compare_exchange_weak(state, DecodeTask::TASK_QUEUED)) {
+                get_instance()->push(task);
+                return;
+            }
+        }
+        else if (state == DecodeTask::TASK_RUNNING) {
+            if (task->task_state.compare_exchange_weak(state, DecodeTask::TASK_RUNNING_AGAIN))
+                return;
+        }
+        else {
+            return; // queued, or going to be, or not on the pool
+        }
+    }
+}
+
+void DecodePool::push(DecodeTask* task)
+{
+    // a worker keeps what it schedules (e.g. the decoder of a queue it just fed), others go round robin
+    Worker* worker = (current_worker && current_worker->pool == this) ? current_worker
+        : &this->workers[this->next_worker++ % this->nb_workers];
+    {
+        AutoLocker _yes_locked(worker->lock);
+        worker->push_back(task);
+    }
+
+    this->nb_queued++;
+    if (this->nb_sleeping.load()) {
+        AutoLocker _yes_locked(this->work_signal);
+        this->work_signal.wake();
+    }
+}
+
+DecodeTask* DecodePool::take(Worker* self)
+{
+    DecodeTask* task;
+    {
+        AutoLocker _yes_locked(self->lock);
+        task = self->pop_back();
+    }
+
+    for (int i = 1; !task && i < this->nb_workers; i++) {
+        Worker* victim = &this->workers[(self - this->workers + i) % this->nb_workers];
+        AutoLocker _yes_locked(victim->lock);
+        task = victim->pop_front();
+    }
+
+    if (task)
+        this->nb_queued--;
+    return task;
+}
+
+void DecodePool::run(DecodeTask* task)
+{
+    task->task_state = DecodeTask::TASK_RUNNING;
+    int more = task->run_task();
+
+    int state = DecodeTask::TASK_RUNNING;
+    if (!more && task->task_state.compare_exchange_strong(state, DecodeTask::TASK_IDLE)) {
+        if (this->nb_detaching.load()) {
+            AutoLocker _yes_locked(this->idle_signal);
+            this->idle_signal.wake(WAKE_ALL);
+        }
+        return;
+    }
+
+    // time slice used up, or scheduled again while running
+    task->task_state = DecodeTask::TASK_QUEUED;
+    push(task);
+}
+
+void DecodePool::Worker::push_back(DecodeTask* task)
+{
+    this->tasks[(this->first + this->nb) % DECODE_POOL_MAX_TASKS] = task;
+    this->nb++;     // never overflows, a task is in one deque at most
+}
+
+DecodeTask* DecodePool::Worker::pop_back()
+{
+    if (!this->nb)
+        return NULL;
+    this->nb--;
+    return this->tasks[(this->first + this->nb) % DECODE_POOL_MAX_TASKS];
+}
+
+DecodeTask* DecodePool::Worker::pop_front()
+{
+    if (!this->nb)
+        return NULL;
+    DecodeTask* task = this->tasks[this->first];
+    this->first = (this->first + 1) % DECODE_POOL_MAX_TASKS;
+    this->nb--;
+    return task;
+}
+
+ThreadRetType DecodePool::Worker::thread_main()
+{
+    current_worker = this;
+
+    for (;;) {
+        DecodeTask* task = this->pool->take(this);
+        if (task) {
+            this->pool->run(task);
+            continue;
+        }
+
+        AutoLocker _yes_locked(this->pool->work_signal);
+        this->pool->nb_sleeping++;
+        while (!this->pool->nb_queued.load())
+            this->pool->work_signal.wait();
+        this->pool->nb_sleeping--;
+    }
+    return (ThreadRetType)0;
+}
+
+// }}} DecodePool section 
+
+// {{{ IntraDecodeGroup section 
+IntraDecodeGroup::IntraDecodeGroup()
+{
+    for (int i = 0; i < INTRA_MAX_WORKERS * INTRA_JOBS_PER_WORKER; i++) {
+        av_init_packet(&this->jobs[i].pkt);
+        this->jobs[i].pkt.data = NULL;
+        this->jobs[i].pkt.size = 0;
+        this->jobs[i].frame = NULL;
+        this->jobs[i].state = JOB_FREE;
+    }
+    this->nb_jobs = 0;
+    this->head = this->nb = 0;
+    this->nb_busy = 0;
+    this->draining = 0;
+    this->quit = 0;
+    this->workers = NULL;
+    this->nb_workers = 0;
+}
+
+IntraDecodeGroup::~IntraDecodeGroup()
+{
+    destroy();
+}
+
+int IntraDecodeGroup::is_intra_only(const AVCodecParameters* codec_para)
+{
+    const AVCodecDescriptor* desc = avcodec_descriptor_get(codec_para->codec_id);
+    if (desc && (desc->props & AV_CODEC_PROP_INTRA_ONLY))
+        return 1;
+
+    // High 10/4:2:2/4:4:4 Intra, CAVLC 4:4:4 Intra
+    return AV_CODEC_ID_H264 == codec_para->codec_id && FF_PROFILE_UNKNOWN != codec_para->profile
+        && (codec_para->profile & FF_PROFILE_H264_INTRA);
+}
+
+int IntraDecodeGroup::init(const AVCodecContext* avctx, int nb_workers, FrameBufferPool* buffer_pool)
+{
+    destroy();
+
+    AVCodecParameters* codec_para = avcodec_parameters_alloc();
+    if (!codec_para || avcodec_parameters_from_context(codec_para, avctx) < 0) {
+        avcodec_parameters_free(&codec_para);
+        return 1;
+    }
+
+    this->nb_workers = av_clip(nb_workers, 1, INTRA_MAX_WORKERS);
+    this->workers = new (std::nothrow) Worker[this->nb_workers];
+    if (!this->workers) {
+        avcodec_parameters_free(&codec_para);
+        this->nb_workers = 0;
+        return 2;
+    }
+
+    int ret = 0;
+    for (int i = 0; i < this->nb_workers; i++) {
+        Worker* worker = &this->workers[i];
+        worker->group = this;
+        worker->avctx = avcodec_alloc_context3(NULL);
+        if (!worker->avctx || avcodec_parameters_to_context(worker->avctx, codec_para) < 0) {
+            ret = 3;
+            continue;
+        }
+
+        worker->avctx->pkt_timebase = avctx->pkt_timebase;
+        worker->avctx->lowres = avctx->lowres;
+        worker->avctx->flags = avctx->flags;
+        worker->avctx->flags2 = avctx->flags2;
+        worker->avctx->thread_count = 1;    // parallel across pkts instead
+        if (buffer_pool)
+            buffer_pool->attach(worker->avctx);
+
+        if (avcodec_open2(worker->avctx, avctx->codec, NULL) < 0)
+            ret = 4;
+    }
+    avcodec_parameters_free(&codec_para);
+
+    if (ret) {
+        for (int i = 0; i < this->nb_workers; i++)
+            avcodec_free_context(&this->workers[i].avctx);
+        delete[] this->workers;
+        this->workers = NULL;
+        this->nb_workers = 0;
+        return ret;
+    }
+
+    this->nb_jobs = this->nb_workers * INTRA_JOBS_PER_WORKER;
+    for (int i = 0; i < this->nb_jobs; i++) {
+        this->jobs[i].frame = av_frame_alloc();
+        if (!this->jobs[i].frame)
+            ret = AVERROR(ENOMEM);
+    }
+    this->head = this->nb = 0;
+    this->nb_busy = 0;
+    this->draining = 0;
+    this->quit = 0;
+
+    for (int i = 0; i < this->nb_workers; i++)
+        this->workers[i].create_thread();
+
+    if (ret) {
+        destroy();
+        return 5;
+    }
+
+    av_log(NULL, AV_LOG_VERBOSE, "intra-only %s: %d contexts decode in parallel\n"
+        , avcodec_get_name(avctx->codec_id), this->nb_workers);
+    return 0;
+}
+
+void IntraDecodeGroup::destroy()
+{
+    if (!this->workers)
+        return;
+
+    this->lock.lock();
+    this->quit = 1;
+    this->lock.wake(WAKE_ALL);
+    this->lock.unlock();
+
+    for (int i = 0; i < this->nb_workers; i++) {
+        this->workers[i].wait_thread_quit();
+        avcodec_free_context(&this->workers[i].avctx);
+    }
+    delete[] this->workers;
+    this->workers = NULL;
+    this->nb_workers = 0;
+
+    for (int i = 0; i < this->nb_jobs; i++) {
+        av_packet_unref(&this->jobs[i].pkt);
+        av_frame_free(&this->jobs[i].frame);
+        this->jobs[i].state = JOB_FREE;
+    }
+    this->nb_jobs = 0;
+    this->head = this->nb = 0;
+}
+
+int IntraDecodeGroup::send(const AVPacket* pkt, const AVCodecContext* tuning)
+{
+    AutoLocker _yes_locked(this->lock);
+
+    if (!pkt) {
+        this->draining = 1;
+        this->lock.wake(WAKE_ALL);  // receiver may wait for the last jobs now
+        return 0;
+    }
+    if (this->draining)
+        return AVERROR_EOF;
+    if (this->nb == this->nb_jobs)
+        return AVERROR(EAGAIN);
+
+    Job* job = &this->jobs[(this->head + this->nb) % this->nb_jobs];
+    int ret = av_packet_ref(&job->pkt, pkt);
+    if (ret < 0)
+        return ret;
+
+    job->skip_frame = tuning->skip_frame;
+    job->skip_loop_filter = tuning->skip_loop_filter;
+    job->skip_idct = tuning->skip_idct;
+    job->state = JOB_QUEUED;
+    this->nb++;
+    this->lock.wake(WAKE_ALL);      // receiver waits on it too, it must not swallow the wakeup
+    return 0;
+}
+
+int IntraDecodeGroup::receive(AVFrame* frame, int more_input)
+{
+    AutoLocker _yes_locked(this->lock);
+
+    for (;;) {
+        if (!this->nb)
+            return this->draining ? AVERROR_EOF : AVERROR(EAGAIN);
+
+        Job* job = &this->jobs[this->head];
+        if (JOB_DONE == job->state) {
+            int ret = job->ret;
+            if (0 == ret)
+                av_frame_move_ref(frame, job->frame);
+            av_frame_unref(job->frame);
+            av_packet_unref(&job->pkt);
+            job->state = JOB_FREE;
+            this->head = (this->head + 1) % this->nb_jobs;
+            this->nb--;
+
+            if (0 == ret)
+                return 0;
+            continue;   // pkt failed to decode, as if codec gave nothing for it
+        }
+
+        if (more_input && !this->draining && this->nb < this->nb_jobs)
+            return AVERROR(EAGAIN);
+        this->lock.wait();
+    }
+}
+
+void IntraDecodeGroup::flush()
+{
+    AutoLocker _yes_locked(this->lock);
+
+    for (int i = 0; i < this->nb; i++) {
+        Job* job = &this->jobs[(this->head + i) % this->nb_jobs];
+        if (JOB_QUEUED == job->state)
+            job->state = JOB_DONE;  // not to be taken by workers
+    }
+    while (this->nb_busy)
+        this->lock.wait();
+
+    for (int i = 0; i < this->nb; i++) {
+        Job* job = &this->jobs[(this->head + i) % this->nb_jobs];
+        av_packet_unref(&job->pkt);
+        av_frame_unref(job->frame);
+        job->state = JOB_FREE;
+    }
+    this->head = this->nb = 0;
+    this->draining = 0;
+
+    for (int i = 0; i < this->nb_workers; i++)
+        avcodec_flush_buffers(this->workers[i].avctx);  // all idle now
+}
+
+IntraDecodeGroup::Job* IntraDecodeGroup::take_queued()
+{
+    for (int i = 0; i < this->nb; i++) {
+        Job* job = &this->jobs[(this->head + i) % this->nb_jobs];
+        if (JOB_QUEUED == job->state)
+            return job;
+    }
+    return NULL;
+}
+
+void IntraDecodeGroup::decode_job(AVCodecContext* avctx, Job* job)
+{
+    avctx->skip_frame = (enum AVDiscard)job->skip_frame;
+    avctx->skip_loop_filter = (enum AVDiscard)job->skip_loop_filter;
+    avctx->skip_idct = (enum AVDiscard)job->skip_idct;
+
+    int ret = avcodec_send_packet(avctx, &job->pkt);
+    if (ret >= 0) {
+        ret = avcodec_receive_frame(avctx, job->frame);
+        if (AVERROR(EAGAIN) == ret) {
+            // codec holds it back (e.g. H.264 without reorder info in SPS), there is nothing to wait for
+            avcodec_send_packet(avctx, NULL);
+            ret = avcodec_receive_frame(avctx, job->frame);
+            avcodec_flush_buffers(avctx);
+        }
+    }
+    job->ret = ret < 0 ? ret : 0;
+}
+
+ThreadRetType IntraDecodeGroup::Worker::thread_main()
+{
+    IntraDecodeGroup* g = this->group;
+
+    for (;;) {
+        Job* job = NULL;
+
+        g->lock.lock();
+        while (!g->quit && !(job = g->take_queued()))
+            g->lock.wait();
+        if (g->quit) {
+            g->lock.unlock();
+            break;
+        }
+        job->state = JOB_BUSY;
+        g->nb_busy++;
+        g->lock.unlock();
+
+        decode_job(this->avctx, job);
+
+        g->lock.lock();
+        job->state = JOB_DONE;
+        g->nb_busy--;
+        g->lock.wake(WAKE_ALL);
+        g->lock.unlock();
+    }
+    return (ThreadRetType)0;
+}
+// }}} IntraDecodeGroup section 
+
+// {{{ FrameHistory section 
+int FrameHistory::init(int max_frames, int64_t max_bytes)
+{
+    destroy();
+
+    AutoLocker _yes_locked(this->lock);
+    if (max_frames <= 0)
+        return 0;
+
+    this->ring = (Frame*)av_mallocz_array(max_frames, sizeof(Frame));
+    if (!this->ring)
+        return AVERROR(ENOMEM);
+    this->max_frames = max_frames;
+    this->max_bytes = max_bytes;
+
+    for (int i = 0; i < max_frames; i++)
+        if (!(this->ring[i].frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+    return 0;
+}
+
+void FrameHistory::destroy()
+{
+    AutoLocker _yes_locked(this->lock);
+    if (!this->ring)
+        return;
+
+    for (int i = 0; i < this->max_frames; i++)
+        av_frame_free(&this->ring[i].frame);
+    av_freep(&this->ring);
+    this->max_frames = 0;
+    this->first = this->nb = 0;
+    this->cursor = -1;
+    this->bytes = 0;
+}
+
+void FrameHistory::clear()
+{
+    AutoLocker _yes_locked(this->lock);
+    clear_locked();
+}
+
+void FrameHistory::clear_locked()
+{
+    while (this->nb > 0)
+        drop_oldest();
+    this->first = 0;
+    this->cursor = -1;
+}
+
+int64_t FrameHistory::frame_bytes(const AVFrame* frame)
+{
+    int64_t size = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+        size += frame->buf[i]->size;
+    return size;
+}
+
+void FrameHistory::copy_item(Frame* dst, const Frame* src)
+{
+    AVFrame* frame = dst->frame;
+    *dst = *src;
+    dst->frame = frame;
+    dst->uploaded = 0;
+    av_frame_ref(frame, src->frame);
+}
+
+void FrameHistory::drop_oldest()
+{
+    Frame* vp = at(0);
+    this->bytes -= frame_bytes(vp->frame);
+    av_frame_unref(vp->frame);
+    this->first = (this->first + 1) % this->max_frames;
+    this->nb--;
+    this->cursor = FFMAX(this->cursor - 1, this->nb ? 0 : -1);
+}
+
+void FrameHistory::drop_newest()
+{
+    Frame* vp = at(this->nb - 1);
+    this->bytes -= frame_bytes(vp->frame);
+    av_frame_unref(vp->frame);
+    this->nb--;
+    this->cursor = FFMIN(this->cursor, this->nb - 1);
+}
+
+void FrameHistory::push(const Frame* vp)
+{
+    AutoLocker _yes_locked(this->lock);
+    if (!this->max_frames || !vp->frame->buf[0])
+        return;
+
+    if (this->nb > 0 && !isnan(vp->pts) && vp->pts <= at(this->nb - 1)->pts)
+        return;     // got it already, e.g. frames decoded again after a step back
+
+    int live = this->cursor == this->nb - 1;
+    int64_t size = frame_bytes(vp->frame);
+    while (this->nb > 0 && this->is_full(size))
+        drop_oldest();
+
+    copy_item(at(this->nb), vp);
+    this->nb++;
+    this->bytes += size;
+    if (live)
+        this->cursor = this->nb - 1;
+}
+
+void FrameHistory::prepend(FrameHistory* older)
+{
+    AutoLocker _yes_locked(this->lock);
+    AutoLocker _older_locked(older->lock);
+
+    int inserted = 0;
+    for (int i = older->nb - 1; i >= 0 && this->max_frames; i--) {   // the newest of them first
+        Frame* src = older->at(i);
+        int64_t size = frame_bytes(src->frame);
+
+        // make room by dropping newer frames, which are far from where we're stepping to
+        while (this->is_full(size) && this->nb > inserted + 1)
+            drop_newest();
+        if (this->is_full(size))
+            break;
+
+        this->first = (this->first + this->max_frames - 1) % this->max_frames;
+        copy_item(at(0), src);
+        this->nb++;
+        this->bytes += size;
+        inserted++;
+    }
+
+    if (inserted)
+        this->cursor = inserted - 1;
+    else if (this->cursor < 0 && this->nb > 0)
+        this->cursor = 0;
+    older->clear_locked();
+}
+
+int FrameHistory::step(int dir, double* pts)
+{
+    AutoLocker _yes_locked(this->lock);
+    int to = this->cursor + dir;
+    if (this->nb <= 0 || to < 0 || to >= this->nb)
+        return 0;
+
+    this->cursor = to;
+    *pts = at(to)->pts;
+    return 1;
+}
+
+int FrameHistory::can_step_back(double* oldest_pts)
+{
+    AutoLocker _yes_locked(this->lock);
+    if (this->cursor > 0)
+        return 1;
+
+    *oldest_pts = this->nb > 0 ? at(0)->pts : NAN;
+    return 0;
+}
+
+int FrameHistory::leave(double* pts)
+{
+    AutoLocker _yes_locked(this->lock);
+    if (this->nb <= 0 || this->cursor == this->nb - 1)
+        return 0;
+
+    *pts = at(this->cursor)->pts;
+    this->cursor = this->nb - 1;
+    return 1;
+}
+
+double FrameHistory::newest_pts()
+{
+    AutoLocker _yes_locked(this->lock);
+    return this->nb > 0 ? at(this->nb - 1)->pts : NAN;
+}
+
+int FrameHistory::is_live()
+{
+    AutoLocker _yes_locked(this->lock);
+    return this->cursor == this->nb - 1;
+}
+
+Frame* FrameHistory::peek_cursor()
+{
+    if (this->nb <= 0)
+        return NULL;
+    return at(this->cursor);
+}
+// }}} FrameHistory section
+
+// {{{ Clock section 
+double Clock::get_clock()
+{
+    if (*this->queue_serial != this->serial)
+        return NAN;
+    if (this->paused) {
+        return this->pts;
+    }
+    else {
+        double time = av_gettime_relative() / 1000000.0;
+        return this->pts_drift + time - (time - this->last_updated) * (1.0 - this->speed);
+    }
+}
+
+void Clock::set_clock_at(double pts, int serial, double time)
+{
+    this->pts = pts;
+    this->last_updated = time;
+    this->pts_drift = this->pts - time;
+    this->serial = serial;
+}
+
+void Clock::set_clock(double pts, int serial)
+{
+    double time = av_gettime_relative() / 1000000.0;
     set_clock_at(pts, serial, time);
 }
 
@@ -394,6 +2012,181 @@ int is_realtime(AVFormatContext* s)
     return 0;
 }
 
+static const uint8_t* find_start_code(const uint8_t* p, const uint8_t* end)
+{
+    for (; end - p >= 3; p++) {
+        if (!p[0] && !p[1] && 1 == p[2])
+            return p + 3;
+    }
+    return end;
+}
+
+int is_nonref_packet(enum AVCodecID codec_id, const AVPacket* pkt, int nal_length_size)
+{
+    if (AV_CODEC_ID_H264 != codec_id || !pkt->data)
+        return 0;
+
+    const uint8_t* p = pkt->data;
+    const uint8_t* end = pkt->data + pkt->size;
+
+    while (p < end) {
+        const uint8_t* nal;
+        if (nal_length_size) {
+            if (end - p < nal_length_size)
+                return 0;
+            uint32_t len = 0;
+            for (int i = 0; i < nal_length_size; i++)
+                len = (len << 8) | p[i];
+            nal = p + nal_length_size;
+            if (len > (uint32_t)(end - nal))
+                return 0;
+            p = nal + len;
+        }
+        else {
+            nal = find_start_code(p, end);
+            p = nal;
+        }
+
+        if (nal >= end)
+            return 0;
+
+        int type = nal[0] & 0x1f;
+        if (1 == type || 5 == type)         // coded slice, tells by the 1st one
+            return 0 == (nal[0] & 0x60);    // nal_ref_idc
+    }
+    return 0;
+}
+
+int get_nal_length_size(enum AVCodecID codec_id, const uint8_t* extradata, int extradata_size)
+{
+    if (!extradata)
+        return 0;
+
+    if (AV_CODEC_ID_H264 == codec_id && extradata_size >= 7 && 1 == extradata[0])
+        return (extradata[4] & 0x03) + 1;   // avcC
+
+    if (AV_CODEC_ID_HEVC == codec_id && extradata_size >= 23 
+        && (extradata[0] || extradata[1] || extradata[2] > 1))
+        return (extradata[21] & 0x03) + 1;  // hvcC
+
+    return 0;
+}
+
+void EsCodecSniffer::reset()
+{
+    codec_id = AV_CODEC_ID_NONE;
+    h264_found = hevc_found = 0;
+    h264_size = hevc_size = 0;
+}
+
+void EsCodecSniffer::append_nal(uint8_t* ps, int* ps_size, const uint8_t* nal, int nal_size)
+{
+    static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+
+    if (*ps_size + 4 + nal_size > ES_SNIFF_MAX_EXTRADATA)
+        return;     // repeated too many times, or garbage
+
+    memcpy(ps + *ps_size, start_code, 4);
+    memcpy(ps + *ps_size + 4, nal, nal_size);
+    *ps_size += 4 + nal_size;
+}
+
+enum AVCodecID EsCodecSniffer::sniff(const uint8_t* data, int size, int* used)
+{
+    if (used)
+        *used = FFMAX(size - 3, 0);     // no start code found, but one may begin in the last 3 bytes
+
+    if (AV_CODEC_ID_NONE != this->codec_id || !data)
+        return this->codec_id;
+
+    if (size >= 3 && 0xff == data[0] && 0xd8 == data[1] && 0xff == data[2])   // SOI, then another marker
+        return this->codec_id = AV_CODEC_ID_MJPEG;
+
+    // H.264 and H.265 NAL headers of parameter sets don't collide: 0x67/0x68 (and the like) read as H.265 are 
+    // reserved types, and 0x40/0x42/0x44 read as H.264 are neither SPS nor PPS.
+    const uint8_t* end = data + size;
+    const uint8_t* nal = find_start_code(data, end);
+    while (nal < end) {
+        const uint8_t* next = find_start_code(nal, end);
+        if (next >= end && used) {      // may go on in the next call, sniffed then
+            *used = (int)(nal - 3 - data);
+            break;
+        }
+        const uint8_t* nal_end = next < end ? next - 3 : end;
+        while (nal_end > nal && !nal_end[-1])   // zero_byte of 4-byte start code, trailing_zero_8bits
+            nal_end--;
+        int nal_size = (int)(nal_end - nal);
+
+        if (nal_size >= 2 && !(nal[0] & 0x80)) {    // forbidden_zero_bit
+            int type = nal[0] & 0x1f;
+            if ((7 == type || 8 == type) && (nal[0] & 0x60)) {  // SPS, PPS with nal_ref_idc
+                this->h264_found |= 1 << type;
+                append_nal(this->h264_ps, &this->h264_size, nal, nal_size);
+            }
+
+            type = (nal[0] >> 1) & 0x3f;
+            if (type >= 32 && type <= 34 && !(nal[0] & 0x01) && !(nal[1] & 0xf8) && (nal[1] & 0x07)) {
+                this->hevc_found |= 1 << (type - 32);   // VPS, SPS, PPS of base layer
+                append_nal(this->hevc_ps, &this->hevc_size, nal, nal_size);
+            }
+        }
+        nal = next;
+    }
+
+    if (0x07 == this->hevc_found)
+        this->codec_id = AV_CODEC_ID_HEVC;
+    else if (((1 << 7) | (1 << 8)) == this->h264_found)
+        this->codec_id = AV_CODEC_ID_H264;
+
+    return this->codec_id;
+}
+
+const uint8_t* EsCodecSniffer::get_extradata(int* size) const
+{
+    *size = 0;
+    if (AV_CODEC_ID_H264 == this->codec_id && this->h264_size) {
+        *size = this->h264_size;
+        return this->h264_ps;
+    }
+    if (AV_CODEC_ID_HEVC == this->codec_id && this->hevc_size) {
+        *size = this->hevc_size;
+        return this->hevc_ps;
+    }
+    return NULL;
+}
+
+int is_system_memory_low()
+{
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status) || !status.ullTotalPhys)
+        return 0;
+
+    return status.ullAvailPhys * 100 / status.ullTotalPhys < MEMORY_LOW_PERCENT;
+#else
+    // 'MemAvailable' counts reclaimable page cache too, unlike sysconf(_SC_AVPHYS_PAGES)
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (!f)
+        return 0;
+
+    char line[128];
+    long long total = 0, avail = -1, v;
+    while (fgets(line, sizeof(line), f)) {
+        if (1 == sscanf(line, "MemTotal: %lld kB", &v))
+            total = v;
+        else if (1 == sscanf(line, "MemAvailable: %lld kB", &v))
+            avail = v;
+    }
+    fclose(f);
+
+    if (total <= 0 || avail < 0)
+        return 0;
+
+    return avail * 100 / total < MEMORY_LOW_PERCENT;
+#endif
+}
+
 template<>
 void AutoReleasePtr<AVCodecContext>::release()
 {
@@ -43,6 +43,7 @@ extern "C"
 #include "libavutil/avassert.h"
 #include "libavutil/time.h"
 #include "libavutil/bprint.h"
+#include "libavutil/adler32.h"
 #include "libavformat/avformat.h"
 #include "libavdevice/avdevice.h"
 #include "libswscale/swscale.h"
@@ -52,6 +53,8 @@ extern "C"
 }
 
 #include <assert.h>
+#include <atomic>
+#include <new>
 
 #ifdef _WIN32 
 #include "../utils/utils.h"
@@ -60,7 +63,8 @@ extern "C"
 #endif 
 
 
-#define MAX_QUEUE_SIZE (15 * 1024 * 1024)
+#define MAX_QUEUE_SIZE (15 * 1024 * 1024)   // of all V/A packet queues (channels included) in one SimpleAVDecoder
+#define MAX_CHANNELS   16                   // channel 0 is the primary V/A, see SimpleAVDecoder::open_channel()
 #define QUEUE_ENOUGH_TIME    (10.0)
 #define QUEUE_ENOUGH_PKG     (25 * (int)QUEUE_ENOUGH_TIME )
 
@@ -92,6 +96,31 @@ extern "C"
 /* we use about AUDIO_DIFF_AVG_NB A-V differences to make the average */
 #define AUDIO_DIFF_AVG_NB   20
 
+/* at fast playback speed, video decoder skips frames no one would see */
+#define SKIP_NONREF_SPEED   2.0     // from this speed on, decode ref frames only
+#define SKIP_NONKEY_SPEED   4.0     // from this speed on, decode keyframes only
+
+/* adaptive degradation of video decoding, see VideoDecoder::review_degrade_level() */
+#define DEGRADE_REVIEW_INTERVAL  1.0    // in seconds
+#define DEGRADE_LATE_THRESHOLD   0.1    // in seconds, degrade if frames are this late on average 
+#define DEGRADE_RECOVER_LATE     0.02   // in seconds, frames are 'in time' if no later than this on average
+#define DEGRADE_BUSY_THRESHOLD   0.9    // degrade if decoder thread is busy this much of the time
+#define DEGRADE_RECOVER_BUSY     0.5    // decoder has spare power if busy less than this
+#define DEGRADE_RECOVER_REVIEWS  3      // step back up after this many 'good' reviews in a row
+
+/* reverse playback, see VideoState::read_reverse_gop() and VideoDecoder::reverse_step() */
+#define REVERSE_SPEED_MAX        4.0
+#define REVERSE_GOP_MAX_FRAMES   128    // frames cached per GOP, longer GOPs are decimated to stay in bound
+#define REVERSE_SEEK_BACKOFF     1.0    // in seconds, step further back when seek lands at/after the wanted GOP
+#define REVERSE_SEEK_TRIES       16
+
+/* frames shown lately kept for stepping back/forward, see FrameHistory */
+#define STEP_HISTORY_FRAMES      32
+#define STEP_HISTORY_BYTES       (256 * 1024 * 1024)
+
+/* accurate seek, a frame ending within this (in seconds) after the target is taken as before it */
+#define ACCURATE_SEEK_EPS        0.001
+
 /* polls for possible required screen refresh at least this often, should be less than 1/fps */
 #define REFRESH_RATE 0.01
 
@@ -101,10 +130,39 @@ extern "C"
 
 #define CURSOR_HIDE_DELAY 1000000
 
+/* reader thread sleeps at most this long when it has nothing to do (buffer full, EOF), unless notified */
+#define READER_IDLE_WAIT_MS   100
+/* reader thread retries this often after a read error */
+#define READER_RETRY_WAIT_MS  10
+
 #define USE_ONEPASS_SUBTITLE_RENDER 1
 
 #define SWS_FLAG_4_PIXELFORMAT_UNKNOWN  SWS_BICUBIC
 
+/* keep data touched by different threads on different cache lines */
+#define CACHE_LINE_SIZE 64
+
+/* slots of a PQ_IMPL_SPSC_RING packet queue, must be power of 2 */
+#define PACKET_RING_SIZE 2048
+
+/* max packets a decoder takes from its packet queue at one time */
+#define PACKET_BATCH_SIZE 16
+
+/* pooled decoding, see DecodePool */
+#define DECODE_POOL_MAX_TASKS 1024  // decoders on the pool at a time, others fall back to a thread each
+#define DECODE_POOL_SLICE     8     // decode steps a task takes before leaving its worker to others
+
+/* parallel decoding of intra-only streams, see IntraDecodeGroup */
+#define INTRA_MAX_WORKERS       16
+#define INTRA_JOBS_PER_WORKER   2   // pkts in flight per worker, so none idles between its jobs
+
+/* idle codec contexts kept for reuse, see CodecContextCache */
+#define CODEC_CACHE_MAX_ENTRIES 16
+
+/* raw ES of unknown codec, see SimpleAVDecoder::open_es() */
+#define ES_SNIFF_MAX_BYTES  (8 * 1024 * 1024)   // give up if codec not told in this many bytes
+#define ES_SNIFF_MAX_HELD   8                   // newest pkts held till the codec is told, older ones dropped
+
 
 
 typedef struct MyAVPacketListNode {  // 扩展了 AVPacket，增加serial， 将来可以考虑改成继承 AVPacke，再套一个std::list
@@ -113,33 +171,132 @@ typedef struct MyAVPacketListNode {  // 扩展了 AVPacket，增加serial， 将
     int serial;
 } MyAVPacketListNode;
 
+// free-list of MyAVPacketListNode, so that put/get/flush dont hit the allocator for every packet.
+// no concurrency protection, the owner (PacketQueue) calls it with its lock held.
+class PacketNodePool
+{
+public:
+    PacketNodePool()
+    {
+        free_nodes = NULL;
+        nb_free_nodes = 0;
+        hits = 0;
+        misses = 0;
+    }
+
+    ~PacketNodePool()
+    {
+        release_all();
+    }
+
+    MyAVPacketListNode* alloc_node();                // reuse a recycled node if any, otherwise av_malloc one
+    void recycle_node(MyAVPacketListNode* node);     // give the node back, the pkt inside must have been moved out/unref'ed
+    void release_all();                              // really free all recycled nodes
+
+    // {{ statistics
+    int64_t hits;       // alloc_node() served from free list
+    int64_t misses;     // alloc_node() had to av_malloc
+    int nb_free_nodes;  // nodes sitting in free list now
+    // }} statistics
+
+protected:
+    MyAVPacketListNode* free_nodes;
+};
+
+class DecodeTask;
+
+// lets a thread sleep until 'something changed' (e.g. reader waits for room in packet queues),
+// without polling. notify() is cheap when nobody is sleeping: no lock, no syscall.
+// usage on the waiting side:
+//      unsigned epoch = sig.get_epoch();
+//      if (!condition_ok())  sig.wait(epoch, timeout_ms);   // returns at once if notified after get_epoch()
+class WakeupSignal
+{
+public:
+    WakeupSignal()
+        : epoch(0), waiters(0)
+    {
+    }
+
+    unsigned get_epoch() const
+    {
+        return epoch.load();
+    }
+
+    void notify();
+
+    // return 0 -- notified,  nonzero -- timeout
+    int wait(unsigned seen_epoch, unsigned int timeout_ms);
+
+protected:
+    std::atomic<unsigned> epoch;
+    std::atomic<int> waiters;
+    SimpleConditionVar cond;
+};
+
+typedef enum
+{
+    PQ_IMPL_LINKED_LIST = 0,  // linked list, every put/get takes the lock
+    PQ_IMPL_SPSC_RING   = 1,  // bounded lock-free ring, only for 1 producer + 1 consumer. 
+                              // takes the lock only when one side has to sleep (ring empty or full).
+}PacketQueueImpl;
+
+struct PacketRing   // storage of PQ_IMPL_SPSC_RING
+{
+    PacketRing()
+        : head(0), tail(0), consumer_waiting(0), producer_waiting(0)
+    {
+    }
+
+    char pad0[CACHE_LINE_SIZE];
+    std::atomic<unsigned> head;     // next slot to read. moved by consumer, and by flush (from producer side)
+    char pad1[CACHE_LINE_SIZE];
+    std::atomic<unsigned> tail;     // next slot to write. moved by producer only
+    char pad2[CACHE_LINE_SIZE];
+    std::atomic<int> consumer_waiting;  // consumer is (going to be) sleeping on PacketQueue::cond
+    std::atomic<int> producer_waiting;  // producer is (going to be) sleeping on PacketQueue::cond
+    char pad3[CACHE_LINE_SIZE];
+
+    MyAVPacketListNode slots[PACKET_RING_SIZE];  // 'next' is not used
+};
+
 class PacketQueue
 {
 public:
     MyAVPacketListNode* first_pkt, * last_pkt;
-    int nb_packets;
-    int size;
-    int64_t total_duration;  // sum of each packet's duration in q
+    std::atomic<int> nb_packets;
+    std::atomic<int> size;
+    std::atomic<int64_t> total_duration;  // sum of each packet's duration in q
     int abort_request;
     int serial;
 
+    static int default_impl;  // PacketQueueImpl used by queues constructed without spec one.
+    int impl;                 // PacketQueueImpl, decided at construction
+
     static AVPacket flush_pkt;
 
     int static is_flush_pkt(const AVPacket& to_check);
     int static is_null_pkt(const AVPacket& to_check);
 
     SimpleConditionVar cond;
+    PacketNodePool node_pool;   // protected by 'cond'
 
-    PacketQueue()
-    {
-        first_pkt = NULL;
-        last_pkt = NULL;
-        nb_packets = 0;
-        size = 0;
-        total_duration = 0;
-        serial = 0;
-        abort_request = 1;
-    }
+    WakeupSignal* space_signal; // if set, notified when packets leave the queue (get/flush). ref only.
+    DecodeTask*   consumer_task; // if set, scheduled on DecodePool when packets come (put/abort). ref only.
+
+    // {{ overflow policy for live source. 
+    // when a keyframe comes while the queue holds more than the limits, all queued pkts are dropped,
+    // followed by a flush_pkt (serial++), so that decoder resyncs at this keyframe.
+    // only checked in packet_queue_put/packet_queue_put_many (producer side).
+    void set_overflow_policy(int max_bytes, int64_t max_duration); // 'max_duration' in unit of stream time_base. 0 means no limit.
+    int     overflow_max_bytes;
+    int64_t overflow_max_duration;
+    int64_t overflow_drops;         // statistics: how many times we dropped 
+    int64_t overflow_dropped_pkts;  // statistics: how many pkts we dropped 
+    // }}
+
+    PacketQueue(int impl = default_impl);
+    ~PacketQueue();
 
     // take onwership of pkt. If failed to put, release it.
     int packet_queue_put(AVPacket* pkt);
@@ -153,20 +310,136 @@ public:
 
     void packet_queue_start();
 
+    // take onwership of all 'nb' pkts at one lock, the consumer is waken at most once. 
+    // return nb if all put, < 0 if failed (the pkts failed to put are released).
+    int packet_queue_put_many(AVPacket* pkts, int nb);
+
     // return < 0 if aborted, 0 if no packet and > 0 if packet.  
     int packet_queue_get(AVPacket* pkt, int block, /*out*/ int* serial);
 
+    // get at most 'max' pkts at one lock, block (if asked) only when queue is empty. 
+    // return < 0 if aborted, 0 if no packet, otherwise number of pkts got.
+    int packet_queue_get_many(/*out*/ AVPacket* pkts, /*out*/ int* serials, int max, int block);
+
     int packet_queue_put_nullpacket(int stream_index);
 
 protected:
     int packet_queue_put_private(AVPacket* pkt);
 
+    int  is_overflowed(const AVPacket* incoming);   // check overflow policy, producer side only
+    void drop_for_overflow();
+    int64_t oldest_pts();  // pts of the oldest queued pkt which has one. producer side only
+
+    // {{ PQ_IMPL_SPSC_RING section
+    PacketRing* ring;  // non-NULL iff impl is PQ_IMPL_SPSC_RING
+
+    int  ring_put(AVPacket* pkt);  // producer side, blocks only when ring is full
+    int  ring_get(AVPacket* pkt, int block, /*out*/ int* serial); // consumer side, blocks only when ring is empty
+    int  ring_get_many(/*out*/ AVPacket* pkts, /*out*/ int* serials, int max, int block); // claims up to 'max' slots by one CAS
+    void ring_flush(); // must be called from producer side (or while producer is idle)
+    void ring_wake_waiter(std::atomic<int>& waiting);
+    // }} PQ_IMPL_SPSC_RING section
+};
+
+// parser stage in front of a PacketQueue: byte chunks of any size (pipe, serial capture, transport chunks) in,
+// access units out, by av_parser_parse2(). see SimpleAVDecoder::feed_bytes(). no concurrency protection, 
+// the feeder owns it.
+class Packetizer
+{
+public:
+    Packetizer()
+    {
+        parser = NULL;
+        parse_context = NULL;
+        init_failed = 0;
+        units = 0;
+        copied_units = 0;
+    }
+    ~Packetizer()
+    {
+        close();
+    }
+
+    // parse as what 'avctx' decodes (codec, and extradata which tells avcC/hvcC from annex B).
+    // Return:  0 -- success, non-zero -- no parser for the codec.
+    int  init(const AVCodecContext* avctx);
+    void close();
+    int  is_inited() const
+    {
+        return parser != NULL;
+    }
+    int  has_failed() const     // init() failed, no need to try again
+    {
+        return init_failed;
+    }
+
+    // take ownership of 'chunk', NULL flushes the unit still buffered (e.g. at EOF). its timestamps go to the unit
+    // starting in it. units completed are put into 'q' in batches, with keyframe flag set by what parser tells.
+    // units lying in the (refcounted) 'chunk' ref it, only those spanning chunks are copied. 'whole_units' tells
+    // 'chunk' holds whole units only, then none is copied. Return: number of units put, <0 if failed.
+    int  packetize(AVPacket* chunk, int whole_units, PacketQueue* q);
+    void reset();   // drop the bytes buffered, e.g. at seek
+
+    // {{ statistics
+    int64_t units;          // put into queue
+    int64_t copied_units;   // of 'units', assembled in parser's own buffer then copied out
+    // }} statistics
+
+protected:
+    AVCodecParserContext* parser;
+    AVCodecContext* parse_context;  // av_parser_parse2() wants one, and the decoder's is not ours to touch
+    int init_failed;
+
+    int  make_unit(AVPacket* unit, const AVPacket* chunk, const uint8_t* data, int size);
+};
+
+/* size classes of PacketBufferPool, padding excluded. bigger pkts are allocated as usual */
+#define PACKET_POOL_MIN_SIZE  (4 * 1024)
+#define PACKET_POOL_CLASSES   11        // doubling from PACKET_POOL_MIN_SIZE, up to 4M
+
+struct PacketBufferPoolStats
+{
+    int64_t nb_gets;        // pkts built from pool
+    int64_t nb_allocs;      // buffers really allocated (pool had none to reuse)
+    int64_t nb_oversize;    // pkts too big for any class, allocated as usual
+};
+
+// recycled pkt buffers for bytes the caller doesn't keep, e.g. ES callbacks of camera SDK, see 
+// SimpleAVDecoder::make_pooled_pkt(). one AVBufferPool per size class, so a feeder at steady bitrate stops 
+// hitting the allocator once each class has buffers enough for what's queued.
+class PacketBufferPool
+{
+public:
+    PacketBufferPool();
+    ~PacketBufferPool();    // buffers still referenced by pkts stay valid, they are freed on their last unref
+
+    // copy 'data' into 'pkt' (initialized here), padding zeroed. thread safe. 
+    // Return:  0 -- success, <0 -- error
+    int  make_packet(AVPacket* pkt, const uint8_t* data, int size);
+
+    // 'pkt' refs 'data' of the caller, no copy at all. 'data' must have AV_INPUT_BUFFER_PADDING_SIZE bytes (zeroed) 
+    // beyond 'size'. 'release' is called with 'opaque' and 'data' when the last ref is gone, by whoever drops it
+    // (decoder thread mostly). Return:  0 -- success, <0 -- error, 'release' is not called then.
+    static int wrap_packet(AVPacket* pkt, uint8_t* data, int size, void (*release)(void* opaque, uint8_t* data), void* opaque);
+
+    void get_stats(PacketBufferPoolStats* stats);
+
+protected:
+    SimpleMutex lock;   // for creating pools only
+    std::atomic<AVBufferPool*> pools[PACKET_POOL_CLASSES];  // created on demand
+    std::atomic<int64_t> nb_gets, nb_allocs, nb_oversize;
+
+    AVBufferPool* get_pool(int size_class);
+    static AVBufferRef* pool_alloc(void* opaque, int size);
 };
 
 #define VIDEO_PICTURE_QUEUE_SIZE 3
 #define SUBPICTURE_QUEUE_SIZE 16
 #define SAMPLE_QUEUE_SIZE 9
 #define FRAME_QUEUE_SIZE FFMAX(SAMPLE_QUEUE_SIZE, FFMAX(VIDEO_PICTURE_QUEUE_SIZE, SUBPICTURE_QUEUE_SIZE))
+#define FRAME_QUEUE_MAX_DEPTH 64   // hard limit of a frame queue's depth, adaptive or not
+#define FRAME_QUEUE_ADAPT_INTERVAL 1.0  // in seconds, how often adaptive frame queue depth is reviewed
+#define HOLD_PICTURE_TIMEOUT 5.0        // in seconds, a held picture with no video stream opened after it is dropped
 
 
 class Clock {
@@ -212,15 +485,231 @@ typedef struct Frame {
     AVRational sample_aspect_ratio;
     int uploaded;
     int flip_v;
+    int sub_x, sub_y;     // subtitle only: RGBA bitmap 'frame' goes here on a canvas of 'width' x 'height' (0 -- video size)
 } Frame;
 
+/* alignment of frame buffers from FrameBufferPool, enough for AVX-512 */
+#define FRAME_BUFFER_ALIGN  64
+/* buffers no less than this are candidates of huge page backing */
+#define HUGE_PAGE_SIZE      (2 * 1024 * 1024)
+
+struct FrameBufferPoolStats
+{
+    int64_t nb_gets;        // get_buffer2 served by pool
+    int64_t nb_allocs;      // buffers really allocated (pool had none to reuse)
+    int64_t nb_fallbacks;   // get_buffer2 handed over to avcodec_default_get_buffer2
+    int64_t nb_reinits;     // pool rebuilt for new geometry/format
+    int64_t alloced_bytes;  // sum of bytes really allocated
+    int64_t huge_page_bytes;// part of 'alloced_bytes' backed by huge pages
+};
+
+// AVCodecContext.get_buffer2 backed by AVBufferPool, one pool per plane, sized from current geometry/format.
+// buffers are reused once the frames referencing them are freed (e.g. frame_queue_next), 
+// so decoding loop does not hit the allocator (and page faults) for every frame.
+class FrameBufferPool
+{
+public:
+    FrameBufferPool();
+    ~FrameBufferPool();
+
+    static int default_enabled;     // attach() does nothing if 0
+    static int default_huge_pages;  // back big buffers with huge pages (linux only, madvise)
+
+    // must be called before avcodec_open2.
+    void attach(AVCodecContext* avctx);
+    void uninit();  // buffers still referenced by frames stay valid, they are freed on their last unref
+    void trim();    // drop idle buffers (e.g. under memory pressure), pools are rebuilt on demand
+
+    void get_stats(FrameBufferPoolStats* stats);
+
+protected:
+    SimpleMutex lock;   // get_buffer2 may be called from frame threads
+    int use_huge_pages;
+    FrameBufferPoolStats stats;
+
+    // {{ current geometry/format of 'pools'
+    AVBufferPool* pools[AV_NUM_DATA_POINTERS];
+    int nb_pools;
+    int linesize[AV_NUM_DATA_POINTERS];
+    int format;
+    int width, height;      // video
+    int channels, nb_samples;   // audio
+    // }}
+
+    static int get_buffer2(AVCodecContext* avctx, AVFrame* frame, int flags);
+    static AVBufferRef* pool_alloc(void* opaque, int size);
+
+    int update_video_pools(AVCodecContext* avctx, AVFrame* frame);
+    int update_audio_pools(AVCodecContext* avctx, AVFrame* frame);
+    void release_pools();
+};
+
+// a decoder run by DecodePool instead of a thread of its own.
+// it's scheduled whenever it may have work (packets come, frame queue gives a slot back),
+// and it's never run by 2 workers at the same time.
+class DecodeTask
+{
+public:
+    DecodeTask()
+        : task_state(TASK_DETACHED)
+    {
+    }
+    virtual ~DecodeTask() {}
+
+    // by a pool worker. do a slice of work without blocking, return 1 if there is more to do right away.
+    virtual int run_task() = 0;
+
+protected:
+    friend class DecodePool;
+    enum {
+        TASK_IDLE,          // nothing to do, waits for schedule()
+        TASK_QUEUED,        // in a worker's deque
+        TASK_RUNNING,
+        TASK_RUNNING_AGAIN, // scheduled while running, goes back to a deque after this run
+        TASK_DETACHED,      // not on the pool, schedule() does nothing
+    };
+    std::atomic<int> task_state;
+};
+
+// fixed workers (one per core) shared by all decoders of the process. each worker has a deque of tasks,
+// takes from its own, steals from others when it runs dry, and sleeps when all are empty.
+class DecodePool
+{
+public:
+    static int default_enabled;     // decoders started after it's set run on the pool, instead of a thread each
+
+    static int  attach(DecodeTask* task);   // start scheduling 'task'. Return: 0 -- success, non-zero -- pool is full
+    static void detach(DecodeTask* task);   // wait until 'task' is neither queued nor running, no scheduling after it
+    static void schedule(DecodeTask* task); // 'task' may have work, from any thread. cheap if it's queued already
+    static int  get_worker_count();
+
+protected:
+    class Worker
+        : public BaseThread
+    {
+    public:
+        DecodePool* pool;
+        SimpleMutex lock;   // deque, the owner takes from the back, thieves from the front
+        DecodeTask* tasks[DECODE_POOL_MAX_TASKS];
+        int first, nb;
+
+        void push_back(DecodeTask* task);
+        DecodeTask* pop_back();
+        DecodeTask* pop_front();
+        virtual ThreadRetType thread_main();
+    };
+
+    DecodePool(int nb_workers);
+    static DecodePool* get_instance();   // started at first use, lives till process exits
+    static thread_local Worker* current_worker;   // NULL if calling thread is not a worker
+
+    Worker* workers;
+    int nb_workers;
+    std::atomic<unsigned> next_worker;  // round robin for tasks scheduled out of the pool
+    std::atomic<int> nb_tasks;          // attached
+    std::atomic<int> nb_queued;         // in all deques
+    std::atomic<int> nb_sleeping;
+    SimpleConditionVar work_signal;     // idle workers sleep on it
+    std::atomic<int> nb_detaching;
+    SimpleConditionVar idle_signal;     // detach() sleeps on it till its task goes idle, woken only if 'nb_detaching'
+
+    void push(DecodeTask* task);
+    DecodeTask* take(Worker* self);     // own deque first, then steal
+    void run(DecodeTask* task);
+};
+
+// consecutive pkts of an intra-only stream (MJPEG, ProRes, all-I H.264: each pkt stands alone) decoded at once
+// by a group of codec contexts, a thread each. frames come out in the order their pkts went in, which is pts order
+// for intra-only codecs. it stands in for avcodec_send_packet/receive_frame/flush_buffers of a decoder (see 
+// Decoder::codec_send()), so serials, flush pkts and draining work as they do with one context.
+class IntraDecodeGroup
+{
+public:
+    IntraDecodeGroup();
+    ~IntraDecodeGroup();
+
+    // 'nb_workers' single threaded contexts like 'avctx' (opened), frames from 'buffer_pool' if given.
+    // Return:  0 -- success, non-zero -- error
+    int  init(const AVCodecContext* avctx, int nb_workers, FrameBufferPool* buffer_pool);
+    void destroy();
+    int  get_worker_count() const
+    {
+        return nb_workers;
+    }
+
+    // as avcodec_send_packet(): AVERROR(EAGAIN) if all jobs are in flight, NULL 'pkt' to drain.
+    // skip_frame/skip_loop_filter/skip_idct of 'tuning' go with the pkt, decoder may change them on the fly.
+    int  send(const AVPacket* pkt, const AVCodecContext* tuning);
+    // as avcodec_receive_frame(), but waits for the oldest job if no pkt could go in meanwhile: all jobs 
+    // in flight, draining, or 'more_input' 0 (nothing to send, so waiting costs no parallelism, only latency if not)
+    int  receive(AVFrame* frame, int more_input);
+    void flush();   // drop all jobs, waits for those being decoded
+
+    // intra-only by codec descriptor, or H.264 of an intra profile
+    static int is_intra_only(const AVCodecParameters* codec_para);
+
+protected:
+    enum { JOB_FREE, JOB_QUEUED, JOB_BUSY, JOB_DONE };
+    struct Job
+    {
+        AVPacket pkt;
+        AVFrame* frame;
+        int      state;
+        int      ret;       // 0 -- 'frame' decoded
+        int      skip_frame, skip_loop_filter, skip_idct;
+    };
+
+    class Worker
+        : public BaseThread
+    {
+    public:
+        IntraDecodeGroup* group;
+        AVCodecContext*   avctx;
+        virtual ThreadRetType thread_main();
+    };
+
+    SimpleConditionVar lock;    // guards 'jobs', woken when a job is queued or done
+    Job     jobs[INTRA_MAX_WORKERS * INTRA_JOBS_PER_WORKER];
+    int     nb_jobs;            // in use, INTRA_JOBS_PER_WORKER for each worker
+    int     head, nb;           // in flight: 'nb' from jobs[head] on, in pkt order
+    int     nb_busy;
+    int     draining;
+    int     quit;
+    Worker* workers;
+    int     nb_workers;
+
+    Job* take_queued();         // oldest queued job, caller holds 'lock'
+    static void decode_job(AVCodecContext* avctx, Job* job);
+};
+
 class FrameQueue
 {
 public:
-    int frame_queue_init(PacketQueue* pktq, int max_size, int keep_last);
+    FrameQueue()
+        : queue(NULL), capacity(0)
+    {
+        max_size = 0;
+        keep_last = 0;
+        producer_task = NULL;
+    }
+
+    // 'capacity' is the max depth it could grow to later by frame_queue_set_depth(), 0 means same as 'max_size'
+    int frame_queue_init(PacketQueue* pktq, int max_size, int keep_last, int capacity = 0);
     void frame_queue_destory();
     void frame_queue_signal();
 
+    // change depth at runtime, clipped to [1 + keep_last, capacity]. return the new depth.
+    // when shrinking, frames already queued are kept, producer just waits longer.
+    int frame_queue_set_depth(int depth);
+    int frame_queue_get_depth() const
+    {
+        return max_size;
+    }
+    int frame_queue_get_capacity() const
+    {
+        return capacity;
+    }
+
     Frame* frame_queue_peek();          // 无并发保护，获得‘读头’,逻辑上‘接下来要上屏的帧’
     Frame* frame_queue_peek_next();     // 无并发保护 ,‘接下来要上屏的帧’ 的‘后一帧’
     Frame* frame_queue_peek_last();     // 无并发保护，逻辑上 ‘已经上屏的帧’
@@ -229,8 +718,13 @@ public:
     Frame* frame_queue_peek_readable_nowait(); // 有并发保护
 
     void frame_queue_next();        //  移动‘读头’，aka ‘出队列’
+    int  frame_queue_purge(int serial); // by consumer: drop undisplayed frames not of 'serial' at once, wakes producer. return how many
 
-    Frame* frame_queue_peek_writable();   // 获得‘写头’，写完之后用 frame_queue_push 移动‘写头’。有并发保护
+    // 获得‘写头’，写完之后用 frame_queue_push 移动‘写头’。有并发保护
+    // NULL if aborted, or if 'serial' (of the frame to write, -1 -- don't care) is stale, i.e. a seek came.
+    // caller tells the two apart by 'pktq->abort_request'. frame_queue_signal() wakes a waiting one to see it.
+    Frame* frame_queue_peek_writable(int serial = -1);
+    Frame* frame_queue_peek_writable_nowait(); // NULL if queue is full
     void frame_queue_push();              // ‘入队列’
 
     static void unref_item(Frame* vp);
@@ -244,6 +738,7 @@ public:
 
     PacketQueue* pktq;
     SimpleConditionVar fq_signal;
+    DecodeTask* producer_task;  // if set, scheduled on DecodePool when a slot is given back. ref only.
 
     int is_last_frame_shown() const
     {
@@ -251,7 +746,20 @@ public:
     }
 
 protected:
-    Frame queue[FRAME_QUEUE_SIZE];
+    Frame* queue;       // ring of 'capacity' slots, at most 'max_size' of which are used at a time
+    int capacity;
+
+    // only 1 producer (decoder thread) and 1 consumer (refresh/audio callback), so indices need no lock. 
+    // each side writes only its own counter, which sits on its own cache line; size = nb_pushed - nb_nexted.
+    // 'fq_signal' is only touched when a side has to sleep (full/empty), or has to wake the sleeping peer.
+    char pad0[CACHE_LINE_SIZE];
+    // {{ producer side
+    std::atomic<unsigned> nb_pushed;
+    int windex;
+    // }}
+    char pad1[CACHE_LINE_SIZE];
+    // {{ consumer side
+    std::atomic<unsigned> nb_nexted;
     int rindex;         // 最初的‘读头’
     int rindex_shown;   // rindex指向的位置，是否曾经被 shown过
                         // rindex + rindex_shown 构成逻辑上的‘读头’ 
@@ -259,17 +767,124 @@ protected:
                         // 这样 rindex + rindex_shown 是‘读头’ , 用 frame_queue_peek() 看;
                         // rindex 是‘刚刚画过的一帧’, 用 frame_queue_peek_last() 看;
                         // rindex + rindex_shown + 1 是‘读头’后面一帧, 用 frame_queue_peek_next() 看。
-    int windex;
-    int size;
-    int max_size;
+    // }}
+    char pad2[CACHE_LINE_SIZE];
+    std::atomic<int> producer_waiting;
+    std::atomic<int> consumer_waiting;
+    std::atomic<int> max_size;  // current depth
     int keep_last;
 
+    int size() const
+    {
+        return (int)(nb_pushed.load() - nb_nexted.load());
+    }
+    void wake_waiter(std::atomic<int>& waiting);
+};
+
+// refs of frames shown lately, kept beside FrameQueue so that stepping back/forward within them needs no decoding.
+// bounded by both frame count and bytes, oldest ones go first. 
+// a cursor points to the frame on screen while stepping, it's at the newest one otherwise ('live').
+// used by refresh loop, and by decoder thread when it refills older frames. all methods lock 'lock' except noted.
+class FrameHistory
+{
+public:
+    FrameHistory()
+        : ring(NULL), max_frames(0), max_bytes(0)
+    {
+        first = nb = 0;
+        cursor = -1;
+        bytes = 0;
+    }
+
+    int  init(int max_frames, int64_t max_bytes);  // 0 'max_frames' disables it
+    void destroy();
+    void clear();
+    int  is_enabled() const
+    {
+        return max_frames > 0;
+    }
+
+    void push(const Frame* vp);         // ref 'vp' as the newest, ignored if it's not newer than the newest. cursor follows if live
+    void prepend(FrameHistory* older);  // move all frames of 'older' before the oldest one, cursor goes to the newest of them
+    int  step(int dir, double* pts);    // move cursor by 'dir' (-1, 0, +1), return 1 and pts of the frame it points to if it could
+    int  can_step_back(double* oldest_pts); // 0 if cursor is at the oldest one, whose pts goes to 'oldest_pts' (NaN if empty)
+    int  leave(double* pts);            // back to live, return 1 and pts of the frame cursor pointed to if it was not live
+    int  is_live();
+    double newest_pts();
+
+    Frame* peek_cursor();               // frame under cursor, NULL if empty. caller holds 'lock'
+
+    SimpleConditionVar lock;
+
+protected:
+    Frame*  ring;
+    int     max_frames;
+    int64_t max_bytes;
+    int     first, nb;  // oldest one is ring[first]
+    int     cursor;     // offset from 'first', -1 when empty
+    int64_t bytes;
+
+    Frame*  at(int offset)
+    {
+        return &ring[(first + offset) % max_frames];
+    }
+    int  is_full(int64_t more_bytes) const
+    {
+        return nb >= max_frames || (nb > 0 && bytes + more_bytes > max_bytes);
+    }
+    void drop_oldest();
+    void drop_newest();
+    void clear_locked();
+    static int64_t frame_bytes(const AVFrame* frame);
+    static void copy_item(Frame* dst, const Frame* src);
 };
 
 AString av_strerror2(int err);
 
 int is_realtime(AVFormatContext* s);
 
+// return 1 if we are sure no other frame refs the one in 'pkt', which then could be dropped before decoding.
+// return 0 if it is a ref frame, or we can't tell (only H.264 is parsed by now).
+// 'nal_length_size' is 0 for annex B stream, otherwise the size of NAL length prefix (avcC).
+int is_nonref_packet(enum AVCodecID codec_id, const AVPacket* pkt, int nal_length_size);
+
+// size of NAL length prefix told by H.264/H.265 'extradata', 0 means annex B (start code)
+int get_nal_length_size(enum AVCodecID codec_id, const uint8_t* extradata, int extradata_size);
+
+// tells the codec of a raw video ES (annex B H.264/H.265, or MJPEG) from its head, see SimpleAVDecoder::open_es().
+// H.264 is told by SPS + PPS, H.265 by VPS + SPS + PPS, those found are kept as (annex B) extradata.
+#define ES_SNIFF_MAX_EXTRADATA  4096
+class EsCodecSniffer
+{
+public:
+    EsCodecSniffer()
+    {
+        reset();
+    }
+    void reset();
+
+    // 'data' holds whole NAL units, e.g. one access unit. return the codec once told, AV_CODEC_ID_NONE if not yet.
+    // if 'used' is given, 'data' is any bytes of the ES, whose last NAL may go on in the next call: it's left 
+    // unsniffed and '*used' tells where the next call should start from.
+    enum AVCodecID sniff(const uint8_t* data, int size, int* used = NULL);
+
+    // parameter sets of the told codec, NULL if none. valid till reset()
+    const uint8_t* get_extradata(int* size) const;
+
+protected:
+    enum AVCodecID codec_id;
+    int  h264_found, hevc_found;    // bit mask of parameter sets seen, by the NAL type of each
+    int  h264_size, hevc_size;
+    uint8_t h264_ps[ES_SNIFF_MAX_EXTRADATA];
+    uint8_t hevc_ps[ES_SNIFF_MAX_EXTRADATA];
+
+    static void append_nal(uint8_t* ps, int* ps_size, const uint8_t* nal, int nal_size);
+};
+
+// is free physical memory below MEMORY_LOW_PERCENT of total ?
+#define MEMORY_LOW_PERCENT  10
+int is_system_memory_low();
+
 inline int compute_mod(int a, int b)
 {
     return a < 0 ? a % b + b : a % b;
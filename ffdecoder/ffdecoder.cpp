@@ -37,7 +37,41 @@ void Decoder::onetime_global_init()
     PacketQueue::flush_pkt.data = (uint8_t*)&PacketQueue::flush_pkt;
 }
 
-AVCodecContext* Decoder::create_codec_directly( const AVCodecParameters * codec_para, const StreamParam* extra_para )
+int DecoderProfile::load_preset(const char* name)
+{
+    if (!strcmp(name, "latency")) {
+        thread_count = 0;
+        thread_type = FF_THREAD_SLICE;  // frame threads hold back 'thread_count' frames
+    }
+    else if (!strcmp(name, "throughput")) {
+        thread_count = av_cpu_count();
+        thread_type = FF_THREAD_FRAME;
+        intra_workers = av_cpu_count();
+    }
+    else {
+        return 1;
+    }
+    return 0;
+}
+
+void DecoderProfile::apply(AVCodecContext* codec_context, const AVCodec* codec) const
+{
+    codec_context->thread_count = this->thread_count;
+    codec_context->thread_type = this->thread_type;
+    codec_context->skip_loop_filter = (enum AVDiscard)this->skip_loop_filter;
+
+    codec_context->lowres = this->lowres;
+    if (codec_context->lowres > codec->max_lowres) {
+        av_log(codec_context, AV_LOG_WARNING, "The maximum value for lowres supported by the decoder is %d\n", codec->max_lowres);
+        codec_context->lowres = codec->max_lowres;
+    }
+
+    if (this->fast)
+        codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+}
+
+AVCodecContext* Decoder::create_codec_directly( const AVCodecParameters * codec_para, const StreamParam* extra_para
+    , FrameBufferPool* buffer_pool, const DecoderProfile* profile)
 { 
     AVCodecContext* codec_context = avcodec_alloc_context3(NULL);
     if (!codec_context)
@@ -59,6 +93,12 @@ AVCodecContext* Decoder::create_codec_directly( const AVCodecParameters * codec_
     }
     codec_context->codec_id = codec->id;  
 
+    if (buffer_pool)
+        buffer_pool->attach(codec_context);
+
+    if (profile)
+        profile->apply(codec_context, codec);
+
     if ((ret = avcodec_open2(codec_context, codec, NULL)) < 0) {
         av_log(NULL, AV_LOG_WARNING, "Failed to open  codec %d(%s), LE = %d\n", codec->id, avcodec_get_name(codec->id), ret);
         return NULL;
@@ -68,6 +108,167 @@ AVCodecContext* Decoder::create_codec_directly( const AVCodecParameters * codec_
     return codec_context;
 }
 
+AVCodecContext* Decoder::open_codec(const AVCodecParameters* codec_para, const StreamParam* extra_para
+    , FrameBufferPool* buffer_pool, const DecoderProfile* profile)
+{
+    this->open_start = av_gettime_relative();
+    memset(&this->open_stats, 0, sizeof(this->open_stats));
+    this->codec_key.fill(codec_para, profile);
+    this->intra_workers = profile && profile->intra_workers > 1 && IntraDecodeGroup::is_intra_only(codec_para) ? profile->intra_workers : 0;
+
+    AVCodecContext* codec_context = CodecContextCache::take(this->codec_key, this->_av_decoder);
+    if (!codec_context)
+        return create_codec_directly(codec_para, extra_para, buffer_pool, profile);
+
+    // what may differ from the last user of it
+    this->open_stats.cache_hit = 1;
+    codec_context->pkt_timebase = extra_para->time_base;
+    codec_context->skip_loop_filter = profile ? (enum AVDiscard)profile->skip_loop_filter : AVDISCARD_DEFAULT;
+    if (buffer_pool)
+        buffer_pool->attach(codec_context);
+    return codec_context;
+}
+
+void Decoder::on_first_frame()
+{
+    this->open_stats.first_frame_time = FFMAX(av_gettime_relative() - this->open_start, 1);
+    av_log(NULL, AV_LOG_VERBOSE, "%s stream (channel %d) opened in %.2f ms%s, first frame after %.2f ms\n"
+        , av_get_media_type_string(this->avctx->codec_type), this->channel, this->open_stats.open_time / 1000.0
+        , this->open_stats.cache_hit ? " (cached codec)" : "", this->open_stats.first_frame_time / 1000.0);
+}
+
+void CodecContextKey::fill(const AVCodecParameters* codec_para, const DecoderProfile* profile)
+{
+    DecoderProfile defaults;
+    if (!profile)
+        profile = &defaults;
+
+    memset(this, 0, sizeof(*this));
+    this->codec_id = codec_para->codec_id;
+    this->width = codec_para->width;
+    this->height = codec_para->height;
+    this->format = codec_para->format;
+    this->sample_rate = codec_para->sample_rate;
+    this->channels = codec_para->channels;
+    this->extradata_size = codec_para->extradata_size;
+    if (codec_para->extradata && codec_para->extradata_size > 0)
+        this->extradata_hash = (uint32_t)av_adler32_update(1, codec_para->extradata, codec_para->extradata_size);
+    this->thread_count = profile->thread_count;
+    this->thread_type = profile->thread_type;
+    this->lowres = profile->lowres;
+    this->fast = profile->fast;
+}
+
+//     codec_context_cache section {{{
+int CodecContextCache::max_entries = 0;
+
+CodecContextCache::CodecContextCache()
+{
+    nb_entries = 0;
+    hits = misses = 0;
+}
+
+CodecContextCache* CodecContextCache::get_instance()
+{
+    static CodecContextCache* instance = new CodecContextCache();   // thread safe init since C++11
+    return instance;
+}
+
+AVCodecContext* CodecContextCache::take(const CodecContextKey& key, const void* owner)
+{
+    if (max_entries <= 0 || key.codec_id == AV_CODEC_ID_NONE)
+        return NULL;
+
+    CodecContextCache* cache = get_instance();
+    AutoLocker _yes_locked(cache->lock);
+    int found = -1;
+    for (int i = 0; i < cache->nb_entries; i++) {
+        if (!cache->entries[i].key.matches(key))
+            continue;
+        if (found < 0 || (cache->entries[i].owner == owner && cache->entries[found].owner != owner))
+            found = i;
+    }
+
+    if (found < 0) {
+        cache->misses++;
+        return NULL;
+    }
+
+    AVCodecContext* avctx = cache->entries[found].avctx;
+    cache->entries[found] = cache->entries[--cache->nb_entries];
+    cache->hits++;
+    return avctx;
+}
+
+void CodecContextCache::put(AVCodecContext** avctx, const CodecContextKey& key, const void* owner)
+{
+    if (!*avctx)
+        return;
+    if (max_entries <= 0 || key.codec_id == AV_CODEC_ID_NONE) {
+        avcodec_free_context(avctx);
+        return;
+    }
+
+    // idle and neutral: nothing held, nothing pointing to the decoder it leaves
+    avcodec_flush_buffers(*avctx);
+    (*avctx)->opaque = NULL;
+    (*avctx)->get_buffer2 = avcodec_default_get_buffer2;
+    (*avctx)->skip_frame = AVDISCARD_DEFAULT;
+    (*avctx)->skip_idct = AVDISCARD_DEFAULT;
+
+    AVCodecContext* oldest = NULL;
+    {
+        CodecContextCache* cache = get_instance();
+        AutoLocker _yes_locked(cache->lock);
+        if (cache->nb_entries >= FFMIN(max_entries, CODEC_CACHE_MAX_ENTRIES)) {
+            int old = 0;
+            for (int i = 1; i < cache->nb_entries; i++)
+                if (cache->entries[i].put_time < cache->entries[old].put_time)
+                    old = i;
+            oldest = cache->entries[old].avctx;
+            cache->entries[old] = cache->entries[--cache->nb_entries];
+        }
+
+        Entry* entry = &cache->entries[cache->nb_entries++];
+        entry->avctx = *avctx;
+        entry->key = key;
+        entry->owner = owner;
+        entry->put_time = av_gettime_relative();
+    }
+    *avctx = NULL;
+    avcodec_free_context(&oldest);    // out of the lock, frame threads take a while to join
+}
+
+void CodecContextCache::purge(const void* owner)
+{
+    AVCodecContext* gone[CODEC_CACHE_MAX_ENTRIES];
+    int nb_gone = 0;
+    {
+        CodecContextCache* cache = get_instance();
+        AutoLocker _yes_locked(cache->lock);
+        for (int i = 0; i < cache->nb_entries; ) {
+            if (cache->entries[i].owner == owner) {
+                gone[nb_gone++] = cache->entries[i].avctx;
+                cache->entries[i] = cache->entries[--cache->nb_entries];
+            }
+            else {
+                i++;
+            }
+        }
+    }
+    for (int i = 0; i < nb_gone; i++)
+        avcodec_free_context(&gone[i]);
+}
+
+void CodecContextCache::get_stats(int64_t* hits, int64_t* misses)
+{
+    CodecContextCache* cache = get_instance();
+    AutoLocker _yes_locked(cache->lock);
+    *hits = cache->hits;
+    *misses = cache->misses;
+}
+//     }}} codec_context_cache section 
+
 int Decoder::decoder_init( AVCodecContext *avctx, const StreamParam* extra_para)
 {
     this->avctx = avctx;
@@ -79,29 +280,76 @@ int Decoder::decoder_init( AVCodecContext *avctx, const StreamParam* extra_para)
     
     av_init_packet(&pending_pkt);
     is_packet_pending = 0;
+    batch_pos = batch_count = 0;
     
     return 0;
 }
 
+int Decoder::get_packet(AVPacket* pkt)
+{
+    if (this->packet_q.abort_request)
+        return -1;
+
+    if (this->batch_pos >= this->batch_count) {
+        int64_t t0 = av_gettime_relative();
+        int got = this->packet_q.packet_queue_get_many(this->batch_pkts, this->batch_serials
+            , PACKET_BATCH_SIZE, !this->pooled /*block until get*/);
+        this->pkt_wait_time += av_gettime_relative() - t0;
+        if (got < 0 || (!got && !this->pooled))
+            return -1;
+        if (!got)
+            return 0;   // pooled, we're scheduled again when packets come
+
+        this->batch_pos = 0;
+        this->batch_count = got;
+    }
+
+    av_packet_move_ref(pkt, &this->batch_pkts[this->batch_pos]);
+    this->pkt_serial = this->batch_serials[this->batch_pos];
+    this->batch_pos++;
+    return 1;
+}
+
+void Decoder::discard_batch()
+{
+    for (; this->batch_pos < this->batch_count; this->batch_pos++) {
+        av_packet_unref(&this->batch_pkts[this->batch_pos]);
+    }
+    this->batch_pos = this->batch_count = 0;
+}
+
 int Decoder::decoder_decode_frame(AVFrame *frame, AVSubtitle *sub) {
     int ret = AVERROR(EAGAIN);
 
     for (;;) {
         
-        if (this->packet_q.serial == this->pkt_serial) {
+        if (!sub && this->packet_q.serial == this->pkt_serial) {
             do {
                 if (this->packet_q.abort_request)
                     return -1;
 
                 // check if frame available
-                ret = avcodec_receive_frame(this->avctx, frame);
+                ret = codec_receive(frame);
+                if (ret >= 0 && this->packet_q.serial != this->pkt_serial) {
+                    av_frame_unref(frame);  // seek came meanwhile, on to its flush pkt rather than draining old ones
+                    break;
+                }
                 if (ret >= 0) {  // yes we've got a frame
+                    if (!this->open_stats.first_frame_time)
+                        on_first_frame();
                     on_got_new_frame(frame);
                     return 1;
                 }                
                 else if (ret == AVERROR_EOF) {
+                    if (this->reopening) {
+                        // drained for reopen, not end of stream
+                        this->reopening = 0;
+                        if (reopen_codec() < 0)
+                            codec_flush();
+                        continue;
+                    }
                     this->finished = this->pkt_serial;
-                    avcodec_flush_buffers(this->avctx);
+                    codec_flush();
                     return 0;
                 }                
                     
@@ -114,8 +362,11 @@ int Decoder::decoder_decode_frame(AVFrame *frame, AVSubtitle *sub) {
                 av_packet_move_ref(&pkt, &this->pending_pkt);
                 this->is_packet_pending = 0;
             } else {
-                if (this->packet_q.packet_queue_get( &pkt, 1 /*block until get*/, &this->pkt_serial) < 0)
+                int got = get_packet(&pkt);
+                if (got < 0)
                     return -1;
+                if (!got)
+                    return AVERROR(EAGAIN);
             }
             if (this->packet_q.serial == this->pkt_serial)
                 break;
@@ -126,24 +377,75 @@ int Decoder::decoder_decode_frame(AVFrame *frame, AVSubtitle *sub) {
         if (PacketQueue::is_null_pkt(pkt)) {
             eos = 1; // end of input stream
             av_packet_unref(&pkt);
+            if (drain_at_null_pkt())
+                codec_send(NULL); // codec gives out what it holds, then AVERROR_EOF
             continue;
         }
 
         if (PacketQueue::is_flush_pkt(pkt)) {
-            avcodec_flush_buffers(this->avctx);
+            codec_flush();
+            this->reopening = 0;
+            this->skip_until_keyframe = 0;  // packets after seek start from a keyframe anyway
             this->finished = 0;
             this->next_pts          = this->start_pts;
             this->next_pts_timebase = this->start_pts_timebase;
 
-            continue;
+            return 0;   // let decoder thread see what comes with new serial, e.g. reverse playback
         }
         
         if (eos)
         {
             eos = 0;
         }
+
+        int before = is_before_until(pkt.pts == AV_NOPTS_VALUE ? NAN : pkt.pts * av_q2d(this->stream_param.time_base)
+            , pkt.duration * av_q2d(this->stream_param.time_base), 0);
+        if (before != this->pkt_before_until) {
+            this->pkt_before_until = before;
+            on_seek_skipping(before);
+        }
+
+        int wanted = get_wanted_skip_frame();
+        if (this->avctx->skip_frame != wanted)
+            apply_skip_frame(wanted);
+
+        if (this->skip_until_keyframe) {
+            if (!(pkt.flags & AV_PKT_FLAG_KEY)) {
+                av_packet_unref(&pkt);
+                continue;
+            }
+            this->skip_until_keyframe = 0;
+        }
+
+        if (should_drop_packet(&pkt)) {
+            av_packet_unref(&pkt);
+            continue;
+        }
+
+        if ((pkt.flags & AV_PKT_FLAG_KEY) && !this->reopening && wants_reopen()) {
+            // drain the old codec, this keyframe goes to the new one
+            this->reopening = 1;
+            av_packet_move_ref(&this->pending_pkt, &pkt);
+            this->is_packet_pending = 1;
+            codec_send(NULL);
+            continue;
+        }
+
+        if (sub) {
+            // subtitle codecs are still on the old API: one pkt in, at most one subtitle out
+            int got_sub = 0;
+            ret = avcodec_decode_subtitle2(this->avctx, sub, &got_sub, &pkt);
+            av_packet_unref(&pkt);
+            if (ret >= 0 && got_sub) {
+                if (!this->open_stats.first_frame_time)
+                    on_first_frame();
+                return 1;
+            }
+            continue;
+        }
+
         // feed packet to codec
-        if (avcodec_send_packet(this->avctx, &pkt) == AVERROR(EAGAIN)) 
+        if (codec_send(&pkt) == AVERROR(EAGAIN)) 
         {
             //AVERROR(EAGAIN) : input is not accepted in the current state - user
             //    must read output with avcodec_receive_frame() (once
@@ -159,6 +461,53 @@ int Decoder::decoder_decode_frame(AVFrame *frame, AVSubtitle *sub) {
     }
 }
 
+int Decoder::codec_send(const AVPacket* pkt)
+{
+    if (this->intra_group)
+        return this->intra_group->send(pkt, this->avctx);
+    return avcodec_send_packet(this->avctx, pkt);
+}
+
+int Decoder::codec_receive(AVFrame* frame)
+{
+    if (!this->intra_group)
+        return avcodec_receive_frame(this->avctx, frame);
+
+    // waiting for a frame while pkts are at hand would leave workers idle
+    int more_input = this->is_packet_pending || this->batch_pos < this->batch_count || this->packet_q.nb_packets > 0;
+    return this->intra_group->receive(frame, more_input);
+}
+
+void Decoder::codec_flush()
+{
+    if (this->intra_group)
+        this->intra_group->flush();
+    else
+        avcodec_flush_buffers(this->avctx);
+}
+
+void Decoder::apply_skip_frame(int wanted)
+{
+    if (this->avctx->skip_frame >= AVDISCARD_NONKEY && wanted < AVDISCARD_NONKEY)
+        this->skip_until_keyframe = 1;
+
+    this->avctx->skip_frame = (enum AVDiscard)wanted;
+}
+
+// 1 if a frame/pkt of current serial is before accurate seek target, 'mark_reached' says target is reached if not
+int Decoder::is_before_until(double pts, double duration, int mark_reached)
+{
+    if (this->until_serial != this->pkt_serial || this->until_reached == this->pkt_serial || isnan(pts))
+        return 0;
+
+    if (pts + FFMAX(duration, 0) <= this->decode_until + ACCURATE_SEEK_EPS && pts < this->decode_until)
+        return 1;
+
+    if (mark_reached)
+        this->until_reached = this->pkt_serial;
+    return 0;
+}
+
 RenderBase* Decoder::get_render()
 {
     return  this->_av_decoder->render;
@@ -168,11 +517,17 @@ RenderBase* Decoder::get_render()
 void Decoder::decoder_destroy() {    
     decoder_abort();
 
+    delete this->intra_group;   // its threads joined before 'avctx' goes
+    this->intra_group = NULL;
+
     av_packet_unref(&this->pending_pkt);
-    avcodec_free_context(&this->avctx);
+    discard_batch();
+    this->packetizer.close();
+    CodecContextCache::put(&this->avctx, this->codec_key, this->_av_decoder);  // freed if it's not to be cached
 
     this->packet_q.packet_queue_destroy();
     this->frame_q.frame_queue_destory();
+    this->frame_pool.uninit();
 
     inited = 0;
 }
@@ -182,7 +537,16 @@ void Decoder::decoder_abort()
     this->packet_q.packet_queue_abort();
     this->frame_q.frame_queue_signal();
 
-    this->BaseThread::wait_thread_quit();  
+    if (this->pooled) {
+        DecodePool::detach(this);
+        this->pooled = 0;
+        this->packet_q.consumer_task = NULL;
+        this->frame_q.producer_task = NULL;
+        av_frame_free(&this->task_frame);
+    }
+    else {
+        this->BaseThread::wait_thread_quit();  
+    }
 
     this->packet_q.packet_queue_flush();
 }
@@ -194,10 +558,43 @@ int VideoDecoder::decoder_init(AVCodecContext* avctx, const StreamParam* extra_p
         return 1;
     }
 
-    if (this->frame_q.frame_queue_init(&this->packet_q, VIDEO_PICTURE_QUEUE_SIZE, 1) < 0)
+    if (this->frame_q.frame_queue_init(&this->packet_q, this->fq_depth ? this->fq_depth : VIDEO_PICTURE_QUEUE_SIZE, 1, this->fq_max_depth) < 0)
+        return 2;
+    this->fq_adaptive = this->frame_q.frame_queue_get_capacity() > this->frame_q.frame_queue_get_depth();
+
+    this->degrade_level = DEGRADE_NONE;
+    this->good_reviews = 0;
+    this->last_review_time = 0;
+    this->late_avg = 0;
+    this->busy_time = 0;
+    this->base_skip_loop_filter = avctx->skip_loop_filter;
+    this->base_skip_idct = avctx->skip_idct;
+    this->base_lowres = avctx->lowres;
+    this->nal_length_size = get_nal_length_size(avctx->codec_id, avctx->extradata, avctx->extradata_size);
+    this->last_adapt_time = 0;
+    this->last_adapt_drops = 0;
+    this->memory_low = 0;
+    this->last_memory_sample = 0;
+    reverse_reset(0);
+    this->refill_before = NAN;
+    this->refill_serial = -1;
+    this->refill_done = 0;
+    this->history_drawn = 0;
+    this->generation++;
+    if (this->step_history.init(this->step_history_frames, this->step_history_bytes) < 0
+        || this->step_refill.init(this->step_history_frames, this->step_history_bytes) < 0)
         return 2;
 
     this->stream_clock.init_clock(&this->packet_q.serial);
+
+    if (this->intra_workers > 1 && !this->intra_group) {
+        this->intra_group = new (std::nothrow) IntraDecodeGroup();
+        if (this->intra_group && this->intra_group->init(avctx, this->intra_workers, &this->frame_pool)) {
+            av_log(NULL, AV_LOG_WARNING, "intra-only decode group failed, one codec context then\n");
+            delete this->intra_group;
+            this->intra_group = NULL;
+        }
+    }
     
     if (decoder_start())
     {
@@ -217,9 +614,192 @@ void VideoDecoder::on_got_new_frame(AVFrame* frame)
     }
 }
 
+void VideoDecoder::adapt_frame_queue_depth(int frame_drops_late)
+{
+    if (!this->fq_adaptive)
+        return;
+
+    double now = av_gettime_relative() / 1000000.0;
+    if (now - this->last_adapt_time < FRAME_QUEUE_ADAPT_INTERVAL)
+        return;
+    this->last_adapt_time = now;
+
+    int depth = this->frame_q.frame_queue_get_depth();
+    int new_depth = depth;
+    if (this->memory_low.load()) {
+        new_depth = this->frame_q.frame_queue_set_depth(depth - 1);
+        if (new_depth != depth)
+            this->frame_pool.trim(); // let idle buffers go back to system
+    }
+    else if (frame_drops_late > this->last_adapt_drops) {
+        new_depth = this->frame_q.frame_queue_set_depth(depth + 1);
+    }
+    this->last_adapt_drops = frame_drops_late;
+
+    if (new_depth != depth)
+        av_log(NULL, AV_LOG_VERBOSE, "video frame queue depth %d -> %d\n", depth, new_depth);
+}
+
+// asking the system may read a file (/proc/meminfo), keep it off the refresh loop
+void VideoDecoder::sample_memory_pressure()
+{
+    if (!this->fq_adaptive)
+        return;
+
+    double now = av_gettime_relative() / 1000000.0;
+    if (now - this->last_memory_sample < FRAME_QUEUE_ADAPT_INTERVAL)
+        return;
+    this->last_memory_sample = now;
+    this->memory_low = is_system_memory_low();
+}
+
+void VideoDecoder::review_degrade_level()
+{
+    double now = av_gettime_relative() / 1000000.0;
+    if (!this->last_review_time) {
+        this->last_review_time = now;
+        this->busy_time = 0;
+        return;
+    }
+
+    double elapsed = now - this->last_review_time;
+    if (elapsed < DEGRADE_REVIEW_INTERVAL)
+        return;
+
+    double busy = this->busy_time / 1000000.0 / elapsed;
+    this->last_review_time = now;
+    this->busy_time = 0;
+
+    int level = this->degrade_level;
+    if (this->late_avg > DEGRADE_LATE_THRESHOLD || busy > DEGRADE_BUSY_THRESHOLD) {
+        this->good_reviews = 0;
+        if (level < DEGRADE_MAX)
+            level++;
+    }
+    else if (this->late_avg < DEGRADE_RECOVER_LATE && busy < DEGRADE_RECOVER_BUSY) {
+        if (++this->good_reviews >= DEGRADE_RECOVER_REVIEWS && level > DEGRADE_NONE) {
+            this->good_reviews = 0;
+            level--;
+        }
+    }
+    else {
+        this->good_reviews = 0;
+    }
+
+    if (level != this->degrade_level) {
+        av_log(NULL, AV_LOG_VERBOSE, "video degrade level %d -> %d (late %.3f s, busy %.0f%%)\n"
+            , this->degrade_level, level, this->late_avg, busy * 100);
+        this->degrade_level = level;
+        this->late_avg = 0;    // judge the new level by itself
+        apply_degrade_level();
+    }
+}
+
+void VideoDecoder::apply_degrade_level()
+{
+    // before accurate seek target, non-ref frames are thrown away anyway. ref ones keep full quality, target is built on them
+    int seeking = this->pkt_before_until ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    this->avctx->skip_loop_filter = (enum AVDiscard)(this->degrade_level >= DEGRADE_SKIP_LOOP_FILTER 
+        ? AVDISCARD_ALL : FFMAX(seeking, this->base_skip_loop_filter));
+    this->avctx->skip_idct = (enum AVDiscard)(this->degrade_level >= DEGRADE_SKIP_IDCT 
+        ? FFMAX(AVDISCARD_NONREF, this->base_skip_idct) : FFMAX(seeking, this->base_skip_idct));
+    // skip_frame is applied by decoder_decode_frame(), see get_wanted_skip_frame()
+}
+
+int VideoDecoder::get_wanted_skip_frame()
+{
+    int wanted = this->wanted_skip_frame;
+    if (this->degrade_level >= DEGRADE_KEYFRAME_ONLY)
+        wanted = FFMAX(wanted, AVDISCARD_NONKEY);
+    else if ((this->degrade_level >= DEGRADE_DROP_NONREF || this->pkt_before_until) && AV_CODEC_ID_H264 != this->avctx->codec_id)
+        wanted = FFMAX(wanted, AVDISCARD_NONREF);   // can't tell non-ref packets by ourselves, let codec skip them
+    return wanted;
+}
+
+int VideoDecoder::should_drop_packet(const AVPacket* pkt)
+{
+    if ((this->degrade_level < DEGRADE_DROP_NONREF && !this->pkt_before_until) || this->degrade_level >= DEGRADE_KEYFRAME_ONLY)
+        return 0;
+
+    return is_nonref_packet(this->avctx->codec_id, pkt, this->nal_length_size);
+}
+
+void VideoDecoder::on_seek_skipping(int skipping)
+{
+    apply_degrade_level();
+}
+
+// largest lowres whose picture is still no smaller than what's shown on screen
+int VideoDecoder::get_wanted_lowres()
+{
+    int max_lowres = this->avctx->codec ? this->avctx->codec->max_lowres : 0;
+    int screen_w = get_render()->screen_width;
+    int screen_h = get_render()->screen_height;
+    int coded_w = this->avctx->coded_width;
+    int coded_h = this->avctx->coded_height;
+    if (max_lowres <= 0 || screen_w <= 0 || screen_h <= 0 || coded_w <= 0 || coded_h <= 0)
+        return this->avctx->lowres;
+
+    double scale = FFMIN((double)screen_w / coded_w, (double)screen_h / coded_h);
+    int lowres = this->base_lowres;
+    while (lowres < max_lowres && scale * (2 << lowres) <= 1.0)
+        lowres++;
+    return lowres;
+}
+
+int VideoDecoder::wants_reopen()
+{
+    return this->auto_lowres && !this->reverse && get_wanted_lowres() != this->avctx->lowres;
+}
+
+int VideoDecoder::reopen_codec()
+{
+    int lowres = get_wanted_lowres();
+    AVCodecParameters* par = avcodec_parameters_alloc();
+    if (!par || avcodec_parameters_from_context(par, this->avctx) < 0) {
+        avcodec_parameters_free(&par);
+        return -1;
+    }
+    if (this->avctx->coded_width && this->avctx->coded_height) {
+        par->width = this->avctx->coded_width;     // 'width' is scaled down by current lowres
+        par->height = this->avctx->coded_height;
+    }
+
+    DecoderProfile profile;
+    profile.thread_count = this->avctx->thread_count;
+    profile.thread_type = this->avctx->thread_type;
+    profile.skip_loop_filter = this->base_skip_loop_filter;
+    profile.lowres = lowres;
+    profile.fast = !!(this->avctx->flags2 & AV_CODEC_FLAG2_FAST);
+
+    // as a fresh open of this stream with that lowres would key it: 'par' has coded size, and the threads 
+    // avcodec_open2 chose, which would never match it
+    CodecContextKey key = this->codec_key;
+    key.lowres = lowres;
+    AVCodecContext* new_ctx = create_codec_directly(par, &this->stream_param, &this->frame_pool, &profile);
+    avcodec_parameters_free(&par);
+    if (!new_ctx) 
+        return -1;
+    this->codec_key = key;
+
+    av_log(NULL, AV_LOG_VERBOSE, "video lowres %d -> %d (shown at %dx%d)\n"
+        , this->avctx->lowres, new_ctx->lowres, get_render()->screen_width, get_render()->screen_height);
+    new_ctx->skip_frame = this->avctx->skip_frame;
+    if (this->intra_group && this->intra_group->init(new_ctx, this->intra_workers, &this->frame_pool)) {
+        delete this->intra_group;   // drained, nothing lost
+        this->intra_group = NULL;
+    }
+    avcodec_free_context(&this->avctx);
+    this->avctx = new_ctx;
+    apply_degrade_level();  // skip_loop_filter/skip_idct
+    return 0;
+}
+
 void VideoDecoder::decoder_destroy() {
     MyBase::decoder_destroy();
-
+    reverse_reset(1);
+    this->step_history.destroy();
+    this->step_refill.destroy();
 }
 
 int AudioDecoder::decoder_init(AVCodecContext* avctx, const StreamParam* extra_para)
@@ -229,7 +809,7 @@ int AudioDecoder::decoder_init(AVCodecContext* avctx, const StreamParam* extra_p
         return 1;
     }
 
-    if (this->frame_q.frame_queue_init(&this->packet_q, SAMPLE_QUEUE_SIZE, 1) < 0)
+    if (this->frame_q.frame_queue_init(&this->packet_q, this->fq_depth ? this->fq_depth : SAMPLE_QUEUE_SIZE, 1, this->fq_max_depth) < 0)
         return 2;
 
     this->stream_clock.init_clock(&this->packet_q.serial);
@@ -317,6 +897,27 @@ void AudioDecoder::on_got_new_frame(AVFrame* frame)
         this->start_pts_timebase = tb;
     }
 }
+
+int SubtitleDecoder::decoder_init(AVCodecContext* avctx, const StreamParam* extra_para)
+{
+    if (MyBase::decoder_init(avctx, extra_para))
+    {
+        return 1;
+    }
+
+    if (this->frame_q.frame_queue_init(&this->packet_q, this->fq_depth ? this->fq_depth : SUBPICTURE_QUEUE_SIZE, 0) < 0)
+        return 2;
+
+    this->shown_pts = this->shown_duration = NAN;
+    this->shown_serial = -1;
+
+    if (decoder_start())
+    {
+        return 3;
+    }
+    inited = 1;
+    return 0;
+}
 //     }}} decoder section 
 
 
@@ -330,8 +931,21 @@ void RenderBase::sdl_audio_callback(void* opaque, uint8_t* stream, int len)
 
 void VideoDecoder::video_image_display()
 {
-    Frame *vp;
-    vp = this->frame_q.frame_queue_peek_last();
+    Frame *vp = NULL;
+    AutoLocker _yes_locked(this->step_history.lock);
+    if (this->_av_decoder->is_stepping())
+        vp = this->step_history.peek_cursor();
+
+    if (vp) {
+        vp->uploaded = 0;   // texture is shared with frame_q
+        this->history_drawn = 1;
+    } else {
+        vp = this->frame_q.frame_queue_peek_last();
+        if (this->history_drawn) {
+            vp->uploaded = 0;
+            this->history_drawn = 0;
+        }
+    }
     get_render()->upload_and_draw_frame(vp);
 
 }
@@ -352,6 +966,17 @@ int  SimpleAVDecoder::get_opened_streams_mask()   // 返回 bit0 代表V， bit1
 
 void SimpleAVDecoder::close_all_stream()
 {
+    close_es();
+
+    for (int i = 1; i < MAX_CHANNELS; i++)
+        close_channel(i);
+
+    if (this->subdec.is_inited())
+    {
+        this->subdec.decoder_destroy();
+        this->render->show_subtitle(NULL);
+    }
+
     if (this->auddec.is_inited())
     {
         this->auddec.decoder_destroy();
@@ -367,6 +992,7 @@ void VideoState::close_input_stream()
 {
     /* XXX: use a special url_shutdown call to abort parse cleanly */
     this->abort_request = 1;
+    this->av_decoder.feeder_wakeup.notify();
     this->wait_thread_quit();
 
     /* close each stream */
@@ -395,6 +1021,10 @@ void VideoDecoder::video_display()
 
 SimpleAVDecoder::~SimpleAVDecoder()
 {
+    close_es();
+    CodecContextCache::purge(this);
+    hold_picture(0);
+
     if (render)
     {
         delete render;
@@ -423,6 +1053,70 @@ int SimpleAVDecoder::get_master_sync_type() const {
     }
 }
 
+void SimpleAVDecoder::set_playback_speed(double speed)
+{
+    get_decoder_clock()->set_clock_speed(speed);
+
+    if (!float_equal(speed, 1.0))
+        set_master_sync_type(AV_SYNC_EXTERNAL_CLOCK);
+    else
+        set_master_sync_type(AV_SYNC_AUDIO_MASTER);
+
+    get_decoder_clock()->set_clock_speed(speed);
+
+    // most frames would be dropped as late anyway, dont waste time on decoding them
+    if (speed >= SKIP_NONKEY_SPEED)
+        this->viddec.set_skip_frame(AVDISCARD_NONKEY);
+    else if (speed >= SKIP_NONREF_SPEED)
+        this->viddec.set_skip_frame(AVDISCARD_NONREF);
+    else
+        this->viddec.set_skip_frame(AVDISCARD_DEFAULT);
+}
+
+double SimpleAVDecoder::get_playback_speed()
+{
+    return get_decoder_clock()->get_clock_speed();
+}
+
+double SimpleAVDecoder::start_reverse(double speed, double pos)
+{
+    if (isnan(pos))
+        pos = this->is_reverse() ? -this->viddec.stream_clock.pts : this->viddec.stream_clock.pts; // the frame on screen
+    if (isnan(pos))
+        pos = this->get_stream_position();
+
+    this->viddec.reverse_start = pos;
+    this->viddec.reverse = 1;
+    this->viddec.set_skip_frame(AVDISCARD_DEFAULT);   // every frame of a GOP is wanted
+
+    set_master_sync_type(AV_SYNC_EXTERNAL_CLOCK);
+    discard_buffer(-pos);   // serial++, clock restarts on the mirrored timeline
+    this->extclk.set_clock_speed(speed);
+    return pos;
+}
+
+void SimpleAVDecoder::stop_reverse()
+{
+    this->viddec.reverse = 0;
+    set_playback_speed(1.0);
+}
+
+double SimpleAVDecoder::get_stream_position()
+{
+    double pos = get_master_clock();
+    return this->is_reverse() ? -pos : pos;
+}
+
+int SimpleAVDecoder::is_reverse_gop_wanted()
+{
+    return this->viddec.packet_q.nb_packets == 0;
+}
+
+void SimpleAVDecoder::feed_reverse_gop_end()
+{
+    this->viddec.packet_q.packet_queue_put_nullpacket(0);
+}
+
 Clock* SimpleAVDecoder::get_decoder_clock() // get the master clock itself
 {
     switch (this->get_master_sync_type()) 
@@ -464,16 +1158,18 @@ void SimpleAVDecoder::check_external_clock_speed() {
 }
 
 /* seek in the stream */
-void VideoState::stream_seek(int64_t pos, int64_t rel, int seek_by_bytes)
+void VideoState::stream_seek(int64_t pos, int64_t rel, int seek_by_bytes, int backward)
 {
     if (!this->seek_req) {
         this->seek_pos = pos;
         this->seek_rel = rel;
+        this->seek_backward = backward;
         this->seek_flags &= ~AVSEEK_FLAG_BYTE;
         if (seek_by_bytes)
             this->seek_flags |= AVSEEK_FLAG_BYTE;
 
         this->seek_req = 1;
+        this->av_decoder.feeder_wakeup.notify();
     }
 }
 
@@ -493,8 +1189,13 @@ int SimpleAVDecoder::internal_toggle_pause()
 
 void VideoState::toggle_pause()
 {
+    double pos;
+    if (this->paused && this->av_decoder.leave_step_history(&pos))
+        this->stream_seek((int64_t)(pos * AV_TIME_BASE), 0, 0);    // go on from where stepping took us
+
     paused = this->av_decoder.internal_toggle_pause();
     this->av_decoder.toggle_step( 0);
+    this->av_decoder.feeder_wakeup.notify();
 }
 
 void SimpleAVDecoder::toggle_mute( )
@@ -512,12 +1213,41 @@ void SimpleAVDecoder::update_volume( int delta )
     auddec.audio_volume = av_clip(auddec.audio_volume + delta , 0 , 100);
 }
 
-void VideoState::step_to_next_frame()
+void VideoState::step_frame(int backward)
 {
-    /* if the stream is paused unpause it, then step */
-    if (this->paused)
-        this->av_decoder.internal_toggle_pause();
+    if (this->av_decoder.is_reverse()) {
+        // frame_q is in reverse order, next frame in it is the previous one
+        if (!backward)
+            step_to_next_frame();
+        return;
+    }
+
+    if (!this->paused)
+        toggle_pause();
+
+    if (!backward) {
+        this->av_decoder.request_step(1);
+        return;
+    }
+
+    double oldest_pts;
+    if (this->av_decoder.can_step_back(&oldest_pts)) {
+        this->av_decoder.request_step(-1);
+    }
+    else if (!isnan(oldest_pts) && !this->seek_req) {
+        // at the edge of step history: decode the GOP before again, its frames refill step history
+        this->av_decoder.request_step_refill(oldest_pts);
+        this->stream_seek((int64_t)(oldest_pts * AV_TIME_BASE) - 1, 0, 0, 1);
+    }
+}
+
+void VideoState::step_to_next_frame()
+{
+    /* if the stream is paused unpause it, then step */
+    if (this->paused)
+        this->av_decoder.internal_toggle_pause();
     this->av_decoder.toggle_step(1);
+    this->av_decoder.feeder_wakeup.notify();
 }
 
 double SimpleAVDecoder::compute_target_delay(double frame_duration)
@@ -584,12 +1314,42 @@ void SimpleAVDecoder::toggle_need_drawing(int need_drawing)
 /* called to display each frame */
 void SimpleAVDecoder::video_refresh(double *remaining_time)
 {
+    AutoLocker _hold_locked(this->hold_lock);   // what's on screen is not taken while it's being replaced
+
     if (!this->paused && this->get_master_sync_type() == AV_SYNC_EXTERNAL_CLOCK && this->realtime)
         this->check_external_clock_speed();
 
     if (this->viddec.is_inited()) {
+        this->viddec.adapt_frame_queue_depth(this->frame_drops_late);
+
+        double pts;
+        if (this->viddec.refill_done) {
+            this->viddec.refill_done = 0;
+            if (this->viddec.step_history.step(0, &pts))    // the frame right before where we stepped back from
+                show_history_frame(pts);
+        }
+        if (this->step_req)
+            serve_step_request();
+
         prepare_picture_for_display(remaining_time);
 
+        // subtitle is timed by the video on screen, mirrored timeline of reverse playback has none
+        if (this->subdec.is_inited()
+            && this->subdec.refresh_subtitle(this->is_reverse() ? NAN : this->viddec.stream_clock.pts))
+            this->force_refresh = 1;
+    }
+
+    if (this->held_pic.frame && draw_held_picture()) {
+        // new stream has nothing to show yet
+    }
+    else if (get_channel_count() > 0) {
+        AutoLocker _yes_locked(this->channels_lock);
+        if (refresh_channels())
+            this->force_refresh = 1;
+        if (this->force_refresh)
+            display_channels();
+    }
+    else if (this->viddec.is_inited()) {
         /* display picture */
         if (this->force_refresh && this->viddec.frame_q.is_last_frame_shown())
             this->viddec.video_display();
@@ -600,6 +1360,132 @@ void SimpleAVDecoder::video_refresh(double *remaining_time)
     }
 }
 
+void SimpleAVDecoder::hold_picture(int hold)
+{
+    AutoLocker _yes_locked(this->hold_lock);
+    av_frame_free(&this->held_pic.frame);
+    if (!hold || !this->viddec.is_inited() || !this->viddec.frame_q.is_last_frame_shown())
+        return;
+
+    Frame* vp = this->viddec.frame_q.frame_queue_peek_last();
+    AVFrame* frame = av_frame_alloc();
+    if (!frame || av_frame_ref(frame, vp->frame) < 0) {    // buffers outlive the decoder, they are refcounted
+        av_frame_free(&frame);
+        return;
+    }
+    this->held_pic = *vp;
+    this->held_pic.frame = frame;
+    this->held_pic.uploaded = 0;
+    this->held_generation = this->viddec.generation;
+    this->held_since = av_gettime_relative();
+}
+
+int SimpleAVDecoder::draw_held_picture()
+{
+    if (this->viddec.is_inited()) {
+        if (this->viddec.generation == this->held_generation)
+            return 0;   // the old stream is still there, it draws by itself
+
+        if (this->viddec.frame_q.is_last_frame_shown()) {
+            // swap, the first frame of new stream is drawn in this same refresh
+            av_log(NULL, AV_LOG_VERBOSE, "picture held for %.2f ms, till the new stream showed\n"
+                , (av_gettime_relative() - this->held_since) / 1000.0);
+            av_frame_free(&this->held_pic.frame);
+            this->force_refresh = 1;
+            return 0;
+        }
+    }
+    else if (av_gettime_relative() - this->held_since > HOLD_PICTURE_TIMEOUT * 1000000) {
+        // closed for good, not switched
+        av_frame_free(&this->held_pic.frame);
+        if (this->render->is_window_shown()) {
+            this->render->clear_render();
+            this->render->draw_render();
+        }
+        return 1;
+    }
+
+    if (this->force_refresh) {
+        if (!this->render->is_window_shown())
+            this->render->show_window(0);
+        this->render->clear_render();
+        this->render->upload_and_draw_frame(&this->held_pic);
+        this->render->draw_render();
+    }
+    return 1;
+}
+
+// extra channels follow master clock, each anchored by the offset of its first frame
+int SimpleAVDecoder::refresh_channels()
+{
+    int changed = 0;
+    double master = get_master_clock();
+
+    for (int i = 1; i < MAX_CHANNELS; i++) {
+        VideoDecoder* dec = this->channels[i];
+        if (!dec)
+            continue;
+
+        while (dec->frame_q.frame_queue_nb_remaining() > 0) {
+            Frame* vp = dec->frame_q.frame_queue_peek();
+            if (vp->serial != dec->packet_q.serial) {
+                dec->frame_q.frame_queue_next();
+                continue;
+            }
+            if (this->paused && dec->frame_q.is_last_frame_shown())
+                break;
+
+            if (!isnan(master) && !isnan(vp->pts)) {
+                double due = vp->pts + dec->channel_offset;
+                if (dec->channel_serial != vp->serial || isnan(due) || fabs(due - master) > AV_NOSYNC_THRESHOLD) {
+                    dec->channel_offset = master - vp->pts;   // (re)anchor: first frame, seek or timestamp jump
+                    dec->channel_serial = vp->serial;
+                    due = master;
+                }
+                if (due > master)
+                    break;
+            }
+
+            dec->stream_clock.set_clock(vp->pts, vp->serial);
+            dec->frame_q.frame_queue_next();
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// primary video and extra channels, one tile each
+void SimpleAVDecoder::display_channels()
+{
+    if (!this->render->is_window_shown())
+        this->render->show_window(0);
+
+    this->render->clear_render();
+
+    int count = (this->viddec.is_inited() ? 1 : 0) + get_channel_count();
+    int tile = 0;
+    if (this->viddec.is_inited()) {
+        if (this->viddec.frame_q.is_last_frame_shown()) {
+            this->render->select_tile(tile, count);
+            this->viddec.video_image_display();
+        }
+        tile++;
+    }
+    for (int i = 1; i < MAX_CHANNELS; i++) {
+        VideoDecoder* dec = this->channels[i];
+        if (!dec)
+            continue;
+        if (dec->frame_q.is_last_frame_shown()) {
+            this->render->select_tile(tile, count);
+            this->render->upload_and_draw_frame(dec->frame_q.frame_queue_peek_last());
+        }
+        tile++;
+    }
+    this->render->select_tile(0, 1);
+
+    this->render->draw_render();
+}
+
 void SimpleAVDecoder::prepare_picture_for_display(double* remaining_time)
 {
     Frame* vp, * lastvp;
@@ -666,11 +1552,110 @@ void SimpleAVDecoder::prepare_picture_for_display(double* remaining_time)
 
     this->viddec.frame_q.frame_queue_next();
     this->force_refresh = 1;
+    on_seek_shown(vp);
+    if (!this->is_reverse())
+        this->viddec.step_history.push(this->viddec.frame_q.frame_queue_peek_last());
 
     if (this->step && !this->paused)
         internal_toggle_pause();
 }
 
+void SimpleAVDecoder::request_step(int dir)
+{
+    this->stepping = 1;
+    this->step_req = dir;
+}
+
+int SimpleAVDecoder::can_step_back(double* oldest_pts)
+{
+    if (!this->viddec.is_inited() || !this->viddec.step_history.is_enabled()) {
+        *oldest_pts = NAN;
+        return 0;
+    }
+
+    if (this->viddec.step_history.can_step_back(oldest_pts))
+        return 1;
+
+    if (isnan(*oldest_pts))
+        *oldest_pts = this->viddec.stream_clock.pts;    // nothing in history, refill before the frame on screen
+    return 0;
+}
+
+void SimpleAVDecoder::request_step_refill(double before)
+{
+    this->stepping = 1;
+    this->step_refill_req = before;
+}
+
+int SimpleAVDecoder::leave_step_history(double* pos)
+{
+    if (!this->stepping)
+        return 0;
+
+    this->stepping = 0;
+    this->step_req = 0;
+    this->toggle_need_drawing(1);
+
+    double pts;
+    int browsing = this->viddec.step_history.leave(&pts);
+    if (!browsing && this->step_rewound) {
+        // frame_q holds frames we've shown, they came again after the step back
+        pts = this->viddec.step_history.newest_pts();
+        browsing = 1;
+    }
+
+    if (!browsing || isnan(pts))
+        return 0;
+    *pos = pts;
+    return 1;
+}
+
+void SimpleAVDecoder::serve_step_request()
+{
+    int dir = this->step_req;
+    int done = 1;
+    double pts;
+
+    if (this->viddec.step_history.step(dir, &pts))
+        show_history_frame(pts);
+    else if (dir > 0)
+        done = step_from_queue();   // frames decoded ahead, or wait for decoder at next refresh
+    // step back beyond step history is a refill, see VideoState::step_frame()
+
+    if (done)
+        this->step_req = 0;
+}
+
+int SimpleAVDecoder::step_from_queue()
+{
+    double newest = this->viddec.step_history.newest_pts();
+
+    while (this->viddec.frame_q.frame_queue_nb_remaining() > 0) {
+        Frame* vp = this->viddec.frame_q.frame_queue_peek();
+        this->viddec.frame_q.frame_queue_next();
+        if (vp->serial != this->viddec.packet_q.serial)
+            continue;
+        if (!isnan(newest) && !isnan(vp->pts) && vp->pts <= newest)
+            continue;   // in step history already, decoded again after a step back
+
+        show_history_frame(vp->pts);
+        on_seek_shown(vp);
+        this->viddec.step_history.push(vp);     // cursor follows it, since it's at the newest
+        return 1;
+    }
+    return 0;
+}
+
+void SimpleAVDecoder::show_history_frame(double pts)
+{
+    if (!isnan(pts)) {
+        AutoLocker yes_locked(this->viddec.frame_q.fq_signal);
+        this->update_video_clock(pts, -1, this->viddec.packet_q.serial);
+        this->extclk.set_clock(pts, this->extclk.serial);
+    }
+    this->force_refresh = 1;
+}
+
 void SimpleAVDecoder::print_stream_status()
 {
     AVBPrint buf;
@@ -734,8 +1719,8 @@ int VideoDecoder::queue_picture( AVFrame *src_frame, double pts, double duration
            av_get_picture_type_char(src_frame->pict_type), pts);
 #endif
 
-    if (!(vp = frame_q.frame_queue_peek_writable()))
-        return -1;
+    if (!(vp = frame_q.frame_queue_peek_writable(serial)))
+        return this->packet_q.abort_request ? -1 : 0;  // or decoded before seek, dropped
 
     vp->sample_aspect_ratio = src_frame->sample_aspect_ratio;
     vp->uploaded = 0;
@@ -761,8 +1746,14 @@ int VideoDecoder::get_video_frame( AVFrame *frame)
 {
     int got_picture;
 
+    int64_t t0 = av_gettime_relative();
+    int64_t wait0 = this->pkt_wait_time;
     if ((got_picture = decoder_decode_frame( frame, NULL)) < 0)
-        return -1;
+        return got_picture;
+    this->busy_time += av_gettime_relative() - t0 - (this->pkt_wait_time - wait0);
+
+    if (this->degrade_enabled)
+        review_degrade_level();
 
     if (!got_picture)
     {
@@ -774,12 +1765,20 @@ int VideoDecoder::get_video_frame( AVFrame *frame)
     if (frame->pts != AV_NOPTS_VALUE)
         dpts = av_q2d(this->stream_param.time_base ) * frame->pts;
 
+    if (is_before_until(dpts, frame->pkt_duration * av_q2d(this->stream_param.time_base), 1)) {
+        av_frame_unref(frame);  // before accurate seek target
+        return 0;
+    }
+
     //frame->sample_aspect_ratio = av_guess_sample_aspect_ratio(this->_vs->format_context, stream, frame); // 有点过于奥义，试着删掉看效果
 
-    if (this->_av_decoder->get_master_sync_type() != AV_SYNC_VIDEO_MASTER) {
+    if (!this->reverse && isnan(this->refill_before) && !this->channel && this->_av_decoder->get_master_sync_type() != AV_SYNC_VIDEO_MASTER) {
         // check if we need to discard some frames here 
         if (frame->pts != AV_NOPTS_VALUE) {
             double diff = dpts - this->_av_decoder->get_master_clock();
+            if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD)
+                this->late_avg = 0.9 * this->late_avg + 0.1 * FFMAX(0, -diff);
+
             if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD &&
                 diff < 0 &&
                 pkt_serial == stream_clock.serial &&
@@ -797,58 +1796,303 @@ int VideoDecoder::get_video_frame( AVFrame *frame)
 }
 
 
-ThreadRetType  AudioDecoder::thread_main()
+int AudioDecoder::decode_step(AVFrame* frame)
 {
-    AVFrame *frame = av_frame_alloc();
     Frame *af;
 
     int got_frame = 0;
     AVRational time_base;
-    int ret = 0;
 
-    if (!frame)
-        return (ThreadRetType) AVERROR(ENOMEM);
+    if (this->pooled && !this->frame_q.frame_queue_peek_writable_nowait())
+        return this->packet_q.abort_request ? -1 : AVERROR(EAGAIN);
 
-    do {
-        if ((got_frame = decoder_decode_frame( frame, NULL)) < 0)
-            goto the_end;
+    if ((got_frame = decoder_decode_frame( frame, NULL)) <= 0)
+        return got_frame;
+    
+    time_base.num = 1;
+    time_base.den = frame->sample_rate ;
+
+    if (frame->pts != AV_NOPTS_VALUE && this->until_serial == this->pkt_serial && this->until_reached != this->pkt_serial) {
+        double fpts = frame->pts * av_q2d(time_base);
+        if (is_before_until(fpts, frame->nb_samples * av_q2d(time_base), 1)) {
+            av_frame_unref(frame);  // before accurate seek target
+            return 0;
+        }
+        // frame holding the target, cut samples before it
+        if (trim_front(frame, (int)lrint((this->decode_until - fpts) * frame->sample_rate)) < 0) {
+            av_frame_unref(frame);
+            return 0;
+        }
+    }
 
-        if (!got_frame)
-        {
+    if (!(af = frame_q.frame_queue_peek_writable(this->pkt_serial))) {
+        av_frame_unref(frame);  // decoded before seek
+        return this->packet_q.abort_request ? -1 : 0;
+    }
+
+    af->pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(time_base);
+    af->pos = frame->pkt_pos;
+    af->serial = this->pkt_serial;
+
+    AVRational szr_dur = { frame->nb_samples, frame->sample_rate };
+    af->duration = av_q2d(szr_dur);
+
+    av_frame_move_ref(af->frame, frame);
+    frame_q.frame_queue_push();
+    return 0;
+}
+
+int SubtitleDecoder::decode_step(AVFrame* frame)
+{
+    AVSubtitle sub;
+    Frame* sp;
+
+    if (this->pooled && !this->frame_q.frame_queue_peek_writable_nowait())
+        return this->packet_q.abort_request ? -1 : AVERROR(EAGAIN);
+
+    int got_sub = decoder_decode_frame(NULL, &sub);
+    if (got_sub <= 0)
+        return got_sub;
+
+    if (!(sp = this->frame_q.frame_queue_peek_writable(this->pkt_serial))) {
+        avsubtitle_free(&sub);
+        return this->packet_q.abort_request ? -1 : 0;
+    }
+
+    // 'end_display_time' not after start means shown until the next one (e.g. PGS, DVB)
+    double pts = (sub.pts == AV_NOPTS_VALUE) ? NAN : sub.pts / (double)AV_TIME_BASE;
+    sp->pts = pts + sub.start_display_time / 1000.0;
+    sp->duration = sub.end_display_time > sub.start_display_time 
+        ? (sub.end_display_time - sub.start_display_time) / 1000.0 : INFINITY;
+    sp->pos = -1;
+    sp->serial = this->pkt_serial;
+    sp->width = this->avctx->width;
+    sp->height = this->avctx->height;
+    sp->sub_x = sp->sub_y = 0;
+    sp->uploaded = 0;
+
+    if (rasterize(&sub, sp) < 0)
+        av_frame_unref(sp->frame);  // shown as an empty one, still clears the previous
+    avsubtitle_free(&sub);
+
+    this->frame_q.frame_queue_push();
+    return 0;
+}
+
+// text of an ASS event ("ReadOrder,Layer,Style,Name,MarginL,MarginR,MarginV,Effect,Text"), override tags stripped
+static void ass_to_plain_text(const char* ass, AVBPrint* text)
+{
+    for (int commas = 0; *ass && commas < 8; ass++)
+        if (*ass == ',')
+            commas++;
+
+    for (; *ass; ass++) {
+        if (*ass == '{') {
+            const char* end = strchr(ass, '}');
+            if (end) {
+                ass = end;
+                continue;
+            }
+        }
+        if (*ass == '\\' && (ass[1] == 'N' || ass[1] == 'n')) {
+            av_bprint_chars(text, '\n', 1);
+            ass++;
+        }
+        else if (*ass == '\\' && ass[1] == 'h') {
+            av_bprint_chars(text, ' ', 1);
+            ass++;
+        }
+        else {
+            av_bprint_chars(text, *ass, 1);
+        }
+    }
+}
+
+// bitmap rects are blended into one RGBA bitmap of their bounding box. text goes to render, if it has a font engine.
+int SubtitleDecoder::rasterize(const AVSubtitle* sub, Frame* sp)
+{
+    AVFrame* rgba = sp->frame;
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+    unsigned int i;
+
+    for (i = 0; i < sub->num_rects; i++) {
+        const AVSubtitleRect* r = sub->rects[i];
+        if (r->type != SUBTITLE_BITMAP || r->w <= 0 || r->h <= 0)
             continue;
+        x0 = FFMIN(x0, r->x);
+        y0 = FFMIN(y0, r->y);
+        x1 = FFMAX(x1, r->x + r->w);
+        y1 = FFMAX(y1, r->y + r->h);
+    }
+
+    if (x0 >= x1 || y0 >= y1) {
+        AVBPrint text;
+        av_bprint_init(&text, 0, AV_BPRINT_SIZE_UNLIMITED);
+        for (i = 0; i < sub->num_rects; i++) {
+            const AVSubtitleRect* r = sub->rects[i];
+            if (text.len)
+                av_bprint_chars(&text, '\n', 1);
+            if (r->type == SUBTITLE_ASS && r->ass)
+                ass_to_plain_text(r->ass, &text);
+            else if (r->type == SUBTITLE_TEXT && r->text)
+                av_bprintf(&text, "%s", r->text);
         }
-        
-        time_base.num = 1;
-        time_base.den = frame->sample_rate ;
 
-        if (!(af = frame_q.frame_queue_peek_writable()))
-            goto the_end;
+        int ret = 0;
+        if (text.len) {
+            if (!sp->width || !sp->height) {
+                sp->width = 384;    // default PlayResX/PlayResY of ASS
+                sp->height = 288;
+            }
+            if (!get_render() || get_render()->rasterize_text(text.str, sp->width, sp->height, rgba, &sp->sub_x, &sp->sub_y)) {
+                if (!this->text_warned++)
+                    av_log(NULL, AV_LOG_WARNING, "Text subtitles are decoded, but render can't draw text.\n");
+                ret = -1;
+            }
+        }
+        av_bprint_finalize(&text, NULL);
+        return ret;     // nothing at all is an empty subtitle, which clears the previous one
+    }
 
-        af->pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(time_base);
-        af->pos = frame->pkt_pos;
-        af->serial = this->pkt_serial;
+    rgba->format = AV_PIX_FMT_RGB32;
+    rgba->width = x1 - x0;
+    rgba->height = y1 - y0;
+    if (av_frame_get_buffer(rgba, 0) < 0)
+        return AVERROR(ENOMEM);
+    for (int y = 0; y < rgba->height; y++)
+        memset(rgba->data[0] + y * rgba->linesize[0], 0, rgba->width * 4);
 
-        AVRational szr_dur = { frame->nb_samples, frame->sample_rate };
-        af->duration = av_q2d(szr_dur);
+    for (i = 0; i < sub->num_rects; i++) {
+        const AVSubtitleRect* r = sub->rects[i];
+        if (r->type != SUBTITLE_BITMAP || r->w <= 0 || r->h <= 0)
+            continue;
 
-        av_frame_move_ref(af->frame, frame);
-        frame_q.frame_queue_push();
+        const uint32_t* palette = (const uint32_t*)r->data[1];   // ARGB, native endian, same as AV_PIX_FMT_RGB32
+        for (int y = 0; y < r->h; y++) {
+            const uint8_t* src = r->data[0] + y * r->linesize[0];
+            uint32_t* dst = (uint32_t*)(rgba->data[0] + (r->y - y0 + y) * rgba->linesize[0]) + (r->x - x0);
+            for (int x = 0; x < r->w; x++) {
+                if (src[x] < r->nb_colors && (palette[src[x]] >> 24))
+                    dst[x] = palette[src[x]];
+            }
+        }
+    }
 
-        
-    } while (ret >= 0 || ret == AVERROR(EAGAIN) || ret == AVERROR_EOF);
+    sp->sub_x = x0;
+    sp->sub_y = y0;
+    return 0;
+}
 
- the_end:
-    av_frame_free(&frame);
-    return (ThreadRetType)0;
+static int same_time(double a, double b)
+{
+    return a == b || (isnan(a) && isnan(b));
+}
+
+// by refresh loop. what's queued next is uploaded ahead of time, so that a static subtitle costs nothing here,
+// and a new one is only switched to.
+int SubtitleDecoder::refresh_subtitle(double pts)
+{
+    Frame* due = NULL;
+    while (this->frame_q.frame_queue_nb_remaining() > 0) {
+        Frame* sp = this->frame_q.frame_queue_peek();
+        Frame* sp2 = this->frame_q.frame_queue_nb_remaining() > 1 ? this->frame_q.frame_queue_peek_next() : NULL;
+
+        if (sp->serial != this->packet_q.serial
+            || (!isnan(pts) && (pts > sp->pts + sp->duration || (sp2 && pts >= sp2->pts)))) {
+            this->frame_q.frame_queue_next();   // expired, or before seek
+            continue;
+        }
+
+        if (isnan(sp->pts) || (!isnan(pts) && pts >= sp->pts))
+            due = sp;
+        if (!sp->uploaded)
+            get_render()->prepare_subtitle(sp);
+        if (sp2 && !sp2->uploaded && sp2->serial == sp->serial)
+            get_render()->prepare_subtitle(sp2);
+        break;
+    }
+
+    if (due ? (due->serial == this->shown_serial && same_time(due->pts, this->shown_pts) && same_time(due->duration, this->shown_duration))
+            : this->shown_serial < 0)
+        return 0;
+
+    get_render()->show_subtitle(due);
+    this->shown_pts = due ? due->pts : NAN;
+    this->shown_duration = due ? due->duration : NAN;
+    this->shown_serial = due ? due->serial : -1;
+    return 1;
+}
+
+// drop first 'nb_samples' of 'frame', pts moves on with them
+int AudioDecoder::trim_front(AVFrame* frame, int nb_samples)
+{
+    if (nb_samples <= 0)
+        return 0;
+    if (nb_samples >= frame->nb_samples || av_frame_make_writable(frame) < 0)
+        return -1;
+
+    enum AVSampleFormat fmt = (enum AVSampleFormat)frame->format;
+    int planar = av_sample_fmt_is_planar(fmt);
+    int planes = planar ? frame->channels : 1;
+    int sample_size = av_get_bytes_per_sample(fmt) * (planar ? 1 : frame->channels);
+    for (int i = 0; i < planes; i++)
+        memmove(frame->extended_data[i], frame->extended_data[i] + nb_samples * sample_size
+            , (frame->nb_samples - nb_samples) * sample_size);
+
+    frame->nb_samples -= nb_samples;
+    frame->pts += nb_samples;   // in 1/sample_rate
+    return 0;
 }
 
 int Decoder::decoder_start()
 {
     packet_q.packet_queue_start();
+    if (this->open_start)
+        this->open_stats.open_time = av_gettime_relative() - this->open_start;  // before decoding may see the first frame
+
+    // the group blocks in waiting for its workers, no place on DecodePool
+    if (DecodePool::default_enabled && !this->intra_group && (this->task_frame = av_frame_alloc())) {
+        this->pooled = 1;
+        this->packet_q.consumer_task = this;
+        this->frame_q.producer_task = this;
+        if (0 == DecodePool::attach(this))
+            return 0;
+
+        // pool is full, a thread of its own then
+        this->pooled = 0;
+        this->packet_q.consumer_task = NULL;
+        this->frame_q.producer_task = NULL;
+        av_frame_free(&this->task_frame);
+    }
+
     create_thread(); // todo: 统一 error report 机制
     return 0;
 }
 
+ThreadRetType Decoder::thread_main()
+{
+    AVFrame* frame = av_frame_alloc();
+    if (!frame)
+        return (ThreadRetType)AVERROR(ENOMEM);
+
+    while (decode_step(frame) >= 0)
+        ;
+
+    av_frame_free(&frame);
+    return (ThreadRetType)0;
+}
+
+int Decoder::run_task()
+{
+    for (int i = 0; i < DECODE_POOL_SLICE; i++) {
+        if (this->packet_q.abort_request)
+            return 0;
+        if (decode_step(this->task_frame) < 0)
+            return 0;   // AVERROR(EAGAIN): scheduled again when pkts come or frame_q gives a slot back
+    }
+    return 1;
+}
+
 int Decoder::buffered_enough_packets() {
     if (!is_inited() || packet_q.abort_request)
         return 1;
@@ -858,37 +2102,210 @@ int Decoder::buffered_enough_packets() {
             
 }
 
-ThreadRetType  VideoDecoder::thread_main()
+// after a seek for step back, frames before 'refill_before' go to step history instead of frame_q
+int VideoDecoder::refill_step_history(AVFrame* frame, double pts, double duration)
 {
-    AVFrame *frame = av_frame_alloc();
-    double pts;
-    double duration;
-    int ret;
+    if (this->pkt_serial != this->packet_q.serial)
+        return 0;
+
+    if (this->refill_serial != this->pkt_serial) {
+        this->step_refill.clear();
+        this->refill_serial = this->pkt_serial;
+    }
+
+    if (!isnan(pts) && pts < this->refill_before) {
+        Frame vp;
+        memset(&vp, 0, sizeof(vp));
+        vp.frame = frame;
+        vp.serial = this->pkt_serial;
+        vp.pts = pts;
+        vp.duration = duration;
+        vp.pos = frame->pkt_pos;
+        vp.width = frame->width;
+        vp.height = frame->height;
+        vp.format = frame->format;
+        vp.sample_aspect_ratio = frame->sample_aspect_ratio;
+        this->step_refill.push(&vp);
+        av_frame_unref(frame);
+        return 1;
+    }
+
+    // all of the GOP before step history is decoded, 'frame' and the following go on into frame_q as usual
+    this->step_history.prepend(&this->step_refill);
+    this->refill_before = NAN;
+    this->refill_done = 1;
+    return 0;
+}
+
+// one iteration of decoder thread in reverse mode
+int VideoDecoder::reverse_step(AVFrame* frame)
+{
+    if (this->rev_serial != this->packet_q.serial) {
+        // entering reverse, or restarting from somewhere else. what's cached is useless
+        reverse_reset(0);
+        this->rev_serial = this->packet_q.serial;
+    }
+
+    // present the GOP in hand. wait for room in frame_q only if there is nothing to decode meanwhile
+    // (pooled never blocks, it's scheduled again when frame_q gives a slot back or pkts come)
+    int has_pkts = this->is_packet_pending || this->batch_pos < this->batch_count || this->packet_q.nb_packets > 0;
+    if (reverse_push(!this->pooled && (this->rev_filled || !has_pkts)) < 0)
+        return -1;
+
+    if (this->rev_filled) {
+        if (this->rev_playing->nb)
+            return this->pooled ? AVERROR(EAGAIN) : 0;
+
+        // current GOP is all in frame_q, go on with the one before
+        ReverseGop* gop = this->rev_playing;
+        this->rev_playing = this->rev_filling;
+        this->rev_filling = gop;
+        reverse_gop_clear(gop, 0);
+        this->rev_filled = 0;
+        return 0;
+    }
+
+    if (!has_pkts && this->rev_playing->nb)
+        return this->pooled ? AVERROR(EAGAIN) : 0;
+
+    int ret = get_video_frame(frame);
+    if (ret < 0)
+        return ret;
+
+    if (this->pkt_serial != this->rev_serial) {
+        av_frame_unref(frame);
+        return 0;
+    }
+
+    if (ret > 0) {
+        reverse_gop_add(frame);
+    }
+    else if (this->finished == this->pkt_serial) {
+        // codec drained at the null pkt ending the GOP
+        this->finished = 0;
+        ReverseGop* gop = this->rev_filling;
+        if (gop->nb) {
+            if (gop->frames[0]->pts != AV_NOPTS_VALUE)
+                this->rev_limit = gop->frames[0]->pts * av_q2d(this->stream_param.time_base);
+            this->rev_filled = 1;
+        }
+        else {
+            reverse_gop_clear(gop, 0);  // nothing wanted in it, go on with the one before
+        }
+    }
+    return 0;
+}
+
+int VideoDecoder::reverse_push(int block)
+{
+    ReverseGop* gop = this->rev_playing;
     AVRational tb = this->stream_param.time_base;
+    AVRational frame_rate = this->stream_param.guessed_vframe_rate;
+    AVRational szr_dur = { frame_rate.den, frame_rate.num };
+    double duration = (frame_rate.num && frame_rate.den ? av_q2d(szr_dur) * gop->stride : 0);
 
-    if (!frame)
-        return (ThreadRetType)AVERROR(ENOMEM);
+    while (gop->nb > 0 && this->packet_q.serial == this->rev_serial) {
+        if (!this->frame_q.frame_queue_peek_writable_nowait()) {
+            if (!block)
+                break;
+            block = 0;  // wait for one slot only, there may be decoding to do then
+        }
 
-    for (;;) {
-        ret = get_video_frame( frame);
+        AVFrame* src = gop->frames[--gop->nb];
+        double pts = (src->pts == AV_NOPTS_VALUE) ? NAN : -src->pts * av_q2d(tb);   // mirrored
+        int ret = queue_picture(src, pts, duration, src->pkt_pos, this->rev_serial);
+        av_frame_unref(src);
         if (ret < 0)
-            goto the_end;
-        if (!ret)
-            continue;
+            return -1;
+    }
+    return 0;
+}
+
+void VideoDecoder::reverse_gop_add(AVFrame* frame)
+{
+    ReverseGop* gop = this->rev_filling;
+    double dpts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(this->stream_param.time_base);
 
-        AVRational guessed_frame_rate = stream_param.guessed_vframe_rate;
-        AVRational szr_dur = { guessed_frame_rate.den, guessed_frame_rate.num };
-        duration = (guessed_frame_rate.num && guessed_frame_rate.den ? av_q2d(szr_dur) : 0);
-        pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
-        ret = queue_picture( frame, pts, duration, frame->pkt_pos, pkt_serial);
+    if (isnan(this->rev_limit))
+        this->rev_limit = this->reverse_start;  // latched after serial++, see SimpleAVDecoder::start_reverse()
+    if (!isnan(dpts) && !isnan(this->rev_limit) && dpts >= this->rev_limit) {
+        av_frame_unref(frame);  // shown already
+        return;
+    }
+
+    if (gop->nb_decoded++ % gop->stride) {
         av_frame_unref(frame);
+        return;
+    }
 
-        if (ret < 0)
-            goto the_end;
+    if (gop->nb == REVERSE_GOP_MAX_FRAMES) {
+        // GOP too long to cache, keep every other frame (of this GOP) from now on
+        for (int i = 0; i < gop->nb / 2; i++)
+            FFSWAP(AVFrame*, gop->frames[i], gop->frames[2 * i]);
+        for (int i = gop->nb / 2; i < gop->nb; i++)
+            av_frame_unref(gop->frames[i]);
+        gop->nb /= 2;
+        gop->stride *= 2;
     }
- the_end:
-    av_frame_free(&frame);
-    return (ThreadRetType) 0;
+
+    if (!gop->frames[gop->nb] && !(gop->frames[gop->nb] = av_frame_alloc())) {
+        av_frame_unref(frame);
+        return;
+    }
+    av_frame_move_ref(gop->frames[gop->nb++], frame);
+}
+
+void VideoDecoder::reverse_gop_clear(ReverseGop* gop, int free_frames)
+{
+    for (int i = 0; i < REVERSE_GOP_MAX_FRAMES; i++) {
+        if (free_frames)
+            av_frame_free(&gop->frames[i]);
+        else if (gop->frames[i])
+            av_frame_unref(gop->frames[i]);
+    }
+    gop->nb = 0;
+    gop->nb_decoded = 0;
+    gop->stride = 1;
+}
+
+void VideoDecoder::reverse_reset(int free_frames)
+{
+    reverse_gop_clear(&this->rev_gops[0], free_frames);
+    reverse_gop_clear(&this->rev_gops[1], free_frames);
+    this->rev_filled = 0;
+    this->rev_limit = NAN;
+    this->rev_serial = -1;
+}
+
+int VideoDecoder::decode_step(AVFrame* frame)
+{
+    double pts;
+    double duration;
+    int ret;
+    AVRational tb = this->stream_param.time_base;
+
+    sample_memory_pressure();
+    if (this->reverse)
+        return reverse_step(frame);
+    if (this->rev_serial >= 0)
+        reverse_reset(0);   // back to forward, drop what's cached
+
+    if (this->pooled && !this->frame_q.frame_queue_peek_writable_nowait())
+        return this->packet_q.abort_request ? -1 : AVERROR(EAGAIN);
+
+    ret = get_video_frame( frame);
+    if (ret <= 0)
+        return ret;
+
+    AVRational guessed_frame_rate = stream_param.guessed_vframe_rate;
+    AVRational szr_dur = { guessed_frame_rate.den, guessed_frame_rate.num };
+    duration = (guessed_frame_rate.num && guessed_frame_rate.den ? av_q2d(szr_dur) : 0);
+    pts = (frame->pts == AV_NOPTS_VALUE) ? NAN : frame->pts * av_q2d(tb);
+    if (!isnan(this->refill_before) && refill_step_history(frame, pts, duration))
+        return 0;
+    ret = queue_picture( frame, pts, duration, frame->pkt_pos, pkt_serial);
+    av_frame_unref(frame);
+    return ret;
 }
 
 
@@ -952,7 +2369,7 @@ int AudioDecoder::audio_decode_frame()
     int wanted_nb_samples;
     Frame *af;
 
-    if (this->_av_decoder->paused)
+    if (this->_av_decoder->paused || this->_av_decoder->is_reverse())
         return -1;
 
     Clock* decoder_clock = this->_av_decoder->get_decoder_clock();
@@ -1192,56 +2609,300 @@ int VideoState::open_stream_file()
         }
     }
 
-    if (this->infinite_buffer < 0 && is_realtime(format_context))
-        this->infinite_buffer = 1;
+    if (this->infinite_buffer < 0 && is_realtime(format_context))
+        this->infinite_buffer = 1;
+
+    av_dump_format(format_context, 0, this->file_to_play, 0);
+
+    return 0;
+}
+ 
+// Return:  0 -- success, non-zero -- error.
+int SimpleAVDecoder::open_stream(const AVCodecParameters * codec_para, const StreamParam* extra_para, const DecoderProfile* profile)
+{ 
+    Decoder * decoder = NULL;
+    if (AVMEDIA_TYPE_AUDIO == codec_para->codec_type  )  {
+        decoder = &this->auddec;
+        if (!profile)
+            profile = &this->audio_profile;
+    } 
+    else if (AVMEDIA_TYPE_VIDEO == codec_para->codec_type   ) {
+        decoder = &this->viddec;
+        if (!profile)
+            profile = &this->video_profile;
+    }
+    else if (AVMEDIA_TYPE_SUBTITLE == codec_para->codec_type) {
+        decoder = &this->subdec;    // no profile, nor frame pool (subtitles don't come in AVFrame)
+    }
+
+    if (!decoder)
+    {
+        LOG_WARN("Only support audio/video/subtitle stream.\n");
+        return 1;
+    }
+    
+    if (decoder->is_inited() ) {
+        LOG_WARN("%s stream alread opened.\n", av_get_media_type_string(codec_para->codec_type));
+        return 2;
+    }
+
+    AVCodecContext* codec_context  = decoder->open_codec (codec_para , extra_para
+        , decoder == &this->subdec ? NULL : decoder->get_frame_pool(), profile);
+    if(!codec_context )
+    {
+        return 3;
+    }
+
+    if ( decoder->decoder_init( codec_context, extra_para))
+    {
+        return 4;
+    }
+
+    apply_live_overflow_policy(decoder);
+    return 0 ;
+}
+
+int SimpleAVDecoder::open_es(const StreamParam* extra_para, const DecoderProfile* profile)
+{
+    AutoLocker _yes_locked(this->es_lock);
+
+    if (this->viddec.is_inited() || this->es_sniffer) {
+        LOG_WARN("video stream alread opened.\n");
+        return 2;
+    }
+
+    this->es_sniffer = new (std::nothrow) EsCodecSniffer();
+    if (!this->es_sniffer)
+        return 3;
+
+    this->es_param = *extra_para;
+    this->es_profile = profile ? *profile : this->video_profile;
+    this->es_sniffed_bytes = 0;
+    return 0;
+}
+
+void SimpleAVDecoder::close_es()
+{
+    AutoLocker _yes_locked(this->es_lock);
+
+    delete this->es_sniffer;
+    this->es_sniffer = NULL;
+
+    for (int i = 0; i < this->es_nb_held; i++)
+        av_packet_unref(&this->es_held[i]);
+    this->es_nb_held = 0;
+
+    av_packet_unref(&this->es_bytes);
+    this->es_scanned = 0;
+}
+
+int SimpleAVDecoder::feed_es(AVPacket* pkt)
+{
+    AVPacketExtra extra;
+    extra.v_or_a = PSI_VIDEO;
+
+    AutoLocker _yes_locked(this->es_lock);
+
+    if (!this->es_sniffer) {
+        if (!this->viddec.is_inited()) {    // gave up, or not by open_es()
+            av_packet_unref(pkt);
+            return 1;
+        }
+        feed_pkt(pkt, &extra);
+        return 0;
+    }
+
+    enum AVCodecID codec_id = this->es_sniffer->sniff(pkt->data, pkt->size);
+    this->es_sniffed_bytes += pkt->size;
+
+    if (ES_SNIFF_MAX_HELD == this->es_nb_held) {    // no one could decode the oldest without what's before it anyway
+        av_packet_unref(&this->es_held[0]);
+        memmove(this->es_held, this->es_held + 1, (ES_SNIFF_MAX_HELD - 1) * sizeof(AVPacket));
+        this->es_nb_held--;
+    }
+    av_packet_move_ref(&this->es_held[this->es_nb_held++], pkt);
+
+    if (AV_CODEC_ID_NONE == codec_id) {
+        if (this->es_sniffed_bytes <= ES_SNIFF_MAX_BYTES)
+            return 0;
+
+        LOG_ERROR("Codec of ES not told in the first %d bytes, neither H.264, H.265 nor MJPEG.\n", ES_SNIFF_MAX_BYTES);
+        close_es();
+        return 1;
+    }
+
+    int r = open_sniffed_es(codec_id);
+    if (0 == r) {
+        for (int i = 0; i < this->es_nb_held; i++)
+            feed_pkt(&this->es_held[i], &extra);
+        this->es_nb_held = 0;
+    }
+
+    close_es();
+    return r;
+}
+
+// feed_bytes() flavor of feed_es(): bytes are held in one piece, NALs may span chunks.
+// Return:  0 -- not sniffing, go on with 'chunk', which holds all bytes held if the codec is just told.
+//          1 -- held, <0 -- dropped
+int SimpleAVDecoder::sniff_es_bytes(AVPacket* chunk)
+{
+    AutoLocker _yes_locked(this->es_lock);
+
+    if (!this->es_sniffer)
+        return 0;
+
+    int held = this->es_bytes.size;
+    int size = chunk->size;
+    int r = held ? av_grow_packet(&this->es_bytes, size) : av_new_packet(&this->es_bytes, size);
+    if (r < 0) {
+        av_packet_unref(chunk);
+        return r;
+    }
+    if (!held)
+        av_packet_copy_props(&this->es_bytes, chunk);   // timestamps of the 1st chunk
+    memcpy(this->es_bytes.data + held, chunk->data, size);
+    av_packet_unref(chunk);
+    this->es_sniffed_bytes += size;
+
+    int used = 0;
+    enum AVCodecID codec_id = this->es_sniffer->sniff(this->es_bytes.data + this->es_scanned
+        , this->es_bytes.size - this->es_scanned, &used);
+    this->es_scanned += used;
+
+    if (AV_CODEC_ID_NONE == codec_id) {
+        if (this->es_sniffed_bytes <= ES_SNIFF_MAX_BYTES)
+            return 1;
+
+        LOG_ERROR("Codec of ES not told in the first %d bytes, neither H.264, H.265 nor MJPEG.\n", ES_SNIFF_MAX_BYTES);
+        close_es();
+        return -1;
+    }
+
+    r = open_sniffed_es(codec_id);
+    if (0 == r)
+        av_packet_move_ref(chunk, &this->es_bytes);
 
-    av_dump_format(format_context, 0, this->file_to_play, 0);
+    close_es();
+    return r ? -1 : 0;
+}
 
-    return 0;
+// open video stream of what 'es_sniffer' tells. caller holds 'es_lock'
+int SimpleAVDecoder::open_sniffed_es(enum AVCodecID codec_id)
+{
+    AVCodecParameters codec_para;
+    memset((void*)&codec_para, 0, sizeof codec_para);
+    codec_para.codec_type = AVMEDIA_TYPE_VIDEO;
+    codec_para.codec_id = codec_id;
+    codec_para.extradata = (uint8_t*)this->es_sniffer->get_extradata(&codec_para.extradata_size);  // copied by open_codec()
+
+    int r = open_stream(&codec_para, &this->es_param, &this->es_profile);
+    av_log(NULL, AV_LOG_INFO, "ES told as %s after %lld bytes, with %d bytes of extradata, opened: %d\n", avcodec_get_name(codec_id)
+        , (long long)this->es_sniffed_bytes, codec_para.extradata_size, r);
+    return r;
 }
- 
-// Return:  0 -- success, non-zero -- error.
-int SimpleAVDecoder::open_stream(const AVCodecParameters * codec_para, const StreamParam* extra_para)
-{ 
-    Decoder * decoder = NULL;
-    if (AVMEDIA_TYPE_AUDIO == codec_para->codec_type  )  {
-        decoder = &this->auddec;
-    } 
-    else if (AVMEDIA_TYPE_VIDEO == codec_para->codec_type   ) {
-        decoder = &this->viddec;
-    }
 
-    if (!decoder)
-    {
-        LOG_WARN("Only support audio/video stream.\n");
+int SimpleAVDecoder::open_channel(int channel, const AVCodecParameters* codec_para, const StreamParam* extra_para, const DecoderProfile* profile)
+{
+    if (channel <= 0 || channel >= MAX_CHANNELS || AVMEDIA_TYPE_VIDEO != codec_para->codec_type) {
+        LOG_WARN("Channel %d: only video of channel [1, %d) could be opened.\n", channel, MAX_CHANNELS);
         return 1;
     }
-    
-    if (decoder->is_inited() ) {
-        LOG_WARN("%s stream alread opened.\n", AVMEDIA_TYPE_AUDIO == codec_para->codec_type ? "audio" : "video" );
+
+    if (this->channels[channel]) {
+        LOG_WARN("Channel %d alread opened.\n", channel);
         return 2;
     }
 
-    AVCodecContext* codec_context  = Decoder::create_codec_directly (codec_para , extra_para);
-    if(!codec_context )
-    {
+    VideoDecoder* decoder = new (std::nothrow) VideoDecoder(this);
+    if (!decoder)
+        return 3;
+    decoder->channel = channel;
+    decoder->set_step_history(0, 0);
+    decoder->packet_q.space_signal = &this->feeder_wakeup;
+
+    AVCodecContext* codec_context = decoder->open_codec(codec_para, extra_para, decoder->get_frame_pool()
+        , profile ? profile : &this->video_profile);
+    if (!codec_context) {
+        delete decoder;
         return 3;
     }
 
-    if ( decoder->decoder_init( codec_context, extra_para))
-    {
+    if (decoder->decoder_init(codec_context, extra_para)) {
+        avcodec_free_context(&codec_context);
+        delete decoder;
         return 4;
     }
 
-    return 0 ;
+    apply_live_overflow_policy(decoder);
+
+    AutoLocker _yes_locked(this->channels_lock);
+    this->channels[channel] = decoder;
+    return 0;
+}
+
+void SimpleAVDecoder::close_channel(int channel)
+{
+    if (channel <= 0 || channel >= MAX_CHANNELS)
+        return;
+
+    VideoDecoder* decoder;
+    {
+        AutoLocker _yes_locked(this->channels_lock);
+        decoder = this->channels[channel];
+        this->channels[channel] = NULL;
+    }
+
+    if (decoder) {
+        decoder->decoder_destroy();
+        delete decoder;
+        this->force_refresh = 1;    // its tile is gone
+    }
+}
+
+int SimpleAVDecoder::get_channel_count()
+{
+    AutoLocker _yes_locked(this->channels_lock);   // recursive, display_channels() calls it with the lock held
+    int count = 0;
+    for (int i = 1; i < MAX_CHANNELS; i++)
+        if (this->channels[i])
+            count++;
+    return count;
+}
+
+void SimpleAVDecoder::set_live_overflow_policy(double max_seconds, int max_bytes)
+{
+    this->live_max_seconds = max_seconds;
+    this->live_max_bytes = max_bytes;
+
+    if (this->viddec.is_inited())
+        apply_live_overflow_policy(&this->viddec);
+    if (this->auddec.is_inited())
+        apply_live_overflow_policy(&this->auddec);
+
+    AutoLocker _yes_locked(this->channels_lock);
+    for (int i = 1; i < MAX_CHANNELS; i++)
+        if (this->channels[i])
+            apply_live_overflow_policy(this->channels[i]);
+}
+
+void SimpleAVDecoder::apply_live_overflow_policy(Decoder* decoder)
+{
+    int64_t max_duration = 0;
+    if (this->live_max_seconds > 0 && decoder->stream_param.time_base.num)
+        max_duration = (int64_t)(this->live_max_seconds / av_q2d(decoder->stream_param.time_base));
+
+    decoder->packet_q.set_overflow_policy(this->live_max_bytes, max_duration);
 }
 
 // return a mask:  bit0  -- V opened, bit1 -- A opened 
-int SimpleAVDecoder::open_stream_from_avformat(AVFormatContext* format_context, int* vstream_id, int* astream_id)
+int SimpleAVDecoder::open_stream_from_avformat(AVFormatContext* format_context, int* vstream_id, int* astream_id, int* sstream_id)
 {
     // 1. some preparation
     this->max_frame_duration = (format_context->iformat->flags & AVFMT_TS_DISCONT) ? 10.0 : 3600.0;
     this->realtime = is_realtime(format_context);
+    if (!this->realtime)    // local file is throttled by reader, dropping GOPs there makes no sense
+        this->live_max_seconds = this->live_max_bytes = 0;
 
     // 2. open vstream if present
     int vs,as; 
@@ -1288,6 +2949,25 @@ int SimpleAVDecoder::open_stream_from_avformat(AVFormatContext* format_context,
             *astream_id = as;
         }
     }
+
+    // 4. subtitle stream, related to what's opened
+    if (sstream_id && this->viddec.is_inited())
+    {
+        int ss = av_find_best_stream(format_context, AVMEDIA_TYPE_SUBTITLE, -1, (as >= 0 ? as : vs), NULL, 0);
+        if (ss >= 0)
+        {
+            AVStream* stream = format_context->streams[ss];
+            StreamParam  extra_para;  
+            extra_para.time_base  = stream->time_base;
+            extra_para.start_time = stream->start_time;
+
+            if (0 == open_stream(stream->codecpar , &extra_para))
+            {
+                LOG_DEBUG("%s\n",codec_para_2_str(stream->codecpar).c_str());
+                *sstream_id = ss;
+            }
+        }
+    }
     
     return get_opened_streams_mask();
 }
@@ -1315,26 +2995,115 @@ int VideoState::read_loop_check_pause() // return: nonzero -- shoud 'continue',
         
         /* wait 10 ms to avoid trying to get another packet */
         /* XXX: horrible */
-        av_usleep( 10 * 1000);
+        unsigned epoch = this->av_decoder.feeder_wakeup.get_epoch();
+        if (this->paused && !this->seek_req && !this->abort_request)
+            this->av_decoder.feeder_wakeup.wait(epoch, READER_RETRY_WAIT_MS);
         return 1;
     }
     return 0;
 }
 
 // discard cache packets for 'seek'
-void SimpleAVDecoder::discard_buffer(double seek_target ) 
+void SimpleAVDecoder::discard_buffer(double seek_target, int accurate) 
 {
+    if (accurate && !isnan(seek_target)) {
+        // coming serial of each packet queue decodes up to 'seek_target' silently
+        this->auddec.decode_until = this->viddec.decode_until = seek_target;
+        this->auddec.until_serial = this->auddec.packet_q.serial + 1;
+        this->viddec.until_serial = this->viddec.packet_q.serial + 1;
+    }
+    this->auddec.packetizer.reset();    // bytes of a unit before seek are no use after it
+    this->viddec.packetizer.reset();
+    this->subdec.packetizer.reset();
     if (this->auddec.is_inited()) {
         this->auddec.packet_q.packet_queue_flush(); // discard cache
         this->auddec.packet_q.packet_queue_put(&PacketQueue::flush_pkt); // packet queue 的 serial ++
     }
     if (this->viddec.is_inited()) {
+        if (!isnan(this->step_refill_req)) {
+            // seek for step back, step history is still good
+            this->viddec.refill_before = this->step_refill_req;
+            this->step_refill_req = NAN;
+            this->step_rewound = 1;
+        }
+        else {
+            this->viddec.refill_before = NAN;
+            this->viddec.step_history.clear();
+            this->step_rewound = 0;
+            this->stepping = 0;
+        }
         this->viddec.packet_q.packet_queue_flush();
         this->viddec.packet_q.packet_queue_put(&PacketQueue::flush_pkt);
     }
+    if (this->subdec.is_inited()) {
+        this->subdec.packet_q.packet_queue_flush();
+        this->subdec.packet_q.packet_queue_put(&PacketQueue::flush_pkt);
+    }
+    {
+        AutoLocker _yes_locked(this->channels_lock);
+        for (int i = 1; i < MAX_CHANNELS; i++) {
+            if (this->channels[i]) {
+                this->channels[i]->packetizer.reset();
+                this->channels[i]->packet_q.packet_queue_flush();
+                this->channels[i]->packet_q.packet_queue_put(&PacketQueue::flush_pkt);
+            }
+        }
+    }
+    purge_stale_frames();
     this->extclk.set_clock(seek_target, 0);    
 }
 
+// frames before seek go now, not at the refresh they would be due. decoders waiting for room see the new serial
+void SimpleAVDecoder::purge_stale_frames()
+{
+    {
+        // video frame queues are consumed by refresh loop only, under 'hold_lock', so we may consume for it
+        AutoLocker _hold_locked(this->hold_lock);
+        int nb = 0;
+        if (this->viddec.is_inited()) {
+            nb += this->viddec.frame_q.frame_queue_purge(this->viddec.packet_q.serial);
+            this->seek_serial = this->viddec.packet_q.serial;
+            this->seek_start = av_gettime_relative();
+        }
+        AutoLocker _yes_locked(this->channels_lock);
+        for (int i = 1; i < MAX_CHANNELS; i++)
+            if (this->channels[i])
+                nb += this->channels[i]->frame_q.frame_queue_purge(this->channels[i]->packet_q.serial);
+        this->seek_stats.nb_purged += nb;
+    }
+
+    // audio one belongs to audio callback, it drops the rest by serial as ever
+    this->auddec.frame_q.frame_queue_signal();
+    this->viddec.frame_q.frame_queue_signal();
+    this->subdec.frame_q.frame_queue_signal();
+    AutoLocker _yes_locked(this->channels_lock);
+    for (int i = 1; i < MAX_CHANNELS; i++)
+        if (this->channels[i])
+            this->channels[i]->frame_q.frame_queue_signal();
+}
+
+// first frame after seek shown, by refresh loop
+void SimpleAVDecoder::on_seek_shown(const Frame* vp)
+{
+    if (!this->seek_start || vp->serial != this->seek_serial)
+        return;
+
+    int64_t elapsed = av_gettime_relative() - this->seek_start;
+    this->seek_start = 0;
+    this->seek_stats.nb_seeks++;
+    this->seek_stats.last_time = elapsed;
+    this->seek_stats.total_time += elapsed;
+    this->seek_stats.max_time = FFMAX(this->seek_stats.max_time, elapsed);
+    av_log(NULL, AV_LOG_VERBOSE, "seek to first frame: %.2f ms (avg %.2f ms over %" PRId64 ")\n"
+        , elapsed / 1000.0, this->seek_stats.total_time / 1000.0 / this->seek_stats.nb_seeks, this->seek_stats.nb_seeks);
+}
+
+void SimpleAVDecoder::get_seek_stats(SeekStats* stats)
+{
+    AutoLocker _hold_locked(this->hold_lock);
+    *stats = this->seek_stats;
+}
+
 int SimpleAVDecoder::is_stalled()
 {   
     int codec_num =  0, eos_num = 0;
@@ -1363,39 +3132,253 @@ int  VideoState::read_loop_check_seek()   // return: > 0 -- shoud 'continue', 0
         return 0;
     }
 
+    if (this->reverse_speed > 0 && !(this->seek_flags & AVSEEK_FLAG_BYTE)) {
+        // in reverse, seek just restarts it from the target
+        double pos = this->av_decoder.start_reverse(this->reverse_speed, this->seek_pos / (double)AV_TIME_BASE);
+        this->rev_next_end = llrint(pos / av_q2d(this->format_context->streams[this->last_video_stream]->time_base));
+        this->rev_at_start = 0;
+        this->seek_req = 0;
+        return 0;
+    }
+
     int64_t seek_target = this->seek_pos;
     int64_t seek_min = this->seek_rel > 0 ? seek_target - this->seek_rel + 2 : INT64_MIN;
     int64_t seek_max = this->seek_rel < 0 ? seek_target - this->seek_rel - 2 : INT64_MAX;
+    int accurate = this->av_decoder.is_accurate_seek() && !this->seek_backward && !(this->seek_flags & AVSEEK_FLAG_BYTE);
+    if (this->seek_backward || accurate)
+        seek_max = seek_target;     // keyframe before target
     // FIXME the +-2 is due to rounding being not done in the correct direction in generation
     //      of the seek_pos/seek_rel variables
 
     int ret = avformat_seek_file(this->format_context, -1, seek_min, seek_target, seek_max, this->seek_flags);
+    if (ret < 0 && seek_max == seek_target) // no keyframe before target, e.g. near the start
+        ret = avformat_seek_file(this->format_context, -1, seek_min, seek_target, INT64_MAX, this->seek_flags);
     if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR,
             "%s: error while seeking\n", this->format_context->url);
     }
     else {
         // seek成功，清现有的缓存  
-        this->av_decoder.discard_buffer( (this->seek_flags & AVSEEK_FLAG_BYTE) ?  NAN : seek_target / (double)AV_TIME_BASE);
+        this->av_decoder.discard_buffer( (this->seek_flags & AVSEEK_FLAG_BYTE) ?  NAN : seek_target / (double)AV_TIME_BASE, accurate);
     }
 
     this->seek_req = 0;
     this->eof = 0;
-    if (this->paused)
+    if (this->paused && !this->seek_backward)   // backward one is for step back, which shows frame by itself
         this->step_to_next_frame();
 
     return 0;
 }
 
+void VideoState::stream_reverse(double speed)
+{
+    this->reverse_req = av_clipd(speed, 0, REVERSE_SPEED_MAX);
+    this->av_decoder.feeder_wakeup.notify();
+}
+
+int VideoState::read_loop_check_reverse()   // return: > 0 -- shoud 'continue', 0 -- go on current iteration, < 0 -- error exit loop
+{
+    double req = this->reverse_req;
+    if (req != this->reverse_speed) {
+        if (this->last_video_stream < 0) {
+            this->reverse_req = 0;  // nothing to play backwards
+            return 0;
+        }
+
+        if (req > 0 && this->reverse_speed <= 0) {
+            double pos = this->av_decoder.start_reverse(req);
+            this->rev_next_end = isnan(pos) ? 0 : llrint(pos / av_q2d(this->format_context->streams[this->last_video_stream]->time_base));
+            this->rev_at_start = 0;
+            this->eof = 0;
+            av_log(NULL, AV_LOG_VERBOSE, "reverse playback x%.2f from %.3f\n", req, pos);
+        }
+        else if (req > 0) {
+            this->av_decoder.get_decoder_clock()->set_clock_speed(req);
+        }
+        else {
+            double pos = this->av_decoder.get_stream_position();
+            if (isnan(pos))
+                pos = this->rev_next_end * av_q2d(this->format_context->streams[this->last_video_stream]->time_base);
+            this->av_decoder.stop_reverse();
+            this->reverse_speed = 0;
+            this->stream_seek((int64_t)(pos * AV_TIME_BASE), 0, 0);   // go on forward from where we are
+            return 1;
+        }
+        this->reverse_speed = req;
+    }
+
+    if (this->reverse_speed <= 0)
+        return 0;
+
+    // decoder takes GOPs one by one, load the one before only when it has taken all pkts of the last one
+    unsigned epoch = this->av_decoder.feeder_wakeup.get_epoch();
+    if (this->rev_at_start || !this->av_decoder.is_reverse_gop_wanted()) {
+        if (!this->seek_req && !this->abort_request && this->reverse_req == this->reverse_speed)
+            this->av_decoder.feeder_wakeup.wait(epoch, READER_IDLE_WAIT_MS);
+        return 1;
+    }
+
+    read_reverse_gop();
+    return 1;
+}
+
+// load the GOP right before 'rev_next_end' into video packet queue, ended by a null pkt. return <0 if aborted
+int VideoState::read_reverse_gop()
+{
+    AVStream* st = this->format_context->streams[this->last_video_stream];
+    int64_t start_time = (st->start_time != AV_NOPTS_VALUE) ? st->start_time : 0;
+    int64_t backoff = FFMAX(1, (int64_t)(REVERSE_SEEK_BACKOFF / av_q2d(st->time_base)));
+    int64_t target = this->rev_next_end - 1;
+    int64_t key_ts = AV_NOPTS_VALUE;
+    AVPacket pkt1, *pkt = &pkt1;
+    int ret;
+
+    // seek to the keyframe before 'rev_next_end'. index may bring us to the GOP loaded already, then step further back
+    for (int tries = 0; ; tries++) {
+        if (target < start_time || tries >= REVERSE_SEEK_TRIES) {
+            this->rev_at_start = 1;
+            av_log(NULL, AV_LOG_VERBOSE, "reverse playback reached the start\n");
+            return 0;
+        }
+
+        if (av_seek_frame(this->format_context, this->last_video_stream, target, AVSEEK_FLAG_BACKWARD) < 0) {
+            av_log(NULL, AV_LOG_ERROR, "%s: error while seeking backwards\n", this->format_context->url);
+            this->rev_at_start = 1;
+            return 0;
+        }
+
+        // the first video pkt tells where we are
+        while ((ret = av_read_frame(this->format_context, pkt)) >= 0 && pkt->stream_index != this->last_video_stream)
+            av_packet_unref(pkt);
+        if (ret >= 0) {
+            int64_t ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+            if (ts != AV_NOPTS_VALUE && ts < this->rev_next_end) {
+                key_ts = ts;
+                break;
+            }
+            av_packet_unref(pkt);
+        }
+        if (this->abort_request)
+            return -1;
+
+        target -= backoff;
+    }
+
+    // feed pkts up to the GOP loaded last time
+    AVPacketExtra extra;
+    int nb = 0;
+    for (;;) {
+        int64_t ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+        if (nb && (pkt->flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE && ts >= this->rev_next_end) {
+            av_packet_unref(pkt);
+            break;
+        }
+
+        fill_packet_extra(&extra, pkt);
+        this->av_decoder.feed_pkt(pkt, &extra);
+        nb++;
+
+        while ((ret = av_read_frame(this->format_context, pkt)) >= 0 && pkt->stream_index != this->last_video_stream)
+            av_packet_unref(pkt);
+        if (ret < 0)
+            break;
+        if (this->abort_request) {
+            av_packet_unref(pkt);
+            return -1;
+        }
+    }
+
+    this->av_decoder.feed_reverse_gop_end();
+    this->rev_next_end = key_ts;
+    av_log(NULL, AV_LOG_DEBUG, "reverse playback: GOP at %.3f, %d pkts\n", key_ts * av_q2d(st->time_base), nb);
+    return 0;
+}
+
+int SimpleAVDecoder::get_packet_pool_stats(int v_or_a, int64_t* hits, int64_t* misses)
+{
+    Decoder* decoder = NULL;
+    if (PSI_VIDEO == v_or_a)
+        decoder = &this->viddec;
+    else if (PSI_AUDIO == v_or_a)
+        decoder = &this->auddec;
+
+    if (!decoder || !decoder->is_inited())
+        return 1;
+
+    AutoLocker _yes_locked(decoder->packet_q.cond);
+    *hits   = decoder->packet_q.node_pool.hits;
+    *misses = decoder->packet_q.node_pool.misses;
+    return 0;
+}
+
+int SimpleAVDecoder::get_packetizer_stats(int v_or_a, int64_t* units, int64_t* copied_units)
+{
+    Decoder* decoder = NULL;
+    if (PSI_VIDEO == v_or_a)
+        decoder = &this->viddec;
+    else if (PSI_AUDIO == v_or_a)
+        decoder = &this->auddec;
+
+    if (!decoder || !decoder->is_inited())
+        return 1;
+
+    *units        = decoder->packetizer.units;  // by feeder, a glance is fine
+    *copied_units = decoder->packetizer.copied_units;
+    return 0;
+}
+
+int SimpleAVDecoder::get_frame_pool_stats(int v_or_a, FrameBufferPoolStats* stats)
+{
+    Decoder* decoder = NULL;
+    if (PSI_VIDEO == v_or_a)
+        decoder = &this->viddec;
+    else if (PSI_AUDIO == v_or_a)
+        decoder = &this->auddec;
+
+    if (!decoder || !decoder->is_inited())
+        return 1;
+
+    decoder->frame_pool.get_stats(stats);
+    return 0;
+}
+
+int SimpleAVDecoder::get_open_stats(int v_or_a, StreamOpenStats* stats, int channel)
+{
+    AutoLocker _yes_locked(this->channels_lock);
+    Decoder* decoder = NULL;
+    if (PSI_VIDEO == v_or_a)
+        decoder = channel ? (channel > 0 && channel < MAX_CHANNELS ? this->channels[channel] : NULL) : &this->viddec;
+    else if (PSI_AUDIO == v_or_a)
+        decoder = &this->auddec;
+    else if (PSI_SUBTITLE == v_or_a)
+        decoder = &this->subdec;
+
+    if (!decoder || !decoder->is_inited())
+        return 1;
+
+    *stats = decoder->open_stats;
+    return 0;
+}
+
 int SimpleAVDecoder::is_buffer_full()
 {
-    if (this->auddec.packet_q.size + this->viddec.packet_q.size > MAX_QUEUE_SIZE)
+    AutoLocker _yes_locked(this->channels_lock);
+    int size = this->auddec.packet_q.size + this->viddec.packet_q.size + this->subdec.packet_q.size; // subtitles: size only, too sparse to be 'enough'
+    int enough = this->auddec.buffered_enough_packets() && this->viddec.buffered_enough_packets();
+    for (int i = 1; i < MAX_CHANNELS; i++) {
+        if (this->channels[i]) {
+            size += this->channels[i]->packet_q.size;
+            enough = enough && this->channels[i]->buffered_enough_packets();
+        }
+    }
+
+    if (size > MAX_QUEUE_SIZE)
     {
         //OutputDebugString("#\n"); 
         return 1;
     }
 
-    if (this->auddec.buffered_enough_packets() && this->viddec.buffered_enough_packets())
+    if (enough)
     {
         //OutputDebugString("$\n");
         return 2;
@@ -1406,25 +3389,101 @@ int SimpleAVDecoder::is_buffer_full()
 
 void SimpleAVDecoder::feed_null_pkt()  
 {
-    if (this->viddec.is_inited())
-        this->viddec.packet_q.packet_queue_put_nullpacket(0);
-    if (this->auddec.is_inited())
-        this->auddec.packet_q.packet_queue_put_nullpacket(0);
+    Decoder* decoders[] = { &this->viddec, &this->auddec, &this->subdec };
+    for (int i = 0; i < 3; i++) {
+        if (!decoders[i]->is_inited())
+            continue;
+        if (decoders[i]->packetizer.is_inited())
+            decoders[i]->packetizer.packetize(NULL, 0, &decoders[i]->packet_q);  // the unit still held by parser
+        decoders[i]->packet_q.packet_queue_put_nullpacket(0);
+    }
+
+    AutoLocker _yes_locked(this->channels_lock);
+    for (int i = 1; i < MAX_CHANNELS; i++) {
+        if (this->channels[i]) {
+            if (this->channels[i]->packetizer.is_inited())
+                this->channels[i]->packetizer.packetize(NULL, 0, &this->channels[i]->packet_q);
+            this->channels[i]->packet_q.packet_queue_put_nullpacket(0);
+        }
+    }
+}
+
+// decoder 'extra' addressed, NULL if it goes nowhere. caller holds 'channels_lock'
+Decoder* SimpleAVDecoder::route_decoder(const AVPacketExtra* extra)
+{
+    if (PSI_AUDIO == extra->v_or_a)
+        return !extra->channel ? &this->auddec : NULL;    // one audio output only, that of channel 0
+    if (PSI_SUBTITLE == extra->v_or_a)
+        return !extra->channel && this->subdec.is_inited() ? &this->subdec : NULL;
+    if (PSI_VIDEO != extra->v_or_a)
+        return NULL;
+    if (!extra->channel)
+        return &this->viddec;
+    if (extra->channel > 0 && extra->channel < MAX_CHANNELS && this->channels[extra->channel])
+        return this->channels[extra->channel];
+    return NULL;
+}
+
+// packet queue 'extra' addressed, NULL if it goes nowhere
+PacketQueue* SimpleAVDecoder::route_pkt(const AVPacketExtra* extra)
+{
+    Decoder* decoder = route_decoder(extra);
+    return decoder ? &decoder->packet_q : NULL;
 }
 
 void SimpleAVDecoder::feed_pkt(AVPacket* pkt, const AVPacketExtra* extra) 
 {
-    if (PSI_VIDEO == extra->v_or_a  ) {
-        this->viddec.packet_q.packet_queue_put(pkt);
-    }
-    else if (PSI_AUDIO == extra->v_or_a  ) {
-        this->auddec.packet_q.packet_queue_put(pkt);
+    AutoLocker _yes_locked(this->channels_lock);
+    PacketQueue* q = route_pkt(extra);
+    if (q) {
+        q->packet_queue_put(pkt);
     }
     else {
         av_packet_unref(pkt);
     }
 }
 
+void SimpleAVDecoder::feed_pkt_many(AVPacket* pkts, int nb, const AVPacketExtra* extra)
+{
+    AutoLocker _yes_locked(this->channels_lock);
+    PacketQueue* q = route_pkt(extra);
+    if (q) {
+        q->packet_queue_put_many(pkts, nb);
+    }
+    else {
+        for (int i = 0; i < nb; i++)
+            av_packet_unref(&pkts[i]);
+    }
+}
+
+int SimpleAVDecoder::feed_bytes(AVPacket* chunk, const AVPacketExtra* extra, int whole_units)
+{
+    if (PSI_VIDEO == extra->v_or_a && !extra->channel) {
+        int r = sniff_es_bytes(chunk);  // ES of unknown codec
+        if (r)
+            return r < 0 ? 1 : 0;
+    }
+
+    AutoLocker _yes_locked(this->channels_lock);
+    Decoder* decoder = route_decoder(extra);
+    if (!decoder || !decoder->is_inited()) {
+        av_packet_unref(chunk);
+        return 1;
+    }
+
+    Packetizer* packetizer = &decoder->packetizer;
+    if (!packetizer->is_inited() && (packetizer->has_failed() || packetizer->init(decoder->avctx))) {
+        if (whole_units) {  // no parser, no keyframe flag. units go on anyway
+            decoder->packet_q.packet_queue_put(chunk);
+            return 0;
+        }
+        av_packet_unref(chunk);
+        return 2;
+    }
+
+    return packetizer->packetize(chunk, whole_units, &decoder->packet_q) < 0 ? 3 : 0;
+}
+
 VideoState::VideoState()
 {
     format_context = NULL;
@@ -1434,10 +3493,19 @@ VideoState::VideoState()
     last_paused = 0;
     seek_req = 0;
 	seek_flags = 0;
+    seek_backward = 0;
     infinite_buffer = -1;
     streamopt_start_time = streamopt_duration = AV_NOPTS_VALUE;
     streamopt_autoexit = 0;
+    streamopt_all_video = 0;
+    streamopt_subtitle_disable = 0;
+    streamopt_es_feed = 0;
 	parser_cb = NULL;
+    for (int i = 0; i < MAX_CHANNELS; i++)
+        channel_streams[i] = -1;
+    reverse_req = reverse_speed = 0;
+    rev_next_end = 0;
+    rev_at_start = 0;
 }
 #define LOOP_CHECK(func) \
 {\
@@ -1481,13 +3549,18 @@ ThreadRetType  VideoState::thread_main()
         // 3.3 hanle 'seek' request
         LOOP_CHECK(read_loop_check_seek());
 
+        // 3.4 reverse playback loads GOPs by itself
+        LOOP_CHECK(read_loop_check_reverse());
+
         // 3.4 now we r going to read packet
 
         /* if the queue are full, no need to read more */
+        unsigned epoch = this->av_decoder.feeder_wakeup.get_epoch(); // before checking, so that we won't miss a notify in between
         if  (infinite_buffer <1 && this->av_decoder.is_buffer_full())
         {
-            /* wait 10 ms */
-            av_usleep(10);
+            /* sleep until decoders take some packets, or seek/pause/abort comes */
+            if (!this->seek_req && !this->abort_request && this->paused == this->last_paused)
+                this->av_decoder.feeder_wakeup.wait(epoch, READER_IDLE_WAIT_MS);
             continue;
         }
 
@@ -1510,8 +3583,10 @@ ThreadRetType  VideoState::thread_main()
                 if (streamopt_autoexit)
                     goto fail;
             }
-            
-            av_usleep(10);
+
+            /* nothing to read by now. after EOF only seek/pause/abort (or a growing file) can change that */
+            if (!this->seek_req && !this->abort_request && this->paused == this->last_paused)
+                this->av_decoder.feeder_wakeup.wait(epoch, this->eof ? READER_IDLE_WAIT_MS : READER_RETRY_WAIT_MS);
             continue;
         } else {
             this->eof = 0;
@@ -1526,7 +3601,11 @@ ThreadRetType  VideoState::thread_main()
         AVPacketExtra extra;
         fill_packet_extra( & extra, pkt);
 
-        this->av_decoder.feed_pkt(pkt, &extra);
+        if (this->streamopt_es_feed && PSI_VIDEO == extra.v_or_a && !extra.channel)
+            this->av_decoder.feed_bytes(pkt, &extra    // a demuxer of the codec gives whole units
+                , AVMEDIA_TYPE_VIDEO == format_context->streams[pkt->stream_index]->codecpar->codec_type);
+        else
+            this->av_decoder.feed_pkt(pkt, &extra);
     }
     
     ret = 0;
@@ -1548,6 +3627,70 @@ void VideoState::fill_packet_extra( AVPacketExtra* extra, const AVPacket* pkt) c
     {
         extra->v_or_a = PSI_AUDIO;
     }
+    else if ( this->last_subtitle_stream == pkt->stream_index  )
+    {
+        extra->v_or_a = PSI_SUBTITLE;
+    }
+    else
+    {
+        for (int i = 1; i < MAX_CHANNELS; i++) {
+            if (this->channel_streams[i] == pkt->stream_index) {
+                extra->v_or_a = PSI_VIDEO;
+                extra->channel = i;
+                break;
+            }
+        }
+    }
+}
+
+// video streams other than the primary one, one channel each
+void VideoState::open_video_channels()
+{
+    for (int i = 0; i < MAX_CHANNELS; i++)
+        this->channel_streams[i] = -1;
+
+    int channel = 1;
+    for (unsigned int i = 0; i < this->format_context->nb_streams && channel < MAX_CHANNELS; i++) {
+        AVStream* stream = this->format_context->streams[i];
+        if ((int)i == this->last_video_stream || AVMEDIA_TYPE_VIDEO != stream->codecpar->codec_type
+            || (stream->disposition & AV_DISPOSITION_ATTACHED_PIC))
+            continue;
+
+        StreamParam extra_para;
+        extra_para.time_base = stream->time_base;
+        extra_para.start_time = stream->start_time;
+        extra_para.guessed_vframe_rate = av_guess_frame_rate(this->format_context, stream, NULL);
+        if (0 == this->av_decoder.open_channel(channel, stream->codecpar, &extra_para))
+            this->channel_streams[channel++] = i;
+    }
+}
+
+// video only, what the demuxer knows of its codec is thrown away: its pkts go to SimpleAVDecoder::feed_bytes() 
+// like chunks from a pipe. e.g. to try sniffing with ES dumped by 'ffmpeg -i x.mp4 -c:v copy -an x.h264'.
+// file is read by 'data' demuxer (raw chunks, no timestamps) unless another one is forced, e.g. '-f h264'
+int VideoState::open_es_feed()
+{
+    int vs = av_find_best_stream(this->format_context, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (vs < 0 && this->format_context->nb_streams > 0
+        && AVMEDIA_TYPE_DATA == this->format_context->streams[0]->codecpar->codec_type)
+        vs = 0;
+    if (vs < 0)
+    {
+        LOG_WARN("No video stream found.\n");
+        return 1;
+    }
+
+    AVStream* stream = this->format_context->streams[vs];
+    StreamParam extra_para;
+    extra_para.time_base = stream->time_base;
+    extra_para.start_time = stream->start_time;
+    extra_para.guessed_vframe_rate = av_guess_frame_rate(this->format_context, stream, NULL);
+
+    if (this->av_decoder.open_es(&extra_para))
+        return 2;
+
+    this->last_video_stream = vs;
+    return 0;
 }
 
 int VideoState::is_pkt_in_play_range( AVPacket* pkt)
@@ -1587,11 +3730,13 @@ int VideoState::open_input_stream(const char *filename, AVInputFormat *iformat,
 {
     AutoReleasePtr<VideoState> close_if_failed(this);
 
-    this->last_video_stream = this->last_audio_stream =  -1;
+    this->last_video_stream = this->last_audio_stream = this->last_subtitle_stream = -1;
 
     this->file_to_play = filename;
     
     this->iformat = iformat;
+    if (this->streamopt_es_feed && !iformat)
+        this->iformat = av_find_input_format("data");
 
     // open 'avformat' for input file, 'seek' if need
     if (open_stream_file())
@@ -1600,12 +3745,24 @@ int VideoState::open_input_stream(const char *filename, AVInputFormat *iformat,
     }
 
     // open 'avcodec' for each stream we interest in
-    if (0 == this->av_decoder.open_stream_from_avformat(this->format_context, &last_video_stream, &last_audio_stream))
+    if (this->streamopt_es_feed)
+    {
+        if (open_es_feed())
+        {
+            av_log(NULL, AV_LOG_FATAL, "Failed to open file '%s' as raw ES.\n",  this->file_to_play.GetString());
+            return 6;
+        }
+    }
+    else if (0 == this->av_decoder.open_stream_from_avformat(this->format_context, &last_video_stream, &last_audio_stream
+        , this->streamopt_subtitle_disable ? NULL : &last_subtitle_stream))
     {
         av_log(NULL, AV_LOG_FATAL, "Failed to open file '%s'.\n",  this->file_to_play.GetString());
         return 6;
     }
 
+    if (this->streamopt_all_video)
+        open_video_channels();
+
     if ( pause_now)
     {
         this->toggle_pause();
@@ -1619,7 +3776,7 @@ int VideoState::open_input_stream(const char *filename, AVInputFormat *iformat,
 
 void VideoState::seek_chapter( int incr)
 {
-    int64_t pos = (int64_t) ( this->av_decoder.get_master_clock() * AV_TIME_BASE );
+    int64_t pos = (int64_t) ( this->av_decoder.get_stream_position() * AV_TIME_BASE );
     int i;
 
     if (!this->format_context->nb_chapters)
@@ -21,20 +21,22 @@ class VideoState;
 class SimpleAVDecoder;
 class RenderBase;
 
-typedef enum   // SimpleAVDecoder spec : V stream is 1, A stream is 2
+typedef enum   // SimpleAVDecoder spec : V stream is 1, A stream is 2, S stream is 4
 {
     PSI_BAD   =  0,
     PSI_VIDEO =  1,
     PSI_AUDIO =  2,
+    PSI_SUBTITLE = 4,
 }PsuedoStreamId ; 
 
 struct AVPacketExtra  // 'decoder' could be seperated from 'parser' (even on diff host).
                       // we may need some extra info when feeding AVPacket to 'decoder'
 {
     int v_or_a; // must be PsuedoStreamId 
+    int channel; // 0 -- primary V/A stream, others see SimpleAVDecoder::open_channel()
 
     AVPacketExtra()
-        : v_or_a(PSI_BAD)
+        : v_or_a(PSI_BAD), channel(0)
     {
     }
 };
@@ -47,8 +49,113 @@ public:
     AVRational  guessed_vframe_rate;  // only used in V stream
 };
 
+typedef enum    // steps of VideoDecoder degradation, each one includes the previous ones
+{
+    DEGRADE_NONE = 0,
+    DEGRADE_SKIP_LOOP_FILTER,   // skip_loop_filter = all
+    DEGRADE_SKIP_IDCT,          // skip_idct = nonref
+    DEGRADE_DROP_NONREF,        // drop non-ref packets before avcodec_send_packet
+    DEGRADE_KEYFRAME_ONLY,      // skip_frame = nonkey
+    DEGRADE_MAX = DEGRADE_KEYFRAME_ONLY,
+}DegradeLevel;
+
+struct DecoderProfile // codec tuning per stream, applied before avcodec_open2
+{
+public:
+    int thread_count;       // 0 -- auto (number of cores)
+    int thread_type;        // FF_THREAD_FRAME and/or FF_THREAD_SLICE
+    int skip_loop_filter;   // AVDiscard
+    int lowres;             // clipped to what codec supports
+    int fast;               // AV_CODEC_FLAG2_FAST, allow non spec compliant speedup tricks
+    int intra_workers;      // >1 -- intra-only video decoded by that many contexts at once, see IntraDecodeGroup
+
+    DecoderProfile()    // same as what libavcodec gives if we spec nothing
+        : thread_count(1), thread_type(FF_THREAD_FRAME | FF_THREAD_SLICE)
+        , skip_loop_filter(AVDISCARD_DEFAULT), lowres(0), fast(0), intra_workers(0)
+    {
+    }
+
+    // "latency"    -- slice threads only, no frame-thread delay. for live
+    // "throughput" -- frame threads, one per core (intra-only: a context per core). for offline review
+    // Return:  0 -- success, non-zero -- unknown preset.
+    int load_preset(const char* name);
+
+    void apply(AVCodecContext* codec_context, const AVCodec* codec) const;
+};
+
+struct CodecContextKey // what an idle codec context must match to be reused, see CodecContextCache
+{
+public:
+    int      codec_id;      // AV_CODEC_ID_NONE -- not to be cached
+    int      width, height, format;     // format: AVPixelFormat/AVSampleFormat
+    int      sample_rate, channels;
+    int      extradata_size;
+    uint32_t extradata_hash;
+    int      thread_count, thread_type, lowres, fast;   // from DecoderProfile, fixed by avcodec_open2
+
+    CodecContextKey()
+    {
+        memset(this, 0, sizeof(*this));
+    }
+    void fill(const AVCodecParameters* codec_para, const DecoderProfile* profile);   // 'profile' NULL means defaults
+    int  matches(const CodecContextKey& other) const
+    {
+        return !memcmp(this, &other, sizeof(*this));
+    }
+};
+
+// process-wide cache of idle codec contexts, opened and flushed. switching a stream (e.g. a tile from camera to camera)
+// to the same codec, geometry and extradata takes one from here instead of avcodec_open2 from scratch.
+// an entry is tied to the instance (SimpleAVDecoder) which put it: that instance gets it back first, 
+// and what it put is freed when it goes (purge()).
+class CodecContextCache
+{
+public:
+    static int max_entries;     // [0, CODEC_CACHE_MAX_ENTRIES], 0 disables it
+
+    // a matching context (get_buffer2 is the default one), or NULL. entries of 'owner' are preferred.
+    static AVCodecContext* take(const CodecContextKey& key, const void* owner);
+    // flush and keep '*avctx' (NULL-ed then), or free it if it's not to be cached. the oldest entry goes if full
+    static void put(AVCodecContext** avctx, const CodecContextKey& key, const void* owner);
+    static void purge(const void* owner);  // free entries put by 'owner'
+    static void get_stats(int64_t* hits, int64_t* misses);
+
+protected:
+    struct Entry
+    {
+        AVCodecContext* avctx;
+        CodecContextKey key;
+        const void*     owner;
+        int64_t         put_time;
+    };
+    SimpleMutex lock;
+    Entry   entries[CODEC_CACHE_MAX_ENTRIES];
+    int     nb_entries;
+    int64_t hits, misses;
+
+    CodecContextCache();
+    static CodecContextCache* get_instance();   // lives till process exits
+};
+
+struct StreamOpenStats  // how long opening a stream (or switching a channel) took, see SimpleAVDecoder::get_open_stats()
+{
+    int64_t open_time;          // (us) codec created (or taken from CodecContextCache) and decoder started
+    int64_t first_frame_time;   // (us) from open to first frame decoded, 0 if none yet
+    int     cache_hit;          // codec context came from CodecContextCache
+};
+
+struct SeekStats    // from discard_buffer() to the first frame after it on screen, see SimpleAVDecoder::get_seek_stats()
+{
+    int64_t nb_seeks;       // those which have shown a frame
+    int64_t last_time;      // (us)
+    int64_t total_time;     // (us)
+    int64_t max_time;       // (us)
+    int64_t nb_purged;      // stale video frames dropped at seek without being due
+};
+
 class Decoder 
     :public BaseThread  //decoder thread
+    ,public DecodeTask  //or a task on DecodePool, see DecodePool::default_enabled
 {
 public:
     Decoder(SimpleAVDecoder* av_decoder)
@@ -57,21 +164,65 @@ public:
         inited = 0; 
         avctx = NULL; 
         eos = 0;
+        channel = 0;
+        batch_pos = batch_count = 0;
+        fq_depth = fq_max_depth = 0;
+        wanted_skip_frame = AVDISCARD_DEFAULT;
+        skip_until_keyframe = 0;
+        pkt_wait_time = 0;
+        decode_until = NAN;
+        until_serial = -1;
+        until_reached = -1;
+        pkt_before_until = 0;
+        reopening = 0;
+        pooled = 0;
+        task_frame = NULL;
+        intra_group = NULL;
+        intra_workers = 0;
+        open_start = 0;
+        memset(&open_stats, 0, sizeof(open_stats));
     }
     virtual ~Decoder() {}
     friend SimpleAVDecoder;
 
-    static AVCodecContext* create_codec_directly( const AVCodecParameters * codec_para, const StreamParam* extra_para );
+    // if 'buffer_pool' is given, frames decoded get their buffers from it. 
+    // if 'profile' is given, codec is tuned by it, otherwise libavcodec defaults.
+    static AVCodecContext* create_codec_directly( const AVCodecParameters * codec_para, const StreamParam* extra_para
+        , FrameBufferPool* buffer_pool = NULL, const DecoderProfile* profile = NULL);
+    // create_codec_directly(), or reuse one from CodecContextCache. decoder_destroy() puts it back there.
+    // starts the clock of StreamOpenStats
+    AVCodecContext* open_codec(const AVCodecParameters* codec_para, const StreamParam* extra_para
+        , FrameBufferPool* buffer_pool, const DecoderProfile* profile);
     virtual int decoder_init( AVCodecContext* avctx, const StreamParam* extra_para);
     virtual void decoder_destroy();
 
     int v_or_a; // must be PsuedoStreamId 
+    int channel; // 0 -- primary, which drives clocks. see SimpleAVDecoder::open_channel()
     int eos;
     int is_inited() const
     {
         return inited;
     }
     static void onetime_global_init();
+
+    FrameBufferPool* get_frame_pool() 
+    {
+        return &frame_pool;
+    }
+
+    // codec 'skip_frame' (AVDiscard) wanted, decoder thread applies it before feeding next packet.
+    void set_skip_frame(int discard)
+    {
+        wanted_skip_frame = discard;
+    }
+
+    // frame queue depth used by next decoder_init(), 0 means default.
+    // 'max_depth' > 'depth' lets the depth adapt at runtime within [2, max_depth] (video only).
+    void set_frame_queue_depth(int depth, int max_depth = 0)
+    {
+        fq_depth = depth;
+        fq_max_depth = max_depth;
+    }
    
 protected:
     int inited;
@@ -81,7 +232,10 @@ protected:
     
     FrameQueue  frame_q;        //  VideoState:: pictq/sampq/subpq
     PacketQueue packet_q;       //  VideoState:: videoq/audioq/subtitleq
+    Packetizer  packetizer;     //  in front of 'packet_q', by feeder. see SimpleAVDecoder::feed_bytes()
     Clock       stream_clock;   //  VideoState:: vidclk/audclk/(null)
+    FrameBufferPool frame_pool; // backs get_buffer2 of 'avctx'
+    int fq_depth, fq_max_depth; // see set_frame_queue_depth()
 
     RenderBase* get_render();
     
@@ -89,6 +243,74 @@ protected:
     int is_packet_pending;
     int pkt_serial;        // 'serial' of current pkt  
     int finished;
+
+    // {{ pkts taken from 'packet_q' in one go, then fed to codec one by one
+    AVPacket batch_pkts[PACKET_BATCH_SIZE];
+    int      batch_serials[PACKET_BATCH_SIZE];
+    int      batch_pos, batch_count;
+
+    int  get_packet(AVPacket* pkt); // get next pkt (and its serial into 'pkt_serial'), refill the batch if it's empty. <0 means aborted
+    void discard_batch();
+    // }}
+
+    // {{ skip_frame switching, by decoder thread only
+    int wanted_skip_frame;
+    int skip_until_keyframe;    // we were decoding keyframes only, so the refs of coming non-key frames are missing
+    void apply_skip_frame(int wanted);
+    virtual int get_wanted_skip_frame()
+    {
+        return wanted_skip_frame;
+    }
+    virtual int should_drop_packet(const AVPacket* pkt)  // chance to drop pkt before feeding codec
+    {
+        return 0;
+    }
+    // }}
+
+    virtual int drain_at_null_pkt() // let codec give out what it holds at a null pkt, then go on with next pkts
+    {
+        return 0;
+    }
+
+    // {{ accurate seek, see SimpleAVDecoder::set_accurate_seek()
+    double decode_until;    // (seconds) frames of 'until_serial' ending before it are decoded but not queued. set by feeder
+    int    until_serial;
+    int    until_reached;   // serial whose target was reached, by decoder thread only
+    int    pkt_before_until;
+    int    is_before_until(double pts, double duration, int mark_reached);
+    virtual void on_seek_skipping(int skipping)  // pkts before seek target begin/end, decoder may lower quality for them
+    {
+    }
+    // }}
+
+    // {{ codec reopen at a keyframe, e.g. to change lowres. old codec is drained first, so no frame is lost
+    int reopening;
+    virtual int wants_reopen()  // asked at each keyframe pkt, by decoder thread
+    {
+        return 0;
+    }
+    virtual int reopen_codec()  // old codec is drained. <0 means failed, go on with the old one
+    {
+        return -1;
+    }
+    // }}
+
+    int64_t pkt_wait_time;  // sum of time (in us) blocked in waiting for packets 
+
+    // {{ intra-only stream on several codec contexts, 'avctx' then only tunes them. see IntraDecodeGroup
+    IntraDecodeGroup* intra_group;  // take owner ship, NULL -- 'avctx' decodes
+    int  intra_workers;             // from DecoderProfile by open_codec(), if stream is intra-only
+    int  codec_send(const AVPacket* pkt);   // avcodec_send_packet() or the group
+    int  codec_receive(AVFrame* frame);     // avcodec_receive_frame() or the group
+    void codec_flush();                     // avcodec_flush_buffers() or the group
+    // }}
+
+    // {{ see open_codec()
+    CodecContextKey codec_key;
+    int64_t         open_start;
+    StreamOpenStats open_stats;
+    void            on_first_frame();
+    // }}
     
     int64_t start_pts; 
     AVRational start_pts_timebase;
@@ -97,13 +319,24 @@ protected:
 
     virtual void on_got_new_frame(AVFrame* frame) = 0;
  
-    virtual int decoder_start();  // start decoder thread. 
+    virtual int decoder_start();  // start decoder thread (or task). 
     virtual void decoder_abort(); // signal decoder thread to quit, and wait.
 
+    // one step of the decoding loop: a frame (at most) decoded and queued.
+    // Return: <0 -- quit, AVERROR(EAGAIN) -- would block (pooled only), otherwise go on
+    virtual int decode_step(AVFrame* frame) = 0;
+    virtual ThreadRetType thread_main();    // BaseThread method, decode_step() in a loop
+
+    // {{ run on DecodePool: get_packet() doesn't block, and decode_step() returns when frame_q is full
+    int     pooled;
+    AVFrame* task_frame;
+    virtual int run_task();     // DecodeTask method
+    // }}
+
     int buffered_enough_packets();  
     /// return: 
     //      negative    -- failed.
-    //      0           -- EoF
+    //      0           -- no frame: EoF, or a new serial starts (flush pkt, e.g. seek)
     //      positive    -- got frame
     virtual int decoder_decode_frame(AVFrame* frame, AVSubtitle* sub);
 };
@@ -118,12 +351,62 @@ public:
         stream_param.guessed_vframe_rate = av_make_q(25, 1); 
         frame_timer = 0; 
         v_or_a = PSI_VIDEO;
+        fq_adaptive = 0;
+        last_adapt_time = 0;
+        last_adapt_drops = 0;
+        memory_low = 0;
+        last_memory_sample = 0;
+        degrade_enabled = 0;
+        degrade_level = DEGRADE_NONE;
+        auto_lowres = 0;
+        base_lowres = 0;
+        channel_offset = NAN;
+        channel_serial = -1;
+        reverse = 0;
+        reverse_start = NAN;
+        rev_serial = -1;
+        memset(rev_gops, 0, sizeof(rev_gops));
+        rev_playing = &rev_gops[0];
+        rev_filling = &rev_gops[1];
+        rev_filled = 0;
+        rev_limit = NAN;
+        step_history_frames = STEP_HISTORY_FRAMES;
+        step_history_bytes = STEP_HISTORY_BYTES;
+        refill_before = NAN;
+        refill_serial = -1;
+        refill_done = 0;
+        history_drawn = 0;
+        generation = 0;
     }
     friend SimpleAVDecoder;
 
     virtual int decoder_init(AVCodecContext* avctx, const StreamParam* extra_para);
     virtual void decoder_destroy();
 
+    // let decoder degrade (skip loop filter ... keyframe only) when it can't keep up, and recover later
+    void enable_degrade(int enable)
+    {
+        degrade_enabled = enable;
+    }
+    int get_degrade_level() const
+    {
+        return degrade_level;
+    }
+
+    // let lowres follow the size picture is shown at (render screen_width/screen_height), switched at next keyframe.
+    // for codecs supporting lowres only (mpeg1/2/4, h263, mjpeg ...)
+    void enable_auto_lowres(int enable)
+    {
+        auto_lowres = enable;
+    }
+
+    // bound of step history used by next decoder_init(), 0 frames disables it (and stepping back).
+    void set_step_history(int max_frames, int64_t max_bytes)
+    {
+        step_history_frames = max_frames;
+        step_history_bytes = max_bytes;
+    }
+
 protected:
     
     virtual void on_got_new_frame(AVFrame* frame);
@@ -134,12 +417,96 @@ protected:
                         // then even it was put on to screen at 00:05:38.05
                         // still we have  frame_timer == 00:05:38.04
     
-    virtual  ThreadRetType  thread_main();  // BaseThread method 
+    virtual int decode_step(AVFrame* frame);
     
     void video_display(); // display the current picture, if any  
     
     int get_video_frame( AVFrame* frame);  //  <0 means 'quit decorder thread'
+
+    // {{ adaptive frame queue depth, reviewed from refresh loop
+    int     fq_adaptive;
+    double  last_adapt_time;
+    int     last_adapt_drops;
+    void    adapt_frame_queue_depth(int frame_drops_late);  // grow on late drops, shrink on memory pressure
+    std::atomic<int> memory_low;    // by decoder thread, refresh loop reads it rather than asking the system
+    double  last_memory_sample;     // by decoder thread only
+    void    sample_memory_pressure();
+    // }}
+
+    // {{ degradation governor, by decoder thread only
+    int     degrade_enabled;
+    int     degrade_level;      // DegradeLevel
+    int     good_reviews;       // 'good' reviews in a row
+    double  last_review_time;
+    double  late_avg;           // rolling average of how late (in seconds) decoded frames are
+    int64_t busy_time;          // time (in us) spent in decoding since last review
+    int     base_skip_loop_filter, base_skip_idct;  // from DecoderProfile
+    int     base_lowres;
+    int     nal_length_size;
+
+    void    review_degrade_level();
+    void    apply_degrade_level();
+    virtual int get_wanted_skip_frame();
+    virtual int should_drop_packet(const AVPacket* pkt);
+    virtual void on_seek_skipping(int skipping);
+    // }}
+
+    // {{ extra channel, shown when 'pts + channel_offset' is due on master clock
+    double channel_offset;
+    int    channel_serial;  // 'channel_offset' is anchored on this serial
+    // }}
+
+    // {{ lowres following window size, see enable_auto_lowres()
+    int auto_lowres;
+    int get_wanted_lowres();
+    virtual int wants_reopen();
+    virtual int reopen_codec();
+    // }}
+
+    // {{ reverse playback. reader feeds GOPs backwards, each one ended by a null pkt.
+    // a GOP is decoded forward into cache, then pushed into frame_q last frame first, on a mirrored timeline (pts -> -pts), 
+    // so that clock/sync works as usual. the next GOP back is decoded while frames of current one wait for room in frame_q.
+    struct ReverseGop
+    {
+        AVFrame* frames[REVERSE_GOP_MAX_FRAMES];    // allocated on first use, kept for reuse
+        int      nb;            // frames cached, in pts order
+        int      nb_decoded;    // frames decoded from this GOP
+        int      stride;        // keep 1 of each 'stride' decoded frames
+    };
+    int     reverse;            // set by SimpleAVDecoder, decoder thread follows it at next serial
+    double  reverse_start;      // (seconds) frames from here on have been shown, set by SimpleAVDecoder before serial++
+    ReverseGop  rev_gops[2];
+    ReverseGop* rev_playing;    // being pushed into frame_q
+    ReverseGop* rev_filling;    // being decoded
+    int     rev_filled;         // 'rev_filling' is complete, waiting for 'rev_playing' to run out
+    int     rev_serial;
+    double  rev_limit;          // only frames before it are wanted in 'rev_filling'
+
+    int     reverse_step(AVFrame* frame);   // one iteration of decoder thread in reverse mode, <0 means quit
+    int     reverse_push(int block);        // push frames of 'rev_playing', wait for room at most once if 'block'
+    void    reverse_gop_add(AVFrame* frame);
+    void    reverse_gop_clear(ReverseGop* gop, int free_frames);
+    void    reverse_reset(int free_frames);
+    virtual int drain_at_null_pkt()
+    {
+        return reverse;
+    }
+    // }}
+
+    // {{ step history, see VideoState::step_frame()
+    FrameHistory step_history;  // frames shown
+    FrameHistory step_refill;   // by decoder thread: frames before 'refill_before', decoded again for a step back
+    int     step_history_frames;
+    int64_t step_history_bytes;
+    double  refill_before;      // (seconds) NaN if not refilling. set by SimpleAVDecoder before serial++
+    int     refill_serial;
+    int     refill_done;        // set by decoder thread, refresh loop shows the frame stepped back to
+    int     history_drawn;      // what's on screen came from step history
+    int     refill_step_history(AVFrame* frame, double pts, double duration);  // return 1 if 'frame' is taken
+    // }}
     int queue_picture(AVFrame* src_frame, double pts, double duration, int64_t pos, int serial);
+
+    int generation;     // ++ by each decoder_init(), tells a stream from the one before it
 };
 
 class AudioDecoder
@@ -163,6 +530,7 @@ public:
     void handle_audio_cb(uint8_t* stream, int len);
 
 protected:
+    static int trim_front(AVFrame* frame, int nb_samples);
     int muted;
     int audio_volume;  //  volume [0 , 100]
 
@@ -204,7 +572,40 @@ protected:
 
     virtual void on_got_new_frame(AVFrame* frame);
     
-    virtual  ThreadRetType thread_main();  // BaseThread method 
+    virtual int decode_step(AVFrame* frame);
+};
+
+// subtitles (bitmap, or text if render rasterizes it) are turned into one RGBA bitmap each by decoder thread, 
+// render uploads each of them once, so that showing frames only composites it.
+class SubtitleDecoder
+    :public Decoder
+{
+public:
+    typedef Decoder MyBase;
+    SubtitleDecoder(SimpleAVDecoder* av_decoder) :MyBase(av_decoder)
+    {
+        v_or_a = PSI_SUBTITLE;
+        shown_pts = shown_duration = NAN;
+        shown_serial = -1;
+        text_warned = 0;
+    }
+    friend SimpleAVDecoder;
+    virtual int decoder_init(AVCodecContext* avctx, const StreamParam* extra_para);
+
+protected:
+    virtual void on_got_new_frame(AVFrame* frame)
+    {
+    }
+    virtual int decode_step(AVFrame* frame);   // 'frame' is unused, subtitles go to slots of frame_q directly
+
+    int text_warned;
+    int rasterize(const AVSubtitle* sub, Frame* sp);    // rects of 'sub' into RGBA 'sp->frame'
+
+    // {{ by refresh loop
+    double shown_pts, shown_duration;   // display interval of what's shown
+    int    shown_serial;                // -1 if nothing shown
+    int    refresh_subtitle(double pts);   // drop expired, show the one due at 'pts' (of video on screen). 1 if that changed
+    // }}
 };
 
 class RenderBase
@@ -213,6 +614,8 @@ public:
     RenderBase()
     { 
         inited = 0;
+        tile_index = 0;
+        tile_count = 1;
     }
 
     virtual ~RenderBase()
@@ -240,6 +643,30 @@ public:
     virtual void draw_render()  = 0;    
     virtual void upload_and_draw_frame(Frame* video_frame) = 0;
 
+    // {{ subtitle, see SubtitleDecoder. 'sub->frame' is RGBA (AV_PIX_FMT_RGB32), placed at 'sub_x'/'sub_y' on its canvas
+    virtual void prepare_subtitle(Frame* sub)   // upload ahead of time, cached by display interval. sets 'uploaded'
+    {
+        sub->uploaded = 1;
+    }
+    virtual void show_subtitle(const Frame* sub)  // composited over the video from now on, NULL to hide
+    {
+    }
+    // text needs a font engine: draw 'text' ('\n' breaks lines) into 'rgba' (callee allocates), and tell where it goes
+    // on the canvas. called by subtitle decoder thread. Return:  0 -- success, non-zero -- not supported.
+    virtual int rasterize_text(const char* text, int canvas_width, int canvas_height, AVFrame* rgba, int* x, int* y)
+    {
+        return 1;
+    }
+    // }}
+
+    // following upload_and_draw_frame() draws into tile 'index' of a grid of 'count' tiles (multi-channel).
+    // 'count' 1 means the whole screen.
+    void select_tile(int index, int count)
+    {
+        tile_index = index;
+        tile_count = FFMAX(count, 1);
+    }
+
     virtual int open_audio( AudioDecoder* decoder, int64_t wanted_channel_layout, int wanted_nb_channels, int wanted_sample_rate, struct AudioParams* audio_hw_params) = 0;
     static void sdl_audio_callback(void* opaque, uint8_t* stream, int len);// prepare a new audio buffer 
 
@@ -257,6 +684,7 @@ public:
     int64_t cursor_last_shown;
     int cursor_hidden;
 protected:
+    int tile_index, tile_count;  // see select_tile()
     int fullscreen;
     int window_shown;
  
@@ -267,7 +695,7 @@ class SimpleAVDecoder
 {
 public:
     SimpleAVDecoder()
-        :auddec(this), viddec(this)
+        :auddec(this), viddec(this), subdec(this)
     {
         this->extclk.init_clock(&this->extclk.serial);
         frame_drops_early = frame_drops_late = 0;
@@ -278,25 +706,77 @@ public:
         decoder_reorder_pts = -1;  
         render = NULL;
 		max_frame_duration = 10;
+        live_max_seconds = 0;
+        live_max_bytes = 0;
+        step_req = 0;
+        stepping = 0;
+        step_rewound = 0;
+        step_refill_req = NAN;
+        accurate_seek = 0;
+        memset(channels, 0, sizeof(channels));
+        memset(&held_pic, 0, sizeof(held_pic));
+        held_generation = 0;
+        held_since = 0;
+        seek_start = 0;
+        seek_serial = -1;
+        memset(&seek_stats, 0, sizeof(seek_stats));
+        es_sniffer = NULL;
+        es_nb_held = 0;
+        es_sniffed_bytes = 0;
+        es_scanned = 0;
+        av_init_packet(&es_bytes);
+        es_bytes.data = NULL;
+        es_bytes.size = 0;
+        auddec.packet_q.space_signal = &feeder_wakeup;
+        viddec.packet_q.space_signal = &feeder_wakeup;
+        subdec.packet_q.space_signal = &feeder_wakeup;
     } 
     virtual ~SimpleAVDecoder();
 
-    friend AudioDecoder; friend  VideoDecoder;
+    friend AudioDecoder; friend  VideoDecoder; friend SubtitleDecoder;
 
     RenderBase*  render;
     
     // mask:  bit0  -- V opened ， bit1 -- A opened 
-    int   open_stream_from_avformat(AVFormatContext* format_context,  int* vstream_id, int* astream_id);
+    // subtitle stream is opened too if 'sstream_id' is given and there is video to show it on.
+    int   open_stream_from_avformat(AVFormatContext* format_context,  int* vstream_id, int* astream_id, int* sstream_id = NULL);
 
     // Return:  0 -- success, non-zero -- error.
-    int   open_stream(const AVCodecParameters * codec_para, const StreamParam* extra_para); 
+    // 'profile' NULL means 'video_profile'/'audio_profile'
+    int   open_stream(const AVCodecParameters * codec_para, const StreamParam* extra_para, const DecoderProfile* profile = NULL); 
+
+    DecoderProfile video_profile;   // used by open_stream() if not spec, e.g. open_stream_from_avformat()
+    DecoderProfile audio_profile;
 
     int   get_opened_streams_mask();  // mask:  bit0  -- V opened ， bit1 -- A opened 
     void  close_all_stream();
+
+    // extra video channels (e.g. NVR channels, camera angles) in one instance: pkts with 'channel' in AVPacketExtra
+    // go to the decoder opened here. they share master clock and render (one tile each), no stepping/reverse on them.
+    // channel 0 is the primary V/A opened by open_stream(). Return:  0 -- success, non-zero -- error.
+    int   open_channel(int channel, const AVCodecParameters* codec_para, const StreamParam* extra_para, const DecoderProfile* profile = NULL);
+    void  close_channel(int channel);
+    int   get_channel_count();      // extra channels opened
+
+    // raw video ES of unknown codec (annex B H.264/H.265, or MJPEG), e.g. from IP camera SDK. feed_es() holds pkts
+    // till EsCodecSniffer tells the codec, then video stream is opened by open_stream() with the parameter sets 
+    // found in-band as extradata, and the pkts held go to it. Return:  0 -- success, non-zero -- error.
+    // 'profile' NULL means 'video_profile'
+    int   open_es(const StreamParam* extra_para, const DecoderProfile* profile = NULL);
+    // 'pkt' is one access unit, ownership taken. Return:  0 -- held or fed, 
+    // non-zero -- dropped, e.g. nothing known in the first ES_SNIFF_MAX_BYTES, or video stream failed to open.
+    int   feed_es(AVPacket* pkt);
+
     
     // called to display each frame (from event loop )
     void video_refresh(double* remaining_time);
 
+    // no blank at a video switch: the picture on screen stays there through close_all_stream() and the opening of 
+    // the next video stream, until that one has its first frame to show. then they swap at once.
+    // 'hold' 0 drops what's held, e.g. if no stream follows. it's dropped anyway after HOLD_PICTURE_TIMEOUT 
+    // without a video stream opened.
+    void hold_picture(int hold);
+
     int  get_master_sync_type() const;
     void set_master_sync_type(int how);
     int realtime;   // is 'realtime' stream or not
@@ -311,6 +791,22 @@ public:
     
     int is_stalled();
 
+    // packet node pool counters of the V/A packet queue. Return:  0 -- success, non-zero -- stream not opened.
+    int get_packet_pool_stats(int v_or_a, int64_t* hits, int64_t* misses);
+
+    // units from feed_bytes() into the V/A packet queue, and how many of them had to be copied.
+    // Return:  0 -- success, non-zero -- stream not opened.
+    int get_packetizer_stats(int v_or_a, int64_t* units, int64_t* copied_units);
+
+    // frame buffer pool statistics of the V/A decoder. Return:  0 -- success, non-zero -- stream not opened.
+    int get_frame_pool_stats(int v_or_a, FrameBufferPoolStats* stats);
+
+    // open / switch time of the V/A/S stream, or of video 'channel'. Return:  0 -- success, non-zero -- stream not opened.
+    int get_open_stats(int v_or_a, StreamOpenStats* stats, int channel = 0);
+
+    // seek latency, from discard_buffer() to the first video frame after it shown.
+    void get_seek_stats(SeekStats* stats);
+
     // decoder status section {{
     int   is_drawing_needed() const{ return force_refresh;}  
     void  toggle_need_drawing(int need_drawing);
@@ -327,13 +823,81 @@ public:
     void update_volume(int delta );
     // }} decoder status section
 
-    void discard_buffer(double seek_target = NAN); // clear cach for 'seek'. If seek by time, also spec the 'seek_target'  ( in unit of 'second')
+    // speed of playback, 1.0 is normal. clock follows it, and video decoder skips frames at fast speeds.
+    void set_playback_speed(double speed);
+    double get_playback_speed();
+
+    // reverse playback (by reader thread, see VideoState::stream_reverse): backwards at 'speed' from 'pos' (seconds) on.
+    // while in reverse, master clock runs forward on the mirrored timeline, i.e. it's -pos.
+    // 'pos' NaN means from the frame on screen. return the position it starts from.
+    double start_reverse(double speed, double pos = NAN);
+    void stop_reverse();
+    int  is_reverse() const { return viddec.reverse; }
+    double get_stream_position();  // master clock in stream time, i.e. un-mirrored in reverse playback
+    int  is_reverse_gop_wanted();   // decoder has taken all pkts of the last GOP
+    void feed_reverse_gop_end();    // null pkt, decoder drains codec at it
+
+    // frame stepping (see VideoState::step_frame), served by refresh loop from step history and frames decoded ahead
+    void request_step(int dir);
+    int  can_step_back(double* oldest_pts);     // 0 if at step history edge, 'oldest_pts' is where to refill from 
+    void request_step_refill(double before);    // next discard_buffer() keeps step history, decoder refills it 
+    int  leave_step_history(double* pos);       // stepping ends, return 1 if playback should go on from 'pos'
+    int  is_stepping() const { return stepping; }
+
+    void discard_buffer(double seek_target = NAN, int accurate = 0); // clear cach for 'seek'. If seek by time, also spec the 'seek_target'  ( in unit of 'second')
     int  is_buffer_full();
+
+    // live source: cap each packet queue to 'max_seconds'/'max_bytes' (0 means no limit) by dropping whole GOPs.
+    // applies to opened streams at once, and to streams opened later.
+    void set_live_overflow_policy(double max_seconds, int max_bytes);
+
+    // accurate seek: playback resumes at the exact frame / sample of the target, not the keyframe before it.
+    // frames before the target are decoded at lowered quality and discarded.
+    void set_accurate_seek(int on)
+    {
+        accurate_seek = on;
+    }
+    int is_accurate_seek() const
+    {
+        return accurate_seek;
+    }
+
     void feed_null_pkt(); // 
     void feed_pkt(AVPacket* pkt, const AVPacketExtra* extra  ); // take ownership of 'pkt'
+    void feed_pkt_many(AVPacket* pkts, int nb, const AVPacketExtra* extra); // take ownership of 'pkts', all of which belong to the same stream
+
+    // byte chunk of the stream (pipe, serial capture, transport chunk ...), not necessarily one access unit, 
+    // ownership taken. it goes through Packetizer of the stream, which reassembles units for 'packet_q'. 
+    // 'whole_units' tells 'chunk' holds whole units only, which then go on without copy.
+    // for the ES opened by open_es(), bytes are held till the codec is told. feed_null_pkt() flushes the tail.
+    // Return:  0 -- success, non-zero -- dropped, e.g. stream not opened.
+    int  feed_bytes(AVPacket* chunk, const AVPacketExtra* extra, int whole_units = 0);
+
+    // {{ building pkts to feed without allocator traffic, e.g. in ES callbacks of camera SDK
+    // copy of 'data' in a recycled buffer, see PacketBufferPool::make_packet(). Return:  0 -- success, <0 -- error
+    int  make_pooled_pkt(AVPacket* pkt, const uint8_t* data, int size)
+    {
+        return ingest_pool.make_packet(pkt, data, size);
+    }
+    // no copy, 'pkt' refs 'data' of the caller till 'release', see PacketBufferPool::wrap_packet()
+    static int wrap_pkt(AVPacket* pkt, uint8_t* data, int size, void (*release)(void* opaque, uint8_t* data), void* opaque)
+    {
+        return PacketBufferPool::wrap_packet(pkt, data, size, release, opaque);
+    }
+    void get_ingest_pool_stats(PacketBufferPoolStats* stats)
+    {
+        ingest_pool.get_stats(stats);
+    }
+    // }}
+
+    // notified whenever packets leave V/A packet queue, the feeder (reader thread) sleeps on it when buffer is full.
+    // anyone who has news for the feeder (seek/pause/abort...) can notify it too.
+    // must be declared before 'auddec' and 'viddec', which ref it.
+    WakeupSignal    feeder_wakeup;
 	
 	AudioDecoder    auddec;
 	VideoDecoder    viddec;
+    SubtitleDecoder subdec;
 
 protected:
 
@@ -346,7 +910,59 @@ protected:
     int paused;
     int step; // frame by frame mode 
     // }} decoder status section
+    // {{ frame stepping, see request_step()
+    int    step_req;        // +1 / -1, 0 means none
+    int    stepping;        // what's on screen is picked by stepping, from step history 
+    int    step_rewound;    // decoding restarted from an earlier GOP for step back
+    double step_refill_req;
+    void   serve_step_request();
+    int    step_from_queue();
+    void   show_history_frame(double pts);
+    // }}
     double max_frame_duration;      // maximum duration of a frame - above this, we consider the jump a timestamp discontinuity
+    // {{ live overflow policy, see set_live_overflow_policy()
+    double live_max_seconds;
+    int    live_max_bytes;
+    void   apply_live_overflow_policy(Decoder* decoder);
+    // }}
+    int accurate_seek;
+    // {{ extra channels, see open_channel()
+    SimpleMutex   channels_lock;        // by feeder, refresh loop and who opens/closes channels
+    VideoDecoder* channels[MAX_CHANNELS];   // [0] is unused, it's 'viddec'
+    PacketQueue*  route_pkt(const AVPacketExtra* extra);   // caller holds 'channels_lock'
+    Decoder*      route_decoder(const AVPacketExtra* extra);
+    int           refresh_channels();   // return 1 if any of them has a new frame to show
+    void          display_channels();
+    // }}
+    // {{ held picture, see hold_picture()
+    SimpleMutex hold_lock;          // by refresh loop and hold_picture()
+    Frame       held_pic;           // 'frame' NULL if nothing held
+    int         held_generation;    // 'viddec.generation' it was taken from
+    int64_t     held_since;
+    int         draw_held_picture();    // return 1 if it's drawn instead of video
+    // }}
+    // {{ seek latency, under 'hold_lock'. see get_seek_stats()
+    int64_t   seek_start;       // 0 -- no seek waiting for its first frame
+    int       seek_serial;      // video serial it waits for
+    SeekStats seek_stats;
+    void      purge_stale_frames();
+    void      on_seek_shown(const Frame* vp);
+    // }}
+    PacketBufferPool ingest_pool;   // see make_pooled_pkt()
+    // {{ raw ES of unknown codec, see open_es()
+    SimpleMutex     es_lock;        // by feeder and who opens/closes streams
+    EsCodecSniffer* es_sniffer;     // NULL if not sniffing
+    StreamParam     es_param;
+    DecoderProfile  es_profile;
+    AVPacket        es_held[ES_SNIFF_MAX_HELD];
+    int             es_nb_held;
+    int64_t         es_sniffed_bytes;
+    AVPacket        es_bytes;       // by feed_bytes(), held till the codec is told
+    int             es_scanned;     // of 'es_bytes', sniffed already
+    int             sniff_es_bytes(AVPacket* chunk);
+    int             open_sniffed_es(enum AVCodecID codec_id);
+    void            close_es();
+    // }}
     // {{ statistics
     int frame_drops_early;
     int frame_drops_late;
@@ -390,20 +1006,32 @@ public:
 	}
 
     // {{{ stream operation section
-    void stream_seek( int64_t pos, int64_t rel, int seek_by_bytes);
+    // 'backward' lands at the keyframe before 'pos', never after it
+    void stream_seek( int64_t pos, int64_t rel, int seek_by_bytes, int backward = 0);
 
     void toggle_pause();
     
     void step_to_next_frame();
 
+    // pause and show next/previous frame. instant within step history (and frames decoded ahead), 
+    // at the oldest end of it, the GOP before is decoded again.
+    void step_frame(int backward);
+
     void seek_chapter( int incr);
 
+    // play backwards at 'speed' (up to REVERSE_SPEED_MAX) from current position, 0 means forward again.
+    void stream_reverse(double speed);
+    double get_reverse_speed() const { return reverse_req; }
+
     // }}} stream operation section
 
     // {{  some ffplay cmd line opt  
     int64_t streamopt_start_time;  // 命令行 -ss ，由 av_parse_time 解析为 microseconds
     int64_t streamopt_duration;    // 命令行 -t  ，由 av_parse_time 解析为 microseconds
     int     streamopt_autoexit;
+    int     streamopt_all_video;   // other video streams (e.g. camera angles) are shown as channels too
+    int     streamopt_subtitle_disable;
+    int     streamopt_es_feed;     // video pkts are fed as raw ES of unknown codec, see SimpleAVDecoder::open_es()
     // }}
     
     SimpleAVDecoder av_decoder;
@@ -429,17 +1057,30 @@ protected:
     int last_paused; // 之前一次reader loop的时候，是否是paused
 
     int open_stream_file();
-    int last_video_stream, last_audio_stream ;
+    int last_video_stream, last_audio_stream, last_subtitle_stream ;
+    int channel_streams[MAX_CHANNELS];  // stream index of each extra channel, -1 if none
+    void open_video_channels();
+    int  open_es_feed();
     void fill_packet_extra( AVPacketExtra* extra, const AVPacket* pkt) const;
 
     int seek_req;
     int seek_flags;
+    int seek_backward;
     int64_t seek_pos;
     int64_t seek_rel;
 
+    // {{ reverse playback
+    double  reverse_req;    // by stream_reverse()
+    double  reverse_speed;  // by reader thread, follows 'reverse_req'
+    int64_t rev_next_end;   // (video stream time base) next GOP to load is the one right before it
+    int     rev_at_start;   // no GOP before 'rev_next_end'
+    int     read_reverse_gop();
+    // }}
+
     // 'reader thread' section {{{
     int  read_loop_check_pause(); // return: > 0 -- shoud 'continue', 0 -- go on current iteration, < 0 -- error exit loop
     int  read_loop_check_seek();  // return: > 0 -- shoud 'continue', 0 -- go on current iteration, < 0 -- error exit loop
+    int  read_loop_check_reverse(); // return: > 0 -- shoud 'continue', 0 -- go on current iteration, < 0 -- error exit loop
 
     int is_pkt_in_play_range( AVPacket* pkt);
     double stream_ts_to_second(int64_t ts, int stream_index);
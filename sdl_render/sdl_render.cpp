@@ -36,7 +36,13 @@ RenderSDL::RenderSDL()
 {
     window = NULL;
     renderer = NULL;
-    vid_texture = sub_texture = NULL;
+    vid_texture = NULL;
+    memset(sub_cache, 0, sizeof(sub_cache));
+    for (int i = 0; i < SUB_TEXTURE_CACHE_SIZE; i++)
+        sub_cache[i].serial = -1;
+    sub_shown = -1;
+    sub_use_count = 0;
+    memset(tile_textures, 0, sizeof(tile_textures));
     audio_dev = 0;
     renderer_info = { 0 };
 
@@ -219,10 +225,24 @@ void RenderSDL::safe_release()
         this->vid_texture = NULL;
     }
 
-    if (this->sub_texture)
+    for (int i = 0; i < SUB_TEXTURE_CACHE_SIZE; i++)
     {
-        SDL_DestroyTexture(this->sub_texture);
-        this->sub_texture = NULL;
+        if (this->sub_cache[i].texture)
+        {
+            SDL_DestroyTexture(this->sub_cache[i].texture);
+            this->sub_cache[i].texture = NULL;
+        }
+        this->sub_cache[i].serial = -1;
+    }
+    this->sub_shown = -1;
+
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        if (this->tile_textures[i])
+        {
+            SDL_DestroyTexture(this->tile_textures[i]);
+            this->tile_textures[i] = NULL;
+        }
     }
 
     if (renderer)
@@ -402,32 +422,121 @@ void RenderSDL::set_sdl_yuv_conversion_mode(AVFrame* frame)
 #endif
 }
 
-void RenderSDL::show_texture(const Frame* video_frame, const SDL_Rect& rect, int show_subtitle)
+void RenderSDL::show_texture(const Frame* video_frame, SDL_Texture* texture, const SDL_Rect& rect, int show_subtitle)
 {
     set_sdl_yuv_conversion_mode(video_frame->frame);
-    SDL_RenderCopyEx(this->renderer, this->vid_texture, NULL, &rect, 0, NULL, (SDL_RendererFlip)(video_frame->flip_v ? SDL_FLIP_VERTICAL : 0));
+    SDL_RenderCopyEx(this->renderer, texture, NULL, &rect, 0, NULL, (SDL_RendererFlip)(video_frame->flip_v ? SDL_FLIP_VERTICAL : 0));
     set_sdl_yuv_conversion_mode(NULL);
 
-    if (show_subtitle) {
-        SDL_RenderCopy(this->renderer, this->sub_texture, NULL, &rect);
+    if (show_subtitle && this->sub_shown >= 0) {
+        // 字幕画布缩放到视频显示区域
+        const SubTexture* st = &this->sub_cache[this->sub_shown];
+        int cw = st->canvas_width ? st->canvas_width : video_frame->width;
+        int ch = st->canvas_height ? st->canvas_height : video_frame->height;
+        if (cw > 0 && ch > 0) {
+            SDL_Rect sub_rect;
+            sub_rect.x = rect.x + (int)av_rescale(st->x, rect.w, cw);
+            sub_rect.y = rect.y + (int)av_rescale(st->y, rect.h, ch);
+            sub_rect.w = (int)av_rescale(st->w, rect.w, cw);
+            sub_rect.h = (int)av_rescale(st->h, rect.h, ch);
+            SDL_RenderCopy(this->renderer, st->texture, NULL, &sub_rect);
+        }
+    }
+}
+
+RenderSDL::SubTexture* RenderSDL::find_subtitle(const Frame* sp)
+{
+    for (int i = 0; i < SUB_TEXTURE_CACHE_SIZE; i++) {
+        SubTexture* st = &this->sub_cache[i];
+        if (st->serial == sp->serial && st->texture
+            && (st->pts == sp->pts || (isnan(st->pts) && isnan(sp->pts))) && st->duration == sp->duration)
+            return st;
+    }
+    return NULL;
+}
+
+void RenderSDL::prepare_subtitle(Frame* sp)
+{
+    sp->uploaded = 1;
+    if (!sp->frame->data[0] || find_subtitle(sp))
+        return;     // empty one, or already there
+
+    // 替换最久没用的, 但不能是正在显示的
+    int slot = -1;
+    for (int i = 0; i < SUB_TEXTURE_CACHE_SIZE; i++) {
+        if (i == this->sub_shown)
+            continue;
+        if (slot < 0 || this->sub_cache[i].last_used < this->sub_cache[slot].last_used)
+            slot = i;
+    }
+
+    SubTexture* st = &this->sub_cache[slot];
+    st->serial = -1;
+    if (realloc_texture(&st->texture, SDL_PIXELFORMAT_ARGB8888, sp->frame->width, sp->frame->height, SDL_BLENDMODE_BLEND, 0) < 0
+        || SDL_UpdateTexture(st->texture, NULL, sp->frame->data[0], sp->frame->linesize[0]) < 0) {
+        av_log(NULL, AV_LOG_WARNING, "Failed to upload subtitle: %s\n", SDL_GetError());
+        return;
+    }
+
+    st->serial = sp->serial;
+    st->pts = sp->pts;
+    st->duration = sp->duration;
+    st->x = sp->sub_x;
+    st->y = sp->sub_y;
+    st->w = sp->frame->width;
+    st->h = sp->frame->height;
+    st->canvas_width = sp->width;
+    st->canvas_height = sp->height;
+    st->last_used = ++this->sub_use_count;
+}
+
+void RenderSDL::show_subtitle(const Frame* sp)
+{
+    this->sub_shown = -1;
+    if (!sp || !sp->frame->data[0])
+        return;
+
+    SubTexture* st = find_subtitle(sp);
+    if (!st) {
+        // 被挤出缓存了, 帧还在队列里, 再传一次
+        prepare_subtitle((Frame*)sp);
+        st = find_subtitle(sp);
+    }
+    if (st) {
+        st->last_used = ++this->sub_use_count;
+        this->sub_shown = (int)(st - this->sub_cache);
     }
 }
 
 void RenderSDL::upload_and_draw_frame(Frame* vp)
 {
     SDL_Rect rect; 
+    SDL_Texture** texture = &vid_texture;
     
-    calculate_display_rect(&rect, 0, 0 , screen_width, screen_height 
-            , vp->width, vp->height, vp->sample_aspect_ratio); 
+    if (tile_count > 1 && tile_index < MAX_CHANNELS) {
+        // grid of tiles, as square as possible
+        int cols = (int)ceil(sqrt((double)tile_count));
+        int rows = (tile_count + cols - 1) / cols;
+        int col = tile_index % cols, row = tile_index / cols;
+        calculate_display_rect(&rect, col * screen_width / cols, row * screen_height / rows
+            , screen_width / cols, screen_height / rows
+            , vp->width, vp->height, vp->sample_aspect_ratio);
+        if (tile_index > 0)
+            texture = &tile_textures[tile_index];
+    }
+    else {
+        calculate_display_rect(&rect, 0, 0 , screen_width, screen_height 
+                , vp->width, vp->height, vp->sample_aspect_ratio); 
+    }
     
     if (!vp->uploaded) {
-        if (upload_texture(&vid_texture, vp->frame, &img_convert_ctx) < 0)
+        if (upload_texture(texture, vp->frame, &img_convert_ctx) < 0)
             return;
         vp->uploaded = 1;
         vp->flip_v = vp->frame->linesize[0] < 0;
     }
 
-    show_texture(vp, rect,  0);
+    show_texture(vp, *texture, rect,  tile_index == 0);  // 字幕只叠加在主视频上
 }
 
 void RenderSDL::mix_audio( uint8_t * dst, const uint8_t * src, uint8_t len, int volume /* [0 - 100]*/ )
@@ -1,8 +1,10 @@
-#pragma  once
+﻿#pragma  once
 #include <SDL.h>
 
 #include "ffdecoder/ffdecoder.h"
 
+#define SUB_TEXTURE_CACHE_SIZE 4    // 上传过的字幕纹理, 当前显示的和接下来的几条
+
 class RenderSDL: public RenderBase
 {
 public:
@@ -33,6 +35,9 @@ public:
     virtual void draw_render();
     virtual void upload_and_draw_frame(Frame* video_frame);
 
+    virtual void prepare_subtitle(Frame* sub);
+    virtual void show_subtitle(const Frame* sub);
+
     virtual int create_window(const char* title, int x, int y, int w, int h, Uint32 flags);
     virtual void show_window( int fullscreen);
     virtual void set_default_window_size(int width, int height, AVRational sar);
@@ -43,14 +48,31 @@ protected:
     SDL_Renderer* renderer;
     SDL_RendererInfo renderer_info;
 
-    SDL_Texture* sub_texture;   // 字幕画布
     SDL_Texture* vid_texture;   // 视频画布
+    SDL_Texture* tile_textures[MAX_CHANNELS];   // 多通道时其它tile的画布, [0] 不用, 即 vid_texture
     
     struct SwsContext* img_convert_ctx; 
 
+    // {{ 字幕纹理缓存, 以显示区间(serial + pts + duration)为key. 每条字幕只上传一次, 之后每帧只做合成
+    struct SubTexture
+    {
+        SDL_Texture* texture;
+        int     serial;         // -1 表示空闲
+        double  pts;
+        double  duration;
+        int     x, y, w, h;     // 在字幕画布上的位置
+        int     canvas_width, canvas_height;    // 0 表示与视频相同
+        int64_t last_used;
+    };
+    SubTexture sub_cache[SUB_TEXTURE_CACHE_SIZE];
+    int     sub_shown;          // sub_cache 下标, -1 表示没有字幕
+    int64_t sub_use_count;
+    SubTexture* find_subtitle(const Frame* sub);
+    // }}
+
     
     int upload_texture(SDL_Texture** tex, AVFrame* frame, struct SwsContext** img_convert_ctx);
-    void show_texture(const Frame* video_frame, const SDL_Rect& rect, int show_subtitle);
+    void show_texture(const Frame* video_frame, SDL_Texture* texture, const SDL_Rect& rect, int show_subtitle);
     int realloc_texture(SDL_Texture** texture, Uint32 new_format, int new_width, int new_height, SDL_BlendMode blendmode, int init_texture);
     
 };
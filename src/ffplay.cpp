@@ -93,40 +93,28 @@ void event_loop(VideoState *cur_stream)
                 break;
             case SDLK_PLUS:
             case SDLK_KP_PLUS:
+                if (cur_stream->get_reverse_speed() > 0) {
+                    cur_stream->stream_reverse(2 * cur_stream->get_reverse_speed());
+                    break;
+                }
                 {
-                    double cur_speed = cur_stream->av_decoder.get_decoder_clock()->get_clock_speed();
+                    double cur_speed = cur_stream->av_decoder.get_playback_speed();
                     double speed = 2 * cur_speed;
                     debug_printf(" speed: %.3f -> %.3f\n", cur_speed,  speed );
-                    cur_stream->av_decoder.get_decoder_clock()->set_clock_speed( speed );
-
-                    if ( ! float_equal(speed, 1.0) )
-                    {
-	                    cur_stream->av_decoder.set_master_sync_type(AV_SYNC_EXTERNAL_CLOCK ); 
-                    }
-                    else
-                    { 
-	                    cur_stream->av_decoder.set_master_sync_type(AV_SYNC_AUDIO_MASTER); 
-                    }
-
-                    cur_stream->av_decoder.get_decoder_clock()->set_clock_speed( speed );
+                    cur_stream->av_decoder.set_playback_speed( speed );
                 }
                 break; 
             case SDLK_MINUS:
             case SDLK_KP_MINUS:
+                if (cur_stream->get_reverse_speed() > 0) {
+                    cur_stream->stream_reverse(FFMAX(1, cur_stream->get_reverse_speed() / 2));
+                    break;
+                }
                 {
-                    double cur_speed = cur_stream->av_decoder.get_decoder_clock()->get_clock_speed();
+                    double cur_speed = cur_stream->av_decoder.get_playback_speed();
                     double speed =  cur_speed / 2;
                     debug_printf(" speed: %.3f -> %.3f\n", cur_speed,  speed );
-
-                    if ( ! float_equal(speed, 1.0) )
-                    {
-	                    cur_stream->av_decoder.set_master_sync_type(AV_SYNC_EXTERNAL_CLOCK); 
-                    }
-                    else
-                    { 
-	                    cur_stream->av_decoder.set_master_sync_type(AV_SYNC_AUDIO_MASTER); 
-                    }
-                    cur_stream->av_decoder.get_decoder_clock()->set_clock_speed( speed );
+                    cur_stream->av_decoder.set_playback_speed( speed );
                 }
                 break;
 
@@ -139,7 +127,17 @@ void event_loop(VideoState *cur_stream)
                 cur_stream->av_decoder.update_volume( -10);
                 break;
             case SDLK_s: // S: Step to next frame
-                cur_stream->step_to_next_frame();
+                cur_stream->step_frame(0);
+                break;
+            case SDLK_b: // B: Step to previous frame
+                cur_stream->step_frame(1);
+                break;
+            case SDLK_r: // R: reverse playback x1 -> x2 -> x4 -> forward
+                {
+                    double speed = cur_stream->get_reverse_speed();
+                    speed = speed <= 0 ? 1 : (speed >= REVERSE_SPEED_MAX ? 0 : speed * 2);
+                    cur_stream->stream_reverse(speed);
+                }
                 break;
            
             case SDLK_PAGEUP:
@@ -169,7 +167,7 @@ void event_loop(VideoState *cur_stream)
                 incr = -60.0; 
             do_seek:
                     {
-                        pos = cur_stream->av_decoder.get_master_clock();
+                        pos = cur_stream->av_decoder.get_stream_position();
                         if (isnan(pos))
                             pos = (double) 0;
                         pos += incr;
@@ -275,6 +273,45 @@ int opt_sync(void *optctx, const char *opt, const char *arg)
     return 0;
 }
 
+int opt_packet_queue(void *optctx, const char *opt, const char *arg)
+{
+    if (!strcmp(arg, "list"))
+        PacketQueue::default_impl = PQ_IMPL_LINKED_LIST;
+    else if (!strcmp(arg, "ring"))
+        PacketQueue::default_impl = PQ_IMPL_SPSC_RING;
+    else {
+        av_log(NULL, AV_LOG_ERROR, "Unknown value for %s: %s\n", opt, arg);
+        exit(1);
+    }
+    return 0;
+}
+
+static DecoderProfile opt_video_profile;
+
+int opt_video_profile_preset(void *optctx, const char *opt, const char *arg)
+{
+    if (opt_video_profile.load_preset(arg)) {
+        av_log(NULL, AV_LOG_ERROR, "Unknown value for %s: %s\n", opt, arg);
+        exit(1);
+    }
+    return 0;
+}
+
+int opt_video_thread_type(void *optctx, const char *opt, const char *arg)
+{
+    if (!strcmp(arg, "frame"))
+        opt_video_profile.thread_type = FF_THREAD_FRAME;
+    else if (!strcmp(arg, "slice"))
+        opt_video_profile.thread_type = FF_THREAD_SLICE;
+    else if (!strcmp(arg, "both"))
+        opt_video_profile.thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    else {
+        av_log(NULL, AV_LOG_ERROR, "Unknown value for %s: %s\n", opt, arg);
+        exit(1);
+    }
+    return 0;
+}
+
 int opt_seek(void *optctx, const char *opt, const char *arg)
 {
     opt_start_time = parse_time_or_die(opt, arg, 1);
@@ -287,6 +324,85 @@ int parse_opt_duration(void *optctx, const char *opt, const char *arg)
     return 0;
 }
 
+// {{ micro-benchmark of pkt ingestion (ES callback of camera SDK): av_malloc + memcpy + av_packet_from_data, 
+// vs. SimpleAVDecoder::make_pooled_pkt() and SimpleAVDecoder::wrap_pkt().
+// pkt sizes vary around the given one, and a queue's worth of pkts is alive at any time, like in a packet queue.
+#define BENCH_INGEST_PKTS       200000
+#define BENCH_INGEST_QUEUED     64
+
+enum { INGEST_MALLOC, INGEST_POOLED, INGEST_WRAP };
+
+static void bench_ingest_release(void* opaque, uint8_t* data)
+{
+    (*(int64_t*)opaque)++;
+}
+
+static int64_t bench_ingest_run(SimpleAVDecoder* av_decoder, int how, const uint8_t* src, int pkt_size, int64_t* bytes)
+{
+    AVPacket queued[BENCH_INGEST_QUEUED];
+    memset(queued, 0, sizeof(queued));
+    int64_t releases = 0;
+    unsigned seed = 1;
+    *bytes = 0;
+
+    int64_t start = av_gettime_relative();
+    for (int i = 0; i < BENCH_INGEST_PKTS; i++) {
+        AVPacket* pkt = &queued[i % BENCH_INGEST_QUEUED];
+        av_packet_unref(pkt);   // the oldest one, done by decoder
+
+        seed = seed * 1103515245 + 12345;
+        int size = pkt_size / 4 + (int)(seed >> 8) % (pkt_size * 7 / 4 + 1);  // [1/4, 2] of pkt_size
+
+        if (INGEST_MALLOC == how) {
+            uint8_t* data = (uint8_t*)av_malloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+            memcpy(data, src, size);
+            memset(data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+            av_init_packet(pkt);
+            av_packet_from_data(pkt, data, size);
+        }
+        else if (INGEST_POOLED == how) {
+            av_decoder->make_pooled_pkt(pkt, src, size);
+        }
+        else {
+            SimpleAVDecoder::wrap_pkt(pkt, (uint8_t*)src, size, bench_ingest_release, &releases);
+        }
+        *bytes += size;
+    }
+    int64_t elapsed = av_gettime_relative() - start;
+
+    for (int i = 0; i < BENCH_INGEST_QUEUED; i++)
+        av_packet_unref(&queued[i]);
+    return elapsed;
+}
+
+int opt_bench_ingest(void *optctx, const char *opt, const char *arg)
+{
+    int pkt_size = (int)parse_number_or_die(opt, arg, OPT_INT, 16, 8 * 1024 * 1024);
+    uint8_t* src = (uint8_t*)av_mallocz(pkt_size * 2 + AV_INPUT_BUFFER_PADDING_SIZE);
+    SimpleAVDecoder* av_decoder = new SimpleAVDecoder();
+    const char* names[] = { "malloc", "pooled", "wrap" };
+
+    printf("%d pkts of %d bytes on average, %d alive at a time\n", BENCH_INGEST_PKTS, pkt_size * 9 / 8, BENCH_INGEST_QUEUED);
+    for (int how = INGEST_MALLOC; how <= INGEST_WRAP; how++) {
+        int64_t bytes;
+        bench_ingest_run(av_decoder, how, src, pkt_size, &bytes);   // warm up
+        int64_t elapsed = bench_ingest_run(av_decoder, how, src, pkt_size, &bytes);
+        printf("%-8s %10.1f ns/pkt %10.1f MB/s\n", names[how], elapsed * 1000.0 / BENCH_INGEST_PKTS
+            , elapsed ? bytes / (double)elapsed : 0.0);
+    }
+
+    PacketBufferPoolStats stats;
+    av_decoder->get_ingest_pool_stats(&stats);
+    printf("pool: %lld gets, %lld allocs, %lld oversize\n", (long long)stats.nb_gets, (long long)stats.nb_allocs
+        , (long long)stats.nb_oversize);
+
+    delete av_decoder;
+    av_free(src);
+    exit(0);
+    return 0;
+}
+// }}
+
 
 void opt_input_file(void *optctx, const char *filename)
 {
@@ -302,6 +418,16 @@ void opt_input_file(void *optctx, const char *filename)
 }
 
 static int dummy;
+static float opt_live_max_delay = 0;
+static int opt_video_fq_depth = 0;
+static int opt_video_fq_max_depth = 0;
+static int opt_video_degrade = 0;
+static int opt_video_step_history = STEP_HISTORY_FRAMES;
+static int opt_accurate_seek = 0;
+static int opt_video_auto_lowres = 0;
+static int opt_all_video = 0;
+static int opt_subtitle_disable = 0;
+static int opt_es_feed = 0;
 
 static const OptionDef options[] = {
 #if defined(__GNUC__) 
@@ -313,6 +439,29 @@ static const OptionDef options[] = {
     { "drp", OPT_INT | HAS_ARG | OPT_EXPERT, { &opt_decoder_reorder_pts }, "let decoder reorder pts 0=off 1=on -1=auto", ""},
     { "sync", HAS_ARG | OPT_EXPERT, { .func_arg = opt_sync }, "set audio-video sync. type (type=audio/video/ext)", "type" },
     { "autoexit", OPT_BOOL | OPT_EXPERT, { &opt_autoexit }, "exit at the end", "" },
+    { "pktq", HAS_ARG | OPT_EXPERT, { .func_arg = opt_packet_queue }, "set packet queue implementation (type=list/ring)", "type" },
+    { "framepool", OPT_BOOL | OPT_EXPERT, { &FrameBufferPool::default_enabled }, "decode into pooled frame buffers (-noframepool to disable)", "" },
+    { "hugepages", OPT_BOOL | OPT_EXPERT, { &FrameBufferPool::default_huge_pages }, "back big frame buffers with huge pages", "" },
+    { "codeccache", OPT_INT | HAS_ARG | OPT_EXPERT, { &CodecContextCache::max_entries }, "keep this many closed codec contexts for reuse by streams of the same codec (0=off)", "count" },
+    { "decodepool", OPT_BOOL | OPT_EXPERT, { &DecodePool::default_enabled }, "run decoders as tasks on a shared worker pool instead of a thread each", "" },
+    { "vfq", OPT_INT | HAS_ARG | OPT_EXPERT, { &opt_video_fq_depth }, "set depth of video frame queue (0=default)", "frames" },
+    { "vfq_max", OPT_INT | HAS_ARG | OPT_EXPERT, { &opt_video_fq_max_depth }, "let video frame queue depth adapt up to this (grow on late drops, shrink on low memory)", "frames" },
+    { "vprofile", HAS_ARG | OPT_VIDEO, { .func_arg = opt_video_profile_preset }, "set video decoder profile (type=latency/throughput)", "type" },
+    { "vthreads", OPT_INT | HAS_ARG | OPT_VIDEO | OPT_EXPERT, { &opt_video_profile.thread_count }, "set video decoder threads (0=auto)", "count" },
+    { "vthread_type", HAS_ARG | OPT_VIDEO | OPT_EXPERT, { .func_arg = opt_video_thread_type }, "set video decoder thread type (type=frame/slice/both)", "type" },
+    { "skiploop", OPT_INT | HAS_ARG | OPT_VIDEO | OPT_EXPERT, { &opt_video_profile.skip_loop_filter }, "skip loop filter for these frames (AVDiscard: 0=default 8=nonref 16=bidir 24=nonintra 32=nonkey 48=all)", "discard" },
+    { "sn", OPT_BOOL, { &opt_subtitle_disable }, "disable subtitling", "" },
+    { "bench_ingest", HAS_ARG | OPT_EXPERT, { .func_arg = opt_bench_ingest }, "benchmark pkt ingestion paths (malloc/pooled/wrap) with pkts of about this size, then exit", "bytes" },
+    { "esfeed", OPT_BOOL | OPT_VIDEO | OPT_EXPERT, { &opt_es_feed }, "feed file as raw video ES (H.264/H.265/MJPEG) in byte chunks, its codec told by sniffing", "" },
+    { "allvideo", OPT_BOOL | OPT_VIDEO, { &opt_all_video }, "show every video stream (e.g. camera angles), one tile each", "" },
+    { "autolowres", OPT_BOOL | OPT_VIDEO | OPT_EXPERT, { &opt_video_auto_lowres }, "decode at lower resolution when the window is small (codecs supporting lowres only)", "" },
+    { "lowres", OPT_INT | HAS_ARG | OPT_VIDEO | OPT_EXPERT, { &opt_video_profile.lowres }, "decode at 1/2^n resolution", "n" },
+    { "fast", OPT_BOOL | OPT_VIDEO | OPT_EXPERT, { &opt_video_profile.fast }, "non spec compliant optimizations", "" },
+    { "intra_workers", OPT_INT | HAS_ARG | OPT_VIDEO | OPT_EXPERT, { &opt_video_profile.intra_workers }, "decode intra-only video (MJPEG, ProRes...) on that many codec contexts at once", "count" },
+    { "accurate_seek", OPT_BOOL | OPT_EXPERT, { &opt_accurate_seek }, "seek to the exact frame/sample instead of the keyframe before it", "" },
+    { "stephistory", OPT_INT | HAS_ARG | OPT_EXPERT, { &opt_video_step_history }, "keep this many shown frames for stepping back (0=off)", "frames" },
+    { "degrade", OPT_BOOL | OPT_VIDEO | OPT_EXPERT, { &opt_video_degrade }, "degrade video decoding step by step when it can't keep up (skip loop filter ... keyframe only)", "" },
+    { "live_max_delay", OPT_FLOAT | HAS_ARG | OPT_EXPERT, { &opt_live_max_delay }, "for realtime input, drop GOPs when more than this is queued (0=off)", "seconds" },
     { "i", OPT_BOOL, { &dummy}, "read specified file", "input_file"},    
 #endif
     { NULL, },
@@ -347,7 +496,11 @@ void show_help_default(const char *opt, const char *arg)
            "9, 0                decrease and increase volume respectively\n"
            "/, *                decrease and increase volume respectively\n"
            "s                   activate frame-step mode\n"
+           "b                   step to previous frame\n"
+           "r                   reverse playback x1 -> x2 -> x4 -> forward again\n"
+           "-, +                halve/double playback speed (reverse speed while playing backwards)\n"
            "left/right          seek backward/forward 10 seconds or to custom interval if -seek_interval is set\n"
+           "                    (while playing backwards, reverse playback restarts from there)\n"
            "down/up             seek backward/forward 1 minute\n"
            "page down/page up   seek backward/forward 10 minutes\n"
            "right mouse click   seek to percentage in file corresponding to fraction of width\n"
@@ -399,6 +552,9 @@ int main(int argc, char **argv)
     is->streamopt_start_time = opt_start_time;
     is->streamopt_duration   = opt_duration;
     is->streamopt_autoexit = opt_autoexit;
+    is->streamopt_all_video = opt_all_video;
+    is->streamopt_subtitle_disable = opt_subtitle_disable;
+    is->streamopt_es_feed = opt_es_feed;
     
     // init decoder
     is->av_decoder.render = RenderBase::create_sdl_render() ;
@@ -416,6 +572,14 @@ int main(int argc, char **argv)
     is->av_decoder.show_status = opt_show_status;
     is->av_decoder.set_master_sync_type(opt_av_sync_type);
     is->av_decoder.decoder_reorder_pts = opt_decoder_reorder_pts;
+    if (opt_live_max_delay > 0)
+        is->av_decoder.set_live_overflow_policy(opt_live_max_delay, 0);
+    is->av_decoder.viddec.set_frame_queue_depth(opt_video_fq_depth, opt_video_fq_max_depth);
+    is->av_decoder.video_profile = opt_video_profile;
+    is->av_decoder.viddec.enable_degrade(opt_video_degrade);
+    is->av_decoder.viddec.set_step_history(opt_video_step_history, STEP_HISTORY_BYTES);
+    is->av_decoder.set_accurate_seek(opt_accurate_seek);
+    is->av_decoder.viddec.enable_auto_lowres(opt_video_auto_lowres);
     
     // open media
     if (is->open_input_stream(opt_input_filename, NULL)) {
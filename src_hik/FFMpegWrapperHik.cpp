@@ -10,6 +10,12 @@
 #define HIK_NVR_PASS "12345"
 #define HIK_NVR_CHAN_TO_PLAY 34
 
+// live-cast: if decoder falls behind more than this, drop GOPs to catch up
+#define HIK_LIVE_MAX_DELAY      (2.0)               // in seconds
+#define HIK_LIVE_MAX_QUEUE_SIZE (8 * 1024 * 1024)   // in bytes
+// Stop()/Play() to another camera reuses the H264 codec context, instead of opening it from scratch
+#define HIK_CODEC_CACHE_SIZE    2
+
 //#define TRACE_FRAMES (1)
 
 #if defined(_WIN32) && defined(_DEBUG) 
@@ -69,6 +75,7 @@ int  DecoderFFMpegWrapper::Init(DecoderEventCB* event_cb)
 
 	av_decoder.render = render;
 	av_decoder.set_master_sync_type(AV_SYNC_EXTERNAL_CLOCK );
+	CodecContextCache::max_entries = FFMAX(CodecContextCache::max_entries, HIK_CODEC_CACHE_SIZE);
 	//vs->av_decoder.set_master_sync_type(AV_SYNC_AUDIO_MASTER);
 
 	guard2.dismiss();
@@ -148,6 +155,7 @@ void DecoderFFMpegWrapper::Close(void)
 		login_ssesion = -1;
 	}
 	
+	av_decoder.hold_picture(0);	// no camera follows
 	av_decoder.close_all_stream();
 }
 
@@ -176,6 +184,24 @@ int  DecoderFFMpegWrapper::Play(HWND  screen)
 	preview_info.byProtoType = 0; //应用层取流协议：0- 私有协议，1- RTSP协议。
 
 	
+	{
+		StreamParam  extra_para = { 0 };
+		extra_para.start_time = av_gettime_relative(); // we are live-casting
+		extra_para.time_base = av_make_q(1, AV_TIME_BASE);
+		extra_para.guessed_vframe_rate = av_make_q(1, 25);
+
+		DecoderProfile profile;
+		profile.load_preset("latency");   // live-casting
+
+		// H.264 or H.265, up to how the camera is set. told by the first I frame, see handle_hik_ES_cb()
+		if (av_decoder.open_es(&extra_para, &profile))
+		{
+			goto FAILED;
+		}
+
+		av_decoder.set_live_overflow_policy(HIK_LIVE_MAX_DELAY, HIK_LIVE_MAX_QUEUE_SIZE);
+	}
+
 	//start 'real play' 
 	play_handle = NET_DVR_RealPlay_V40(login_ssesion, &preview_info, NULL, NULL);
 
@@ -192,33 +218,8 @@ int  DecoderFFMpegWrapper::Play(HWND  screen)
 		goto FAILED;
 	}
 
-	{
-		AVCodecParameters codec_para;
-		memset((void*)&codec_para, 0, sizeof codec_para);
-		codec_para.codec_id = AV_CODEC_ID_H264;  // yes, must be figured out manually.
-		codec_para.codec_type = AVMEDIA_TYPE_VIDEO;
-
-		StreamParam  extra_para = { 0 };
-		extra_para.start_time = av_gettime_relative(); // we are live-casting
-		extra_para.time_base = av_make_q(1, AV_TIME_BASE);
-		extra_para.guessed_vframe_rate = av_make_q(1, 25);
-
-		Decoder * decoder = &av_decoder.viddec;
-
-		AVCodecContext* codec_context = Decoder::create_codec_directly(&codec_para, &extra_para);
-		if (!codec_context)
-		{
-			goto FAILED;
-		}
-
-		if (decoder->decoder_init(codec_context, &extra_para))
-		{
-			goto FAILED;
-		}
-
-	}
-	
 	render-> attach_to_window(screen);
+	av_decoder.toggle_need_drawing(1);	// held picture, if any, while the new camera warms up
 
 	if (av_decoder.is_paused())
 	{
@@ -235,6 +236,8 @@ FAILED:
 		NET_DVR_StopRealPlay(play_handle);
 		play_handle = -1;
 	}
+	av_decoder.hold_picture(0);	// nothing to swap with
+	av_decoder.close_all_stream();
 
 	return 1;
 }
@@ -289,24 +292,13 @@ void DecoderFFMpegWrapper::handle_hik_ES_cb(LONG lPreviewHandle, NET_DVR_PACKET_
 		_dot_count = 0;
 	}
 #endif
-	unsigned char * pkt_data = (unsigned char*)av_malloc(pstruPackInfo->dwPacketSize + AV_INPUT_BUFFER_PADDING_SIZE);
-	if (!pkt_data)
-	{
-		LOG_ERROR("not enough memory for new AvPacket\n");
-		return;
-	}
-
-	memcpy(pkt_data, pstruPackInfo->pPacketBuffer, pstruPackInfo->dwPacketSize);
-
-
+	// SDK reuses its buffer once we return, so a copy is a must. a recycled one, no allocator traffic here
 	AVPacket packet;
-	av_init_packet(&packet);
-
-	int r = av_packet_from_data(&packet, pkt_data, pstruPackInfo->dwPacketSize);
+	int r = av_decoder.make_pooled_pkt(&packet, pstruPackInfo->pPacketBuffer, pstruPackInfo->dwPacketSize);
 	if (r)
 	{
-		LOG_WARN("failed in av_packet_from_data \n");
-		return ;
+		LOG_ERROR("not enough memory for new AvPacket\n");
+		return;
 	}
 
 	// in unit of millisecond 
@@ -314,7 +306,19 @@ void DecoderFFMpegWrapper::handle_hik_ES_cb(LONG lPreviewHandle, NET_DVR_PACKET_
 
 	packet.pts = hik_ts*1000; //  ffmpeg requires pts in 'us' unit
 
-	av_decoder.feed_pkt(&packet, &extra);
+	if (1 == pstruPackInfo->dwPacketType || PSI_AUDIO == extra.v_or_a)
+	{
+		packet.flags |= AV_PKT_FLAG_KEY;  // overflow policy resyncs only at keyframe
+	}
+
+	if (PSI_VIDEO == extra.v_or_a)
+	{
+		av_decoder.feed_es(&packet);
+	}
+	else
+	{
+		av_decoder.feed_pkt(&packet, &extra);
+	}
 }
 
 int  DecoderFFMpegWrapper::Pause()  
@@ -342,6 +346,7 @@ int  DecoderFFMpegWrapper::Stop()
 		av_decoder.internal_toggle_pause();
 	}
 	av_decoder.discard_buffer(0);
+	av_decoder.hold_picture(1);	// shown till the camera of next Play() has its first frame
 	av_decoder.close_all_stream();
 
 	WinRender* render = (WinRender*)av_decoder.render;
@@ -51,6 +51,15 @@ public:
 	{
 		return DEC_NOT_SUPPORTED;
 	}
+
+	virtual int  Reverse(int speed)	 //倒放, speed: 1 - 4 倍速; 0 -- 恢复正放
+	{
+		return DEC_NOT_SUPPORTED;
+	}
+	virtual int  GetReverseSpeed(int * speed)	// 0 -- 正放
+	{
+		return DEC_NOT_SUPPORTED;
+	}
 	
 		
 	//virtual int SetPlayPos(int  percentage);        //设置文件当前播放位置（百分比）
@@ -113,6 +113,7 @@ int  DecoderFFMpegWrapper::Open(const char* fileName)
 	if (vs->open_input_stream(fileName, NULL, 1)) 
 	{
 		LOG_ERROR( "Failed to open '%s'.\n", fileName);
+		vs->av_decoder.hold_picture(0);	// nothing to swap with
 		return 1;
 	}
 	return 0;
@@ -125,6 +126,7 @@ void DecoderFFMpegWrapper::Close(void)
 	_width = 0;
 	_height = 0;
 
+	vs->av_decoder.hold_picture(1);	// shown till the file of next Open()/Play() has its first frame
 	vs->close_input_stream();
 }
 
@@ -143,6 +145,7 @@ int  DecoderFFMpegWrapper::Play(HWND  screen)
 	CHECK_IF_MEDIA_PRESENT(1);
 	WinRender* render = (WinRender*)vs->av_decoder.render;
 	render-> attach_to_window(screen);
+	vs->av_decoder.toggle_need_drawing(1);	// held picture, if any, while the new file warms up
 
 	vs->toggle_pause();
 	return 0;
@@ -177,6 +180,18 @@ int  DecoderFFMpegWrapper::Stop()
 
 int  DecoderFFMpegWrapper::Faster()	 
 {
+	double reverse_speed = vs->get_reverse_speed();
+	if (reverse_speed > 0)
+	{
+		if (reverse_speed >= REVERSE_SPEED_MAX)
+		{
+			LOG_ERROR("reverse speed range [1, %d]\n", (int)REVERSE_SPEED_MAX);
+			return 1;
+		}
+		vs->stream_reverse(reverse_speed * 2);
+		return 0;
+	}
+
 	if (_speed >= 4)
 	{
 		LOG_ERROR("speed randge [-4, +4]\n");
@@ -184,27 +199,28 @@ int  DecoderFFMpegWrapper::Faster()
 	}
 	_speed++;
 
-	double cur_speed = vs->av_decoder.get_decoder_clock()->get_clock_speed();
+	double cur_speed = vs->av_decoder.get_playback_speed();
 	double speed = 2 * cur_speed;
 	debug_printf(" speed: %.3f -> %.3f\n", cur_speed, speed);
-	vs->av_decoder.get_decoder_clock()->set_clock_speed(speed);
-
-	if (!float_equal(speed, 1.0))
-	{
-		vs->av_decoder.set_master_sync_type(AV_SYNC_EXTERNAL_CLOCK);
-	}
-	else
-	{
-		vs->av_decoder.set_master_sync_type(AV_SYNC_AUDIO_MASTER);
-	}
-
-	vs->av_decoder.get_decoder_clock()->set_clock_speed(speed);
+	vs->av_decoder.set_playback_speed(speed);
 	
 	return 0;
 }
 
 int  DecoderFFMpegWrapper::Slower()	 
 {
+	double reverse_speed = vs->get_reverse_speed();
+	if (reverse_speed > 0)
+	{
+		if (reverse_speed <= 1)
+		{
+			LOG_ERROR("reverse speed range [1, %d]\n", (int)REVERSE_SPEED_MAX);
+			return 1;
+		}
+		vs->stream_reverse(reverse_speed / 2);
+		return 0;
+	}
+
 	if (_speed <= -4)
 	{
 		LOG_ERROR("speed randge [-4, +4]\n");
@@ -212,34 +228,46 @@ int  DecoderFFMpegWrapper::Slower()
 	}
 	_speed--;
 
-	double cur_speed = vs->av_decoder.get_decoder_clock()->get_clock_speed();
-	double speed = cur_speed / 2 ;
+	double cur_speed = vs->av_decoder.get_playback_speed();
+	double speed = cur_speed / 2;
 	debug_printf(" speed: %.3f -> %.3f\n", cur_speed, speed);
-	vs->av_decoder.get_decoder_clock()->set_clock_speed(speed);
+	vs->av_decoder.set_playback_speed(speed);
 
-	if (!float_equal(speed, 1.0))
-	{
-		vs->av_decoder.set_master_sync_type(AV_SYNC_EXTERNAL_CLOCK);
-	}
-	else
+	return 0;
+}
+
+int  DecoderFFMpegWrapper::GetSpeed(int* speed)	// [-4, +4]
+{
+	*speed = _speed;
+	return 0;
+}
+
+int  DecoderFFMpegWrapper::Reverse(int speed)	//倒放
+{
+	CHECK_IF_MEDIA_PRESENT(1);
+	if (speed < 0 || speed > REVERSE_SPEED_MAX)
 	{
-		vs->av_decoder.set_master_sync_type(AV_SYNC_AUDIO_MASTER);
+		LOG_ERROR("reverse speed range [0, %d]\n", (int)REVERSE_SPEED_MAX);
+		return 1;
 	}
 
-	vs->av_decoder.get_decoder_clock()->set_clock_speed(speed);
-
+	_speed = 0;
+	vs->stream_reverse(speed);
 	return 0;
 }
 
-int  DecoderFFMpegWrapper::GetSpeed(int* speed)	// [-4, +4]
+int  DecoderFFMpegWrapper::GetReverseSpeed(int* speed)
 {
-	*speed = _speed;
+	CHECK_IF_MEDIA_PRESENT(1);
+	*speed = (int)vs->get_reverse_speed();
 	return 0;
 }
 
 int  DecoderFFMpegWrapper::FrameForward(void)  //单帧向前
 {
-	LOG_ERROR("Not implemented\n");
+	CHECK_IF_MEDIA_PRESENT(1);
+
+	vs->step_frame(0);
 	_speed = 0;
 	return 0;
 }
@@ -247,17 +275,18 @@ int  DecoderFFMpegWrapper::FrameForward(void)  //单帧向前
 
 int  DecoderFFMpegWrapper::FrameBack(void)    //单帧向后	
 {
-	LOG_ERROR("Not implemented\n");
+	CHECK_IF_MEDIA_PRESENT(1);
+
+	vs->step_frame(1);	// 缓存内瞬时后退, 缓存用尽时重新解码前一个GOP
 	_speed = 0;
 	return 0;
-	
 }
 
 int DecoderFFMpegWrapper::GetPlayedTime(int* time_point)		//获取文件当前播放位置（秒）
 {
 	CHECK_IF_MEDIA_PRESENT(1);
 
-	double ts = vs->av_decoder.get_master_clock();
+	double ts = vs->av_decoder.get_stream_position();
 	if (isnan(ts))
 	{
 		*time_point = 0;
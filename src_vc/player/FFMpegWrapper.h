@@ -56,6 +56,9 @@ public:
 	virtual int  GetSpeed(int* speed);	// [-4, +4]
 	int _speed;
 
+	virtual int  Reverse(int speed);	//倒放, speed: 1 - 4 倍速; 0 -- 恢复正放
+	virtual int  GetReverseSpeed(int* speed);
+
 	virtual int  FrameBack(void);    //单帧向后	
 	virtual int  FrameForward(void);  //单帧向前
 
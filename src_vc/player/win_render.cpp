@@ -116,6 +116,11 @@ void WinRender::upload_and_draw_frame(Frame* vp)
 		return;
 	}
 
+	if (tile_count > 1 && tile_index != 0)
+	{
+		return;	// GDI 只画主通道, 多通道请用各自的窗口
+	}
+
 	AVFrame* frame = vp->frame;
 
 	if (need_pic_size)
@@ -174,6 +179,8 @@ void WinRender::draw_frame_gdi(uint8_t * rgb_buffer, int width, int height, HWND
 	GetWindowRect(hWnd, &rect);
 	LONG screen_w = rect.right - rect.left;
 	LONG screen_h = rect.bottom - rect.top;
+	this->screen_width = screen_w;		// 解码器据此选择 lowres
+	this->screen_height = screen_h;
 
 	//BMP Header
 	BITMAPINFO m_bmphdr = { 0 };
@@ -357,7 +364,7 @@ void WinRender::refresh_loop_wait_event(SimpleAVDecoder * av_decoder, /*SDL_Even
 			if ( 20 == refresh_count )
 			{
 				refresh_count = 0;
-				double ts = this->associated_decoder->get_master_clock();
+				double ts = this->associated_decoder->get_stream_position();
 				if (isnan(ts))
 				{
 					_event_cb->on_progress(0);
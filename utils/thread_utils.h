@@ -413,8 +413,14 @@ public:
     int timed_wait_ms(unsigned int ms)
 	{
         struct timespec time_to_wait = {0, 0};
-        time_to_wait.tv_sec = time(NULL) + ms / 1000; 
-        time_to_wait.tv_nsec =  1000* (ms % 1000); 
+        clock_gettime(CLOCK_REALTIME, &time_to_wait);
+        time_to_wait.tv_sec  += ms / 1000; 
+        time_to_wait.tv_nsec += 1000000L * (ms % 1000); 
+        if (time_to_wait.tv_nsec >= 1000000000L)
+        {
+            time_to_wait.tv_sec  ++;
+            time_to_wait.tv_nsec -= 1000000000L;
+        }
 
         int i = pthread_cond_timedwait(&_cond, &m_pthr_mutex, &time_to_wait ); 
         if (ETIMEDOUT ==i)